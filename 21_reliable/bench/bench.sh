@@ -0,0 +1,143 @@
+#!/bin/sh
+# Throughput benchmark over loopback. For every combination of window (-w),
+# timeout (-t, ns), corruption probability (-e, %) and payload (-b, bytes), one
+# end sends BYTES bytes of synthetic traffic to the other (--bytes), and the
+# results are taken from the TRANSFER lines both ends print when it completes.
+# A point that takes more than MAX_SECS is stopped. Every point runs REPEAT
+# times and the run with the median goodput is kept, since loopback is noisy.
+#
+# usage: bench/bench.sh [OUT]
+# Writes OUT.csv and OUT.json (default: bench/results). Every row has:
+#	elapsed_s	first block generated by the sender to the last one accepted by the receiver
+#	goodput_mbps	application bytes * 8 / elapsed_s
+#	efficiency	application bytes / bytes sent by the sender (headers and retransmissions included)
+#	retx_ratio	data packets sent again / data packets sent
+#	cpu_s_per_mb	CPU time of both ends (user + system) per MB transferred
+# Then every point is compared with the same one in BASELINE (a CSV written by a
+# previous run, default bench/baseline.csv; make bench-baseline stores one): the
+# run fails if goodput dropped, or CPU per MB grew, by more than THRESHOLD (%).
+#
+# Environment: WINDOWS, TIMEOUTS, ERRORS, PAYLOADS (space-separated values of the
+# matrix), BYTES, REPEAT, MAX_SECS, EXTRA (more options for both ends, e.g. "-r -k"),
+# BASELINE (empty: no comparison), THRESHOLD, PORT (the ends use PORT and PORT+1).
+
+WINDOWS=${WINDOWS:-1 16 64}
+TIMEOUTS=${TIMEOUTS:-1000000 10000000}
+ERRORS=${ERRORS:-0 1}
+PAYLOADS=${PAYLOADS:-500 1400}
+BYTES=${BYTES:-50000000}
+REPEAT=${REPEAT:-3}
+MAX_SECS=${MAX_SECS:-30}
+EXTRA=${EXTRA:-}
+BASELINE=${BASELINE-bench/baseline.csv}
+THRESHOLD=${THRESHOLD:-20}
+PORT=${PORT:-6611}
+BIN=${BIN:-./reliable}
+OUT=${1:-bench/results}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# run_point W T E B: prints a CSV row
+run_point() {
+	rm -f "$DIR/in.tx" "$DIR/in.rx"
+	mkfifo "$DIR/in.tx" "$DIR/in.rx"
+	opts="-s -w $1 -t $2 -e $3 -b $4 --bytes $BYTES $EXTRA"
+	# The receiver never gets enter: it only acknowledges
+	$BIN "$((PORT + 1))" "127.0.0.1:$PORT" $opts < "$DIR/in.rx" > "$DIR/rx.txt" 2>&1 &
+	rx=$!
+	exec 4> "$DIR/in.rx"
+	$BIN "$PORT" "127.0.0.1:$((PORT + 1))" $opts < "$DIR/in.tx" > "$DIR/tx.txt" 2>&1 &
+	tx=$!
+	exec 3> "$DIR/in.tx"
+	sleep 0.2 # Both listening
+
+	echo >&3
+	status=timeout
+	for i in $(seq $((MAX_SECS * 50))); do
+		if ! kill -0 "$tx" 2>/dev/null; then
+			status=exited
+			break
+		fi
+		sleep 0.02
+	done
+	# The sender leaves when its last block is acknowledged; the receiver would wait a bit more for retransmissions
+	kill -TERM "$tx" "$rx" 2>/dev/null
+	wait "$tx" "$rx" 2>/dev/null
+	exec 3>&- 4>&-
+	grep -h "Error" "$DIR/tx.txt" "$DIR/rx.txt" | head -3 >&2
+
+	# TRANSFER SENT: <bytes> bytes (...) in <s> s, ...; retransmissions: <n> (<pct>% ...); overhead: <ratio> ...; CPU: <s> s
+	# TRANSFER RECEIVED: <bytes> bytes (...) in <s> s, ...; CPU: <s> s
+	awk -v w="$1" -v t="$2" -v e="$3" -v b="$4" -v status="$status" '
+		/TRANSFER SENT:/ { for (i = 1; i <= NF; i++) { if ($i == "overhead:") over = $(i + 1); if ($i == "CPU:") ctx = $(i + 1) }
+			match($0, /\(([0-9.]+)% of the data/); retx = substr($0, RSTART + 1, RLENGTH - 13) / 100; sent = 1 }
+		/TRANSFER RECEIVED:/ { for (i = 1; i <= NF; i++) { if ($i == "RECEIVED:") bytes = $(i + 1); if ($i == "in") el = $(i + 1); if ($i == "CPU:") crx = $(i + 1) }
+			received = 1 }
+		END {
+			if (status == "exited" && !(sent && received))
+				status = "failed"
+			else if (status == "exited")
+				status = "ok"
+			printf "%s,%s,%s,%s,%.0f,%.6f,%.2f,%.4f,%.4f,%.3f,%.3f,%.4f,%s\n", w, t, e, b, bytes, el, (el > 0 ? bytes * 8 / el / 1e6 : 0),
+				(over > 0 ? 1 / over : 0), retx, ctx, crx, (bytes > 0 ? (ctx + crx) / (bytes / 1e6) : 0), status
+		}' "$DIR/tx.txt" "$DIR/rx.txt"
+}
+
+HEADER="window,timeout_ns,error_pct,payload,bytes,elapsed_s,goodput_mbps,efficiency,retx_ratio,cpu_tx_s,cpu_rx_s,cpu_s_per_mb,status"
+echo "$HEADER" > "$OUT.csv"
+echo "$HEADER" | tr ',' '\t'
+for w in $WINDOWS; do
+	for t in $TIMEOUTS; do
+		for e in $ERRORS; do
+			for b in $PAYLOADS; do
+				for r in $(seq "$REPEAT"); do
+					run_point "$w" "$t" "$e" "$b"
+				done > "$DIR/runs"
+				row=$(sort -t, -k7,7g "$DIR/runs" | sed -n "$(((REPEAT + 1) / 2))p")
+				echo "$row" >> "$OUT.csv"
+				echo "$row" | tr ',' '\t'
+			done
+		done
+	done
+done
+
+# The same rows as a JSON array of objects
+awk -F, 'NR == 1 { for (i = 1; i <= NF; i++) k[i] = $i; printf "["; next }
+	{ printf "%s\n  {", (NR > 2 ? "," : "")
+	  for (i = 1; i <= NF; i++) printf "%s\"%s\": %s", (i > 1 ? ", " : ""), k[i], (k[i] == "status" ? "\"" $i "\"" : $i)
+	  printf "}" }
+	END { print "\n]" }' "$OUT.csv" > "$OUT.json"
+echo "[results in $OUT.csv and $OUT.json]"
+
+if [ -z "$BASELINE" ]; then
+	exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+	echo "[no baseline in $BASELINE: make bench-baseline stores this run as the baseline]"
+	exit 0
+fi
+# Points are matched by window, timeout, error and payload; the ones missing on either side are skipped
+awk -F, -v th="$THRESHOLD" '
+	FNR == 1 { next }
+	NR == FNR { key = $1 "," $2 "," $3 "," $4; base_gp[key] = $7; base_cpu[key] = $12; next }
+	{
+		key = $1 "," $2 "," $3 "," $4
+		if (!(key in base_gp))
+			next
+		n++
+		why = ""
+		if ($13 != "ok")
+			why = "did not finish (" $13 ")"
+		else if ($7 < base_gp[key] * (1 - th / 100))
+			why = sprintf("goodput %.2f Mbps, baseline %.2f", $7, base_gp[key])
+		else if (base_cpu[key] > 0 && $12 > base_cpu[key] * (1 + th / 100))
+			why = sprintf("CPU %.4f s/MB, baseline %.4f", $12, base_cpu[key])
+		if (why != "") {
+			printf "REGRESSION -w %s -t %s -e %s -b %s: %s\n", $1, $2, $3, $4, why
+			bad++
+		}
+	}
+	END {
+		printf "[%d points compared with the baseline, %d regressions beyond %s%%]\n", n, bad, th
+		exit bad > 0
+	}' "$BASELINE" "$OUT.csv"
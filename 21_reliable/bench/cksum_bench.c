@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../checksum.h"
+
+/*
+	Throughput of the checksum kernels, in GB/s, for packet-sized buffers:
+		- bytepair: the former cksum() loop, 2 bytes per iteration,
+		- scalar / sse2 / avx2: one's complement sum kernels (same result),
+		- crc32c: table driven and with the SSE4.2 crc32 instruction.
+	Before measuring, every kernel is checked against bytepair (or crc32c
+	against each other) on random buffers of every length up to 2 KB.
+*/
+
+#define TOTAL_BYTES (256 << 20) /* Bytes processed per measurement */
+
+static uint8_t buf[65536];
+static volatile uint64_t sink; /* Keeps the measured loops from being optimized away */
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t run_bytepair(const void *d, size_t n) { return csum_bytepair(d, n); }
+static uint32_t run_scalar(const void *d, size_t n) { return csum_fold(csum_partial_scalar(d, n, 0)); }
+static uint32_t run_sse2(const void *d, size_t n) { return csum_fold(csum_partial_sse2(d, n, 0)); }
+static uint32_t run_avx2(const void *d, size_t n) { return csum_fold(csum_partial_avx2(d, n, 0)); }
+static uint32_t run_crc_sw(const void *d, size_t n) { return crc32c_sw(0, d, n); }
+static uint32_t run_crc_hw(const void *d, size_t n) { return crc32c_hw(0, d, n); }
+
+enum
+{
+	CPU_ANY,
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_SSE42
+};
+
+static const struct
+{
+	const char *name;
+	uint32_t (*run)(const void *, size_t);
+	int cpu; /* Required CPU feature */
+} kernels[] = {
+	{"bytepair", run_bytepair, CPU_ANY},
+	{"scalar", run_scalar, CPU_ANY},
+	{"sse2", run_sse2, CPU_SSE2},
+	{"avx2", run_avx2, CPU_AVX2},
+	{"crc32c-table", run_crc_sw, CPU_ANY},
+	{"crc32c-sse4.2", run_crc_hw, CPU_SSE42},
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static int supported(int k)
+{
+	switch (kernels[k].cpu)
+	{
+#ifdef __x86_64__
+	case CPU_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case CPU_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case CPU_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+#endif
+	case CPU_ANY:
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = {64, 512, 1500, 9000, 65536};
+	uint64_t t0;
+	size_t n, off;
+	int s, k, i, iters;
+
+	srand(1);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	// The results must agree, for every length and alignment
+	for (n = 0; n <= 2048; n++)
+	{
+		off = n % 7;
+		for (k = 1; k < NKERNELS; k++)
+		{
+			if (!supported(k))
+				continue;
+			if (k < 4 && kernels[k].run(buf + off, n) != run_bytepair(buf + off, n))
+			{
+				printf("%s differs from bytepair for %zu bytes\n", kernels[k].name, n);
+				return 1;
+			}
+			if (k >= 4 && kernels[k].run(buf + off, n) != run_crc_sw(buf + off, n))
+			{
+				printf("%s differs from crc32c-table for %zu bytes\n", kernels[k].name, n);
+				return 1;
+			}
+		}
+	}
+
+	printf("%8s", "bytes");
+	for (k = 0; k < NKERNELS; k++)
+		printf(" %14s", kernels[k].name);
+	printf("   (GB/s)\n");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		printf("%8d", sizes[s]);
+		iters = TOTAL_BYTES / sizes[s];
+		for (k = 0; k < NKERNELS; k++)
+		{
+			if (!supported(k))
+			{
+				printf(" %14s", "-");
+				continue;
+			}
+			t0 = now_ns();
+			for (i = 0; i < iters; i++)
+				sink += kernels[k].run(buf, sizes[s]);
+			printf(" %14.2f", (double)iters * sizes[s] / (now_ns() - t0));
+		}
+		printf("\n");
+	}
+	return 0;
+}
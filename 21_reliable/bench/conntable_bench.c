@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../rlib.h"
+#include "../conntable.h"
+
+/*
+	Self-check and microbenchmark for the connection table of -n. First, random
+insert/remove operations on a small table (many keys share an address, and the
+load is kept near its maximum, so runs of slots often wrap around the end and
+removal has to shift them back) are checked after every step: every key must
+be found if and only if it is in a linear array of the keys inserted, and
+random lookups must agree with a scan of that array; a mismatch exits with
+status 1. Then, for an increasing number of connections, it reports the cost
+of a lookup in the table and of a linear scan.
+*/
+
+#define CHECK_KEYS 256
+#define CHECK_OPS 1000000
+#define ITERATIONS 200000
+
+/* The runtime's versions live in rlib.c; these only know IPv4, all the bench uses */
+int addreq(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+
+	return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+}
+
+uint32_t addrhash(const struct sockaddr_storage *ss)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+
+	return sin->sin_addr.s_addr * 31 + sin->sin_port;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Key i: one of 8 peers (address and port), connection ID i / 8 */
+static void make_keys(struct conn_key *keys, int n)
+{
+	struct sockaddr_in *sin;
+	int i;
+
+	memset(keys, 0, n * sizeof(*keys));
+	for (i = 0; i < n; i++)
+	{
+		sin = (struct sockaddr_in *)&keys[i].addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(0x0a000001 + i % 8);
+		sin->sin_port = htons(5000 + i % 8);
+		keys[i].id = i / 8;
+	}
+}
+
+/* Reference: the keys in the table, in no order */
+static struct conn_key *linear_find(struct conn_key **present, int n, const struct sockaddr_storage *addr, uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (present[i]->id == id && addreq(&present[i]->addr, addr))
+			return present[i];
+	return NULL;
+}
+
+static int check_ops()
+{
+	static struct conn_key keys[CHECK_KEYS];
+	static struct conn_key *present[CHECK_KEYS];
+	static int where[CHECK_KEYS]; /* Position of each key in present, -1 if it is not in the table */
+	struct conn_table t;
+	struct conn_key *k, *found;
+	int op, i, j, n = 0, limit, changed;
+
+	make_keys(keys, CHECK_KEYS);
+	for (i = 0; i < CHECK_KEYS; i++)
+		where[i] = -1;
+	ct_init(&t, 1); // Grows during the run
+	srand(1);
+	for (op = 0; op < CHECK_OPS; op++)
+	{
+		// The load switches between half and all the keys, so the table grows and then sits near half full
+		limit = CHECK_KEYS / 2 + (CHECK_KEYS / 2) * ((op / 50000) % 2);
+		i = rand() % CHECK_KEYS;
+		k = &keys[i];
+		changed = 0;
+		if (where[i] < 0 && n < limit)
+		{
+			ct_insert(&t, k);
+			where[i] = n;
+			present[n++] = k;
+			changed = 1;
+		}
+		else if (where[i] >= 0 && rand() % 2)
+		{
+			ct_remove(&t, k);
+			j = where[i];
+			present[j] = present[--n];
+			where[present[j] - keys] = j;
+			where[i] = -1;
+			changed = 1;
+		}
+		for (j = 0; changed && j < CHECK_KEYS; j++)
+		{
+			if (ct_find(&t, &keys[j].addr, keys[j].id) != (where[j] >= 0 ? &keys[j] : NULL))
+			{
+				printf("ct_find id %u: %s, expected %s (%d keys, op %d)\n", keys[j].id, where[j] >= 0 ? "not found" : "found",
+					   where[j] >= 0 ? "found" : "not found", n, op);
+				return 1;
+			}
+		}
+		for (j = 0; j < 4; j++)
+		{
+			k = &keys[rand() % CHECK_KEYS];
+			found = ct_find(&t, &k->addr, k->id);
+			if (found != linear_find(present, n, &k->addr, k->id))
+			{
+				printf("ct_find id %u: %s, expected %s (%d keys, op %d)\n", k->id, found ? "found" : "not found", found ? "not found" : "found", n, op);
+				return 1;
+			}
+		}
+		if (t.count != n)
+		{
+			printf("conn_table count %d, expected %d (op %d)\n", t.count, n, op);
+			return 1;
+		}
+	}
+	free(t.slots);
+	free(t.hashes);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = {16, 1000, 10000, 100000};
+	struct conn_table t;
+	struct conn_key *keys, **present, *k;
+	uint64_t t0;
+	double table_ns, scan_ns;
+	int s, i, n;
+	long sink = 0;
+
+	if (check_ops())
+		return 1;
+
+	printf("%8s %16s %16s\n", "conns", "table ns/find", "scan ns/find");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		n = sizes[s];
+		keys = malloc(n * sizeof(*keys));
+		present = malloc(n * sizeof(*present));
+		make_keys(keys, n);
+		ct_init(&t, n);
+		for (i = 0; i < n; i++)
+		{
+			ct_insert(&t, &keys[i]);
+			present[i] = &keys[i];
+		}
+
+		t0 = now_ns();
+		for (i = 0; i < ITERATIONS; i++)
+		{
+			k = &keys[(i * 7919L) % n];
+			sink += ct_find(&t, &k->addr, k->id) == k;
+		}
+		table_ns = (double)(now_ns() - t0) / ITERATIONS;
+
+		t0 = now_ns();
+		for (i = 0; i < ITERATIONS / (n / 16 + 1) + 1; i++)
+		{
+			k = &keys[(i * 7919L) % n];
+			sink += linear_find(present, n, &k->addr, k->id) == k;
+		}
+		scan_ns = (double)(now_ns() - t0) / i;
+
+		printf("%8d %16.1f %16.1f\n", n, table_ns, scan_ns);
+		free(t.slots);
+		free(t.hashes);
+		free(keys);
+		free(present);
+	}
+	return sink == 42; /* Keeps the measured loops from being optimized away */
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Many concurrent synthetic flows over loopback: two ends run in multi-connection
+# mode (-n), each opening FLOWS connections to the other, for SECS seconds. Extra
+# arguments go to both ends (e.g. -g, -c reno, -j 4 --pin).
+#
+# usage: bench/flows_bench.sh [FLOWS [SECS [options...]]]
+# The statistics printed at the end are the ones of the last report (every 10 s);
+# with worker threads (-j), the total is the sum of the last report of every worker.
+
+FLOWS=${1:-10000}
+SECS=${2:-22}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+BIN=${BIN:-./reliable}
+OPTS="-s -w 4 -r -n $FLOWS $*"
+OUT=$(mktemp -d)
+
+(sleep 0.2; echo; sleep "$SECS") | timeout "$((SECS + 1))" "$BIN" 6601 127.0.0.1:6602 $OPTS > "$OUT/a.txt" 2>&1 &
+(sleep 0.4; echo; sleep "$SECS") | timeout "$((SECS + 1))" "$BIN" 6602 127.0.0.1:6601 $OPTS > "$OUT/b.txt" 2>&1
+wait
+
+echo "$FLOWS flows per end, $SECS s, options: $OPTS"
+for end in a b; do
+	echo "End $end:"
+	if grep -q "WORKER" "$OUT/$end.txt"; then
+		awk '/WORKER [0-9]+:/ { w = $2 }
+			/RX STATS/ { v = $(NF - 1); u = $NF
+				if (u == "kbps") v /= 1000; else if (u == "bps") v /= 1000000; else if (u == "Gbps") v *= 1000
+				rx[w] = v }
+			/Error/ { print }
+			END { for (w in rx) { n++; t += rx[w] }
+				printf "\tRX app. level: %.2f Mbps in total, %d workers\n", t, n }' "$OUT/$end.txt"
+	else
+		grep -E "Error|CONN STATS|TX STATS|RX STATS" "$OUT/$end.txt" | tail -3
+	fi
+done
+rm -rf "$OUT"
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../scoreboard.h"
+
+/*
+	Self-check and microbenchmark for the SACK scoreboard. First, random
+set/clear/clear_range/find_first_zero/count/extract operations on a window
+that slides around the ring (and across the 32-bit seqno wrap) are checked
+against a plain array of one byte per bit; a mismatch exits with status 1.
+Then, for several window sizes, it reports the cost of sb_find_first_zero over
+a window with a single hole at its end, a word at a time and bit by bit.
+*/
+
+#define CHECK_BITS 256
+#define CHECK_OPS 2000000
+#define ITERATIONS 200000
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Reference: bit of seqno s is plain[s % CHECK_BITS] */
+static unsigned char plain[CHECK_BITS];
+
+static int check_ops()
+{
+	struct scoreboard sb;
+	uint64_t out[CHECK_BITS / 64], want;
+	uint32_t base, from, to, s, r;
+	int op, i, n, count;
+
+	sb_init(&sb, CHECK_BITS);
+	srand(1);
+	base = UINT32_MAX - CHECK_BITS * 100; // Crosses the seqno wrap during the run
+	for (op = 0; op < CHECK_OPS; op++)
+	{
+		// A range inside the window [base, base + CHECK_BITS)
+		from = base + rand() % CHECK_BITS;
+		to = from + rand() % (base + CHECK_BITS - from + 1);
+		s = from;
+		switch (rand() % 7)
+		{
+		case 0:
+		case 1:
+			sb_set(&sb, s);
+			plain[s % CHECK_BITS] = 1;
+			break;
+		case 2:
+			sb_clear(&sb, s);
+			plain[s % CHECK_BITS] = 0;
+			break;
+		case 3:
+			sb_clear_range(&sb, from, to);
+			for (s = from; s != to; s++)
+				plain[s % CHECK_BITS] = 0;
+			break;
+		case 4:
+			for (s = from; s != to && plain[s % CHECK_BITS]; s++)
+				;
+			if ((r = sb_find_first_zero(&sb, from, to)) != s)
+			{
+				printf("sb_find_first_zero [%u, %u): %u, expected %u\n", from, to, r, s);
+				return 1;
+			}
+			break;
+		case 5:
+			for (count = 0, s = from; s != to; s++)
+				count += plain[s % CHECK_BITS];
+			if ((n = sb_count(&sb, from, to)) != count)
+			{
+				printf("sb_count [%u, %u): %d, expected %d\n", from, to, n, count);
+				return 1;
+			}
+			break;
+		case 6:
+			n = to - from;
+			sb_extract(&sb, from, n, out);
+			for (i = 0; i < (n + 63) / 64; i++)
+			{
+				for (want = 0, s = 0; s < 64 && 64 * i + s < n; s++)
+					want |= (uint64_t)plain[(from + 64 * i + s) % CHECK_BITS] << s;
+				if (out[i] != want)
+				{
+					printf("sb_extract from %u, %d bits: word %d is %016llx, expected %016llx\n", from, n, i, (unsigned long long)out[i],
+						   (unsigned long long)want);
+					return 1;
+				}
+			}
+			break;
+		}
+		for (i = 0; i < 8; i++)
+		{ // Spot checks of single bits
+			s = base + rand() % CHECK_BITS;
+			if (sb_test(&sb, s) != plain[s % CHECK_BITS])
+			{
+				printf("sb_test %u: %d, expected %d\n", s, sb_test(&sb, s), plain[s % CHECK_BITS]);
+				return 1;
+			}
+		}
+		if (rand() % 4 == 0)
+		{ // Slide the window, clearing the bits it leaves behind as the protocol does
+			n = rand() % 64;
+			sb_clear_range(&sb, base, base + n);
+			for (s = base; s != base + n; s++)
+				plain[s % CHECK_BITS] = 0;
+			base += n;
+		}
+	}
+	sb_free(&sb);
+	return 0;
+}
+
+/* Bit by bit, as a protocol without the scoreboard would walk its acked[] array */
+static uint32_t first_zero_bitwise(const struct scoreboard *sb, uint32_t from, uint32_t to)
+{
+	for (; from != to && sb_test(sb, from); from++)
+		;
+	return from;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = {64, 1024, 16384, 131072};
+	struct scoreboard sb;
+	uint64_t t0;
+	double word_ns, bit_ns;
+	uint32_t sink = 0;
+	int s, i, n;
+
+	if (check_ops())
+		return 1;
+
+	printf("%8s %16s %16s\n", "window", "ffz word ns", "ffz bitwise ns");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		n = sizes[s];
+		sb_init(&sb, n);
+		for (i = 0; i < n - 1; i++)
+			sb_set(&sb, i);
+
+		t0 = now_ns();
+		for (i = 0; i < ITERATIONS; i++)
+			sink += sb_find_first_zero(&sb, sink & 1, n);
+		word_ns = (double)(now_ns() - t0) / ITERATIONS;
+
+		t0 = now_ns();
+		for (i = 0; i < ITERATIONS / (n / 64 + 1) + 1; i++)
+			sink += first_zero_bitwise(&sb, sink & 1, n);
+		bit_ns = (double)(now_ns() - t0) / i;
+
+		printf("%8d %16.1f %16.1f\n", n, word_ns, bit_ns);
+		sb_free(&sb);
+	}
+	return sink == 42; /* Keeps the measured loops from being optimized away */
+}
@@ -0,0 +1,230 @@
+#include <string.h>
+#include <arpa/inet.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+
+#include "checksum.h"
+
+uint64_t (*csum_partial)(const void *data, size_t len, uint64_t sum) = csum_partial_scalar;
+uint32_t (*crc32c)(uint32_t crc, const void *data, size_t len) = crc32c_sw;
+const char *csum_kernel = "scalar", *crc32c_kernel = "table";
+
+uint16_t csum_bytepair(const void *_data, size_t len)
+{
+	const uint8_t *data = _data;
+	uint32_t sum;
+
+	for (sum = 0; len >= 2; data += 2, len -= 2)
+		sum += data[0] << 8 | data[1];
+	if (len > 0)
+		sum += data[0] << 8;
+	while (sum > 0xffff)
+		sum = (sum >> 16) + (sum & 0xffff);
+	sum = htons(~sum);
+	return sum ? sum : 0xffff;
+}
+
+/* One's complement addition: the carry out of the top bit wraps around */
+static inline uint64_t add_carry(uint64_t a, uint64_t b)
+{
+	a += b;
+	return a + (a < b);
+}
+
+/* 32-bit words are added into two 64-bit accumulators, which can not overflow, so there is no carry chain in the loop */
+uint64_t csum_partial_scalar(const void *_data, size_t len, uint64_t sum)
+{
+	const uint8_t *data = _data;
+	uint64_t s0 = 0, s1 = 0, w;
+	uint32_t a, b;
+
+	for (; len >= 8; data += 8, len -= 8)
+	{
+		memcpy(&a, data, 4);
+		memcpy(&b, data + 4, 4);
+		s0 += a;
+		s1 += b;
+	}
+	sum = add_carry(sum, s0);
+	sum = add_carry(sum, s1);
+	if (len)
+	{ // The last bytes keep their position within the 16-bit words
+		w = 0;
+		memcpy(&w, data, len);
+		sum = add_carry(sum, w);
+	}
+	return sum;
+}
+
+uint16_t csum_fold(uint64_t sum)
+{
+	uint16_t r;
+
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	r = ~sum;
+	return r ? r : 0xffff;
+}
+
+/*
+	Vector kernels: every 16-bit word is zero-extended into a 32-bit lane and
+added there, two words per lane and iteration. A lane can not overflow within
+CSUM_BLOCK iterations (2 * 16384 * 0xffff < 2^32); after each block the lanes
+are widened to 64 bits, added together and then added into the sum.
+*/
+#define CSUM_BLOCK 16384
+
+#ifdef CSUM_X86
+__attribute__((target("sse2"))) uint64_t csum_partial_sse2(const void *_data, size_t len, uint64_t sum)
+{
+	const uint8_t *data = _data;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, v2, lo, hi, lo2, hi2, wide;
+	uint64_t lanes[2];
+	size_t n, i;
+
+	while (len >= 16)
+	{
+		n = len / 16 < CSUM_BLOCK ? len / 16 : CSUM_BLOCK;
+		lo = hi = lo2 = hi2 = zero;
+		for (i = 0; i + 1 < n; i += 2, data += 32)
+		{ // Two independent pairs of accumulators hide the latency of the additions
+			v = _mm_loadu_si128((const __m128i *)data);
+			v2 = _mm_loadu_si128((const __m128i *)(data + 16));
+			lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero));
+			hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero));
+			lo2 = _mm_add_epi32(lo2, _mm_unpacklo_epi16(v2, zero));
+			hi2 = _mm_add_epi32(hi2, _mm_unpackhi_epi16(v2, zero));
+		}
+		if (i < n)
+		{
+			v = _mm_loadu_si128((const __m128i *)data);
+			lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero));
+			hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero));
+			data += 16;
+		}
+		len -= n * 16;
+		lo = _mm_add_epi32(lo, hi2); // One word per lane and iteration each, still below 2^32
+		hi = _mm_add_epi32(hi, lo2);
+		wide = _mm_add_epi64(_mm_unpacklo_epi32(lo, zero), _mm_unpackhi_epi32(lo, zero));
+		wide = _mm_add_epi64(wide, _mm_add_epi64(_mm_unpacklo_epi32(hi, zero), _mm_unpackhi_epi32(hi, zero)));
+		_mm_storeu_si128((__m128i *)lanes, wide);
+		sum = add_carry(sum, lanes[0] + lanes[1]);
+	}
+	return csum_partial_scalar(data, len, sum);
+}
+
+__attribute__((target("avx2"))) uint64_t csum_partial_avx2(const void *_data, size_t len, uint64_t sum)
+{
+	const uint8_t *data = _data;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i v, lo, hi, wide;
+	uint64_t lanes[4];
+	size_t n, i;
+
+	while (len >= 32)
+	{
+		n = len / 32 < CSUM_BLOCK ? len / 32 : CSUM_BLOCK;
+		lo = hi = zero;
+		for (i = 0; i < n; i++, data += 32)
+		{
+			v = _mm256_loadu_si256((const __m256i *)data);
+			lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(v, zero));
+			hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(v, zero));
+		}
+		len -= n * 32;
+		wide = _mm256_add_epi64(_mm256_unpacklo_epi32(lo, zero), _mm256_unpackhi_epi32(lo, zero));
+		wide = _mm256_add_epi64(wide, _mm256_add_epi64(_mm256_unpacklo_epi32(hi, zero), _mm256_unpackhi_epi32(hi, zero)));
+		_mm256_storeu_si256((__m256i *)lanes, wide);
+		sum = add_carry(sum, lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+	}
+	return csum_partial_scalar(data, len, sum);
+}
+
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const void *_data, size_t len)
+{
+	const uint8_t *data = _data;
+	uint64_t w;
+
+	crc = ~crc;
+	for (; len >= 8; data += 8, len -= 8)
+	{
+		memcpy(&w, data, 8);
+		crc = (uint32_t)_mm_crc32_u64(crc, w);
+	}
+	for (; len > 0; data++, len--)
+		crc = _mm_crc32_u8(crc, *data);
+	return ~crc;
+}
+#else
+uint64_t csum_partial_sse2(const void *data, size_t len, uint64_t sum)
+{
+	return csum_partial_scalar(data, len, sum);
+}
+
+uint64_t csum_partial_avx2(const void *data, size_t len, uint64_t sum)
+{
+	return csum_partial_scalar(data, len, sum);
+}
+
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+	return crc32c_sw(crc, data, len);
+}
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* Castagnoli polynomial, bit-reversed */
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table()
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *_data, size_t len)
+{
+	const uint8_t *data = _data;
+
+	if (crc32c_table[1] == 0)
+		crc32c_init_table();
+	crc = ~crc;
+	for (; len > 0; data++, len--)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *data) & 0xff];
+	return ~crc;
+}
+
+void csum_init()
+{
+#ifdef CSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		csum_partial = csum_partial_avx2;
+		csum_kernel = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		csum_partial = csum_partial_sse2;
+		csum_kernel = "sse2";
+	}
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		crc32c = crc32c_hw;
+		crc32c_kernel = "sse4.2";
+	}
+#endif
+}
@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Packet checksums used by the runtime with -x.
+		- Internet checksum (RFC 1071): 16-bit one's complement sum. The
+	kernels add the data in native-endian 16-bit words; the one's complement
+	sum is byte-order independent, so the folded result stored in memory is
+	the same as summing big-endian words and converting with htons. They keep
+	the sum in a 64-bit (or wider vector) accumulator and fold it at the end,
+	so a buffer can be summed in pieces: csum_partial(b, lb, csum_partial(a,
+	la, 0)) is the sum of a followed by b, as long as la is even.
+		- CRC32C (Castagnoli): hardware crc32 instruction when the CPU has
+	SSE4.2, table driven otherwise.
+	csum_init selects the fastest kernels the CPU supports.
+*/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/* Reference kernel: the original cksum() loop, one big-endian 16-bit word per iteration */
+uint16_t csum_bytepair(const void *data, size_t len);
+
+/* One's complement sum kernels: return sum plus the data, not folded */
+uint64_t csum_partial_scalar(const void *data, size_t len, uint64_t sum);
+uint64_t csum_partial_sse2(const void *data, size_t len, uint64_t sum);
+uint64_t csum_partial_avx2(const void *data, size_t len, uint64_t sum);
+
+/* Folds a sum into the 16-bit checksum (complemented, 0 is sent as 0xffff as cksum() does) */
+uint16_t csum_fold(uint64_t sum);
+
+/* CRC32C kernels: crc is the CRC of the previous data (0 to start) */
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len);
+
+/* Kernels selected by csum_init for this CPU */
+extern uint64_t (*csum_partial)(const void *data, size_t len, uint64_t sum);
+extern uint32_t (*crc32c)(uint32_t crc, const void *data, size_t len);
+extern const char *csum_kernel, *crc32c_kernel; /* Names of the selected kernels */
+
+void csum_init();
+
+#endif /* CHECKSUM_H */
@@ -0,0 +1,158 @@
+#include <string.h>
+#include <math.h>
+
+#include "congestion.h"
+
+#define MIN_CWND 1.0
+#define MIN_SSTHRESH 2.0
+#define CUBIC_C 0.4	   /* Scaling constant of the cubic function, frames/s^3 */
+#define CUBIC_BETA 0.7 /* Multiplicative decrease factor */
+
+static void clamp(struct cc_state *cc)
+{
+	if (cc->cwnd > cc->max_cwnd)
+		cc->cwnd = cc->max_cwnd;
+	if (cc->cwnd < MIN_CWND)
+		cc->cwnd = MIN_CWND;
+}
+
+/*
+ * none: the congestion window is always the flow control window, as without congestion control
+ */
+static void none_init(struct cc_state *cc)
+{
+	cc->cwnd = cc->max_cwnd;
+	cc->ssthresh = cc->max_cwnd;
+}
+
+static void none_on_ack(struct cc_state *cc, int acked, uint64_t now_ns, long srtt_ns)
+{
+}
+
+static void none_on_event(struct cc_state *cc, uint64_t now_ns)
+{
+}
+
+/*
+ * reno: slow start, then additive increase of one frame per RTT and multiplicative decrease
+ * (halving) on loss. A timeout goes back to slow start from one frame.
+ */
+static void reno_init(struct cc_state *cc)
+{
+	cc->cwnd = MIN_CWND;
+	cc->ssthresh = cc->max_cwnd;
+}
+
+static void reno_on_ack(struct cc_state *cc, int acked, uint64_t now_ns, long srtt_ns)
+{
+	if (cc->cwnd < cc->ssthresh)
+		cc->cwnd += acked; // Slow start: doubles every RTT
+	else
+		cc->cwnd += (double)acked / cc->cwnd; // Congestion avoidance: +1 frame per RTT
+	clamp(cc);
+}
+
+static void reno_on_loss(struct cc_state *cc, uint64_t now_ns)
+{
+	cc->ssthresh = fmax(cc->cwnd / 2, MIN_SSTHRESH);
+	cc->cwnd = cc->ssthresh;
+	clamp(cc);
+}
+
+static void reno_on_timeout(struct cc_state *cc, uint64_t now_ns)
+{
+	cc->ssthresh = fmax(cc->cwnd / 2, MIN_SSTHRESH);
+	cc->cwnd = MIN_CWND;
+}
+
+/*
+ * cubic: after a reduction, the window follows W(t) = C (t - K)^3 + W_max, where t is the time
+ * since the reduction. It grows fast far from the previous maximum and flattens close to it,
+ * independently of the RTT. It never grows slower than Reno would (TCP-friendly region).
+ */
+static void cubic_init(struct cc_state *cc)
+{
+	reno_init(cc);
+	cc->w_max = 0;
+	cc->epoch_start = 0;
+}
+
+static void cubic_on_ack(struct cc_state *cc, int acked, uint64_t now_ns, long srtt_ns)
+{
+	double t, target;
+
+	if (cc->cwnd < cc->ssthresh)
+	{
+		cc->cwnd += acked;
+		clamp(cc);
+		return;
+	}
+	if (cc->epoch_start == 0)
+	{ // First ACK of a congestion avoidance epoch
+		cc->epoch_start = now_ns;
+		if (cc->cwnd < cc->w_max)
+		{
+			cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+			cc->origin = cc->w_max;
+		}
+		else
+		{
+			cc->k = 0;
+			cc->origin = cc->cwnd;
+		}
+		cc->w_est = cc->cwnd;
+	}
+
+	// Aim at the value of the cubic function one RTT ahead
+	t = (now_ns - cc->epoch_start + srtt_ns) / 1e9;
+	target = cc->origin + CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k);
+	if (target > cc->cwnd)
+		cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+	else
+		cc->cwnd += 0.01 * acked / cc->cwnd;
+
+	cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+	if (cc->w_est > cc->cwnd)
+		cc->cwnd = cc->w_est;
+	clamp(cc);
+}
+
+static void cubic_reduce(struct cc_state *cc)
+{
+	cc->epoch_start = 0;
+	// Fast convergence: if the flow lost before reaching its previous maximum, release bandwidth
+	if (cc->cwnd < cc->w_max)
+		cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+	else
+		cc->w_max = cc->cwnd;
+	cc->ssthresh = fmax(cc->cwnd * CUBIC_BETA, MIN_SSTHRESH);
+}
+
+static void cubic_on_loss(struct cc_state *cc, uint64_t now_ns)
+{
+	cubic_reduce(cc);
+	cc->cwnd = cc->ssthresh;
+	clamp(cc);
+}
+
+static void cubic_on_timeout(struct cc_state *cc, uint64_t now_ns)
+{
+	cubic_reduce(cc);
+	cc->cwnd = MIN_CWND;
+}
+
+static const struct cc_ops algorithms[] = {
+	{"none", none_init, none_on_ack, none_on_event, none_on_event},
+	{"reno", reno_init, reno_on_ack, reno_on_loss, reno_on_timeout},
+	{"cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout},
+};
+
+const struct cc_ops *cc_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+		if (!strcmp(algorithms[i].name, name))
+			return &algorithms[i];
+	return NULL;
+}
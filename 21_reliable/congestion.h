@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+/*
+	Congestion control algorithms. Each algorithm is a table of hooks that
+update a shared cc_state; the runtime picks one with -c and the protocol drives
+it through the CC_* API calls declared in rlib.h. Windows are measured in
+frames, and kept as doubles so that congestion avoidance can grow them by a
+fraction of a frame per ACK.
+*/
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+struct cc_state
+{
+	double cwnd;		  /* Congestion window */
+	double ssthresh;	  /* Slow start threshold */
+	double max_cwnd;	  /* The window never grows beyond the flow control window (-w) */
+	/* CUBIC only */
+	double w_max;		  /* Window before the last reduction */
+	double k;			  /* Time (s) the cubic function takes to get back to w_max */
+	double origin;		  /* Plateau of the cubic function */
+	double w_est;		  /* Window a Reno flow would have, for the TCP-friendly region */
+	uint64_t epoch_start; /* Start of the current congestion avoidance epoch, 0 if none */
+};
+
+struct cc_ops
+{
+	const char *name;
+	void (*init)(struct cc_state *cc);
+	/* "acked" new frames were confirmed; srtt_ns is the current smoothed RTT */
+	void (*on_ack)(struct cc_state *cc, int acked, uint64_t now_ns, long srtt_ns);
+	/* A loss was detected while ACKs keep flowing (called once per window) */
+	void (*on_loss)(struct cc_state *cc, uint64_t now_ns);
+	/* The retransmission timer of the oldest frame expired */
+	void (*on_timeout)(struct cc_state *cc, uint64_t now_ns);
+};
+
+/* Returns the algorithm called name ("none", "reno" or "cubic"), or NULL */
+const struct cc_ops *cc_find(const char *name);
+
+#endif /* CONGESTION_H */
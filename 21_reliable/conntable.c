@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+#include "conntable.h"
+
+static void ct_alloc(struct conn_table *t, uint32_t nslots)
+{
+	t->slots = calloc(nslots, sizeof(*t->slots));
+	t->hashes = malloc(nslots * sizeof(*t->hashes));
+	if (!t->slots || !t->hashes)
+	{
+		fprintf(stderr, "connection table: out of memory allocating %u slots\n", nslots);
+		abort();
+	}
+	t->mask = nslots - 1;
+}
+
+void ct_init(struct conn_table *t, int capacity)
+{
+	uint32_t nslots = 16;
+
+	while (nslots < 2 * (uint32_t)capacity)
+		nslots *= 2;
+	ct_alloc(t, nslots);
+	t->count = 0;
+}
+
+uint32_t ct_hash(const struct sockaddr_storage *addr, uint32_t id)
+{
+	uint32_t h = addrhash(addr) ^ (id * 0x9e3779b1u);
+
+	// Final mix of MurmurHash3: every input bit affects the low bits used as index
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+struct conn_key *ct_find(const struct conn_table *t, const struct sockaddr_storage *addr, uint32_t id)
+{
+	uint32_t h = ct_hash(addr, id), i;
+	struct conn_key *k;
+
+	for (i = h & t->mask; (k = t->slots[i]); i = (i + 1) & t->mask)
+		if (t->hashes[i] == h && k->id == id && addreq(&k->addr, addr))
+			return k;
+	return NULL;
+}
+
+static void ct_place(struct conn_table *t, struct conn_key *key, uint32_t h)
+{
+	uint32_t i;
+
+	for (i = h & t->mask; t->slots[i]; i = (i + 1) & t->mask)
+		;
+	t->slots[i] = key;
+	t->hashes[i] = h;
+}
+
+void ct_insert(struct conn_table *t, struct conn_key *key)
+{
+	struct conn_key **old_slots = t->slots;
+	uint32_t *old_hashes = t->hashes;
+	uint32_t i, old_size = t->mask + 1;
+
+	if (2 * (uint32_t)(t->count + 1) > old_size)
+	{ // Rehash into twice the slots
+		ct_alloc(t, 2 * old_size);
+		for (i = 0; i < old_size; i++)
+			if (old_slots[i])
+				ct_place(t, old_slots[i], old_hashes[i]);
+		free(old_slots);
+		free(old_hashes);
+	}
+	ct_place(t, key, ct_hash(&key->addr, key->id));
+	t->count++;
+}
+
+void ct_remove(struct conn_table *t, struct conn_key *key)
+{
+	uint32_t i, j, home;
+
+	for (i = ct_hash(&key->addr, key->id) & t->mask; t->slots[i] != key; i = (i + 1) & t->mask)
+		;
+	/*
+		Backward shift: an entry after the hole moves into it unless its home
+	slot lies cyclically in (i, j], where it can still be found without the hole.
+	*/
+	for (j = (i + 1) & t->mask; t->slots[j]; j = (j + 1) & t->mask)
+	{
+		home = t->hashes[j] & t->mask;
+		if (((j - home) & t->mask) < ((j - i) & t->mask))
+			continue;
+		t->slots[i] = t->slots[j];
+		t->hashes[i] = t->hashes[j];
+		i = j;
+	}
+	t->slots[i] = NULL;
+	t->count--;
+}
@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+	Connection table of the multi-connection runtime (-n): finds the connection
+of a received packet from its source address and the connection ID it carries.
+Open addressing with linear probing over a power-of-two array, kept at most
+half full (it doubles when it gets there), so a lookup usually probes one or two
+slots. Every slot caches the hash of its key, so most mismatches are rejected
+without comparing addresses. Removal shifts the entries after it back instead of
+leaving tombstones, so lookups do not slow down as connections come and go.
+
+	The table stores pointers to a struct conn_key embedded in the caller's
+connection object; it does not own them.
+*/
+
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+struct conn_key
+{
+	struct sockaddr_storage addr; /* Peer address */
+	uint32_t id;				  /* Connection ID */
+};
+
+struct conn_table
+{
+	struct conn_key **slots; /* NULL if empty */
+	uint32_t *hashes;		 /* Hash of the key in each slot */
+	uint32_t mask;			 /* Number of slots - 1 */
+	int count;				 /* Keys in the table */
+};
+
+/* Allocates an empty table with room for capacity keys before it has to grow */
+void ct_init(struct conn_table *t, int capacity);
+
+uint32_t ct_hash(const struct sockaddr_storage *addr, uint32_t id);
+
+/* Returns the key equal to (addr, id), or NULL */
+struct conn_key *ct_find(const struct conn_table *t, const struct sockaddr_storage *addr, uint32_t id);
+
+/* Adds key, which must not be in the table yet */
+void ct_insert(struct conn_table *t, struct conn_key *key);
+
+/* Removes key, which must be in the table */
+void ct_remove(struct conn_table *t, struct conn_key *key);
+
+#endif /* CONNTABLE_H */
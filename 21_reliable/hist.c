@@ -0,0 +1,64 @@
+#include <math.h>
+#include <string.h>
+
+#include "hist.h"
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct hist *h, const struct hist *from)
+{
+	int i;
+
+	if (!from->count)
+		return;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		h->counts[i] += from->counts[i];
+	if (!h->count || from->min < h->min)
+		h->min = from->min;
+	if (from->max > h->max)
+		h->max = from->max;
+	h->count += from->count;
+}
+
+/* Highest value that falls in bucket b */
+static uint64_t bucket_top(int b)
+{
+	int shift;
+
+	if (b < HIST_SUB)
+		return b;
+	shift = b / HIST_SUB - 1;
+	return (((uint64_t)(HIST_SUB + b % HIST_SUB) + 1) << shift) - 1;
+}
+
+uint64_t hist_quantile(const struct hist *h, double q)
+{
+	uint64_t rank, seen = 0, top;
+	int b;
+
+	if (!h->count)
+		return 0;
+	rank = ceil(q * h->count);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	{
+		seen += h->counts[b];
+		if (seen >= rank)
+			break;
+	}
+	top = bucket_top(b);
+	return top > h->max ? h->max : top;
+}
+
+void hist_print(FILE *out, const char *label, const struct hist *h)
+{
+	fprintf(out, "\t%s: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us (%llu samples)\n", label,
+			hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3, hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3,
+			h->max / 1e3, (unsigned long long)h->count);
+}
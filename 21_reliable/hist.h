@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+	Log-linear latency histogram, as in HdrHistogram: values below HIST_SUB
+(128 ns) get a bucket each; above, every power of two is split into HIST_SUB
+equal buckets, so a bucket is never wider than 1/128 (0.8%) of the values in
+it. The range is the whole uint64_t, so nothing is ever clamped. Recording is
+a count leading zeros, a shift and an increment: O(1), and the counts are a
+fixed array, so it never allocates.
+*/
+
+#ifndef HIST_H
+#define HIST_H
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist
+{
+	uint64_t count; /* Values recorded */
+	uint64_t min, max;
+	uint64_t counts[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v < HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS; // v >> shift is in [HIST_SUB, 2 HIST_SUB)
+	return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	h->counts[hist_bucket(v)]++;
+	if (h->count++ == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Empties h */
+void hist_reset(struct hist *h);
+
+/* Adds the values of from to h */
+void hist_merge(struct hist *h, const struct hist *from);
+
+/* Value below which a fraction q (0 to 1) of the values are: the top of its bucket, but never above max */
+uint64_t hist_quantile(const struct hist *h, double q);
+
+/* Prints a line "\t<label>: p50 ... p90 ... p99 ... p99.9 ... max ... (N samples)", in microseconds */
+void hist_print(FILE *out, const char *label, const struct hist *h);
+
+#endif /* HIST_H */
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "impair.h"
+
+static uint64_t splitmix64(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void xoshiro_seed(struct xoshiro *x, uint64_t seed)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		x->s[i] = splitmix64(&seed);
+}
+
+void xoshiro_fill(struct xoshiro *x, void *_buf, size_t len)
+{
+	char *buf = _buf;
+	uint64_t r;
+
+	for (; len >= 8; buf += 8, len -= 8)
+	{
+		r = xoshiro_next(x);
+		memcpy(buf, &r, 8);
+	}
+	if (len)
+	{
+		r = xoshiro_next(x);
+		memcpy(buf, &r, len);
+	}
+}
+
+void impair_init(struct impair *im, const struct impair_config *cfg, uint64_t seed)
+{
+	memset(im, 0, sizeof(*im));
+	im->cfg = *cfg;
+	im->seed = seed;
+	xoshiro_seed(&im->rng, seed);
+	xoshiro_seed(&im->junk, ~seed);
+	im->delays = cfg->delay || cfg->jitter || cfg->reorder > 0;
+}
+
+int impair_enabled(const struct impair *im)
+{
+	return im->cfg.loss > 0 || im->cfg.ge_p > 0 || im->cfg.corrupt > 0 || im->cfg.duplicate > 0 || im->delays;
+}
+
+int impair_lose(struct impair *im)
+{
+	if (im->cfg.ge_p > 0)
+	{
+		if (im->ge_bad ? impair_chance(im, im->cfg.ge_r) : impair_chance(im, im->cfg.ge_p))
+			im->ge_bad = !im->ge_bad;
+		if (impair_chance(im, im->ge_bad ? im->cfg.ge_loss_bad : im->cfg.ge_loss_good))
+		{
+			im->lost++;
+			if (im->ge_bad)
+				im->burst_lost++;
+			return 1;
+		}
+	}
+	if (impair_chance(im, im->cfg.loss))
+	{
+		im->lost++;
+		return 1;
+	}
+	return 0;
+}
+
+uint64_t impair_delay(struct impair *im)
+{
+	uint64_t d = im->cfg.delay;
+
+	if (!im->delays)
+		return 0;
+	if (im->cfg.jitter)
+	{ // delay - jitter + [0, 2 jitter], clamped to 0
+		d += xoshiro_next(&im->rng) % (2 * im->cfg.jitter + 1);
+		d = d > im->cfg.jitter ? d - im->cfg.jitter : 0;
+	}
+	if (impair_chance(im, im->cfg.reorder))
+	{
+		d += im->cfg.reorder_delay;
+		im->reordered++;
+	}
+	if (d)
+		im->delayed++;
+	return d;
+}
+
+void dq_init(struct delay_queue *dq, int size, size_t slot_size)
+{
+	int i;
+
+	memset(dq, 0, sizeof(*dq));
+	dq->size = dq->nfree = size;
+	dq->slot_size = slot_size;
+	dq->heap = malloc(size * sizeof(*dq->heap));
+	dq->bufs = malloc(size * slot_size);
+	dq->free = malloc(size * sizeof(*dq->free));
+	if (!dq->heap || !dq->bufs || !dq->free)
+	{
+		fprintf(stderr, "delay queue: out of memory allocating %d buffers of %zu bytes\n", size, slot_size);
+		abort();
+	}
+	for (i = 0; i < size; i++)
+		dq->free[i] = dq->bufs + (size_t)i * slot_size;
+}
+
+static int entry_before(const struct delay_entry *a, const struct delay_entry *b)
+{
+	return a->release_ns < b->release_ns || (a->release_ns == b->release_ns && a->order < b->order);
+}
+
+void *dq_push(struct delay_queue *dq, uint64_t release_ns, size_t len, int flags, void *owner)
+{
+	struct delay_entry e;
+	int i, parent;
+
+	if (dq->nfree == 0 || len > dq->slot_size)
+	{
+		dq->overflows++;
+		return NULL;
+	}
+	e.release_ns = release_ns;
+	e.order = dq->pushed++;
+	e.buf = dq->free[--dq->nfree];
+	e.len = len;
+	e.flags = flags;
+	e.owner = owner;
+	// Sift up
+	for (i = dq->count++; i > 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if (!entry_before(&e, &dq->heap[parent]))
+			break;
+		dq->heap[i] = dq->heap[parent];
+	}
+	dq->heap[i] = e;
+	return e.buf;
+}
+
+int dq_pop(struct delay_queue *dq, uint64_t now_ns, struct delay_entry *e)
+{
+	struct delay_entry last;
+	int i, child;
+
+	if (dq->count == 0 || dq->heap[0].release_ns > now_ns)
+		return 0;
+	*e = dq->heap[0];
+	dq->free[dq->nfree++] = e->buf;
+	last = dq->heap[--dq->count];
+	// Sift the last entry down from the root
+	for (i = 0; (child = 2 * i + 1) < dq->count; i = child)
+	{
+		if (child + 1 < dq->count && entry_before(&dq->heap[child + 1], &dq->heap[child]))
+			child++;
+		if (!entry_before(&dq->heap[child], &last))
+			break;
+		dq->heap[i] = dq->heap[child];
+	}
+	if (dq->count)
+		dq->heap[i] = last;
+	return 1;
+}
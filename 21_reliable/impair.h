@@ -0,0 +1,176 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Network impairment emulator used by the runtime on the send path. Every
+packet the protocol sends is first given a fate here: it can be lost,
+corrupted, duplicated, delayed or reordered.
+		- Loss: independent (probability loss per packet) and/or in bursts,
+	with a Gilbert-Elliott channel. The channel is a two-state Markov chain:
+	before each packet it moves from the good to the bad state with probability
+	ge_p, and back with probability ge_r; the packet is then lost with
+	probability ge_loss_good or ge_loss_bad depending on the state. Bursts last
+	1 / ge_r packets on average, and the channel is bad ge_p / (ge_p + ge_r) of
+	the time.
+		- Corruption and duplication: independent probabilities per packet.
+		- Delay: each packet is held delay ns plus a uniform jitter in [-jitter,
+	+jitter] (never less than 0). With probability reorder it is held
+	reorder_delay ns more, so that the packets sent after it overtake it.
+	Delayed packets wait in a delay_queue until their release date.
+
+	All the decisions come from one xoshiro256** generator, and a packet only
+draws numbers for the impairments that are enabled, so with the same seed and
+the same configuration the n-th packet always has the same fate. The contents
+of corrupted packets come from a second generator, which keeps the decisions
+independent of the packet sizes.
+*/
+
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+/* xoshiro256** (Blackman and Vigna): 256 bits of state, a few cycles per number */
+struct xoshiro
+{
+	uint64_t s[4];
+};
+
+/* Expands seed into a full state with splitmix64, as the authors recommend */
+void xoshiro_seed(struct xoshiro *x, uint64_t seed);
+
+static inline uint64_t xoshiro_rotl(uint64_t v, int k)
+{
+	return (v << k) | (v >> (64 - k));
+}
+
+static inline uint64_t xoshiro_next(struct xoshiro *x)
+{
+	uint64_t *s = x->s;
+	uint64_t result = xoshiro_rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = xoshiro_rotl(s[3], 45);
+	return result;
+}
+
+/* Uniform double in [0, 1), from the 53 high bits */
+static inline double xoshiro_double(struct xoshiro *x)
+{
+	return (xoshiro_next(x) >> 11) * 0x1.0p-53;
+}
+
+/* Fills len bytes of buf with random bytes, 8 per number */
+void xoshiro_fill(struct xoshiro *x, void *buf, size_t len);
+
+struct impair_config
+{
+	double loss;		   /* Independent loss probability */
+	double ge_p, ge_r;	   /* Gilbert-Elliott transition probabilities, good to bad and bad to good (ge_p = 0: disabled) */
+	double ge_loss_good;   /* Loss probability in the good state */
+	double ge_loss_bad;	   /* Loss probability in the bad state */
+	double corrupt;		   /* Corruption probability */
+	double duplicate;	   /* Duplication probability */
+	double reorder;		   /* Probability of holding a packet reorder_delay ns more */
+	uint64_t delay;		   /* Fixed delay, ns */
+	uint64_t jitter;	   /* Maximum deviation from delay, ns */
+	uint64_t reorder_delay; /* Extra delay of reordered packets, ns */
+};
+
+struct impair
+{
+	struct impair_config cfg;
+	struct xoshiro rng;	 /* Fate of the packets */
+	struct xoshiro junk; /* Contents of corrupted packets */
+	uint64_t seed;
+	int ge_bad;		/* Gilbert-Elliott channel state: 1 bad, 0 good */
+	int delays;		/* Non-zero if some packets can be delayed (delay, jitter or reorder) */
+	long lost, burst_lost, corrupted, duplicated, delayed, reordered; /* Stats: burst_lost counts the losses in the bad state */
+};
+
+void impair_init(struct impair *im, const struct impair_config *cfg, uint64_t seed);
+
+/* Non-zero if any impairment is enabled */
+int impair_enabled(const struct impair *im);
+
+static inline int impair_chance(struct impair *im, double p)
+{
+	return p > 0 && xoshiro_double(&im->rng) < p;
+}
+
+/* Returns 1 if the next packet is lost, advancing the Gilbert-Elliott channel */
+int impair_lose(struct impair *im);
+
+static inline int impair_corrupt(struct impair *im)
+{
+	if (!impair_chance(im, im->cfg.corrupt))
+		return 0;
+	im->corrupted++;
+	return 1;
+}
+
+static inline int impair_duplicate(struct impair *im)
+{
+	if (!impair_chance(im, im->cfg.duplicate))
+		return 0;
+	im->duplicated++;
+	return 1;
+}
+
+/* Returns how long the next packet must be held, in ns (0: send it now) */
+uint64_t impair_delay(struct impair *im);
+
+/*
+	Release queue of delayed packets: a binary min-heap of release dates over a
+fixed set of packet buffers, allocated once. Packets with the same release date
+leave in the order they entered.
+*/
+struct delay_entry
+{
+	uint64_t release_ns;
+	uint64_t order; /* Entry counter, breaks ties between equal dates */
+	char *buf;
+	size_t len;
+	int flags;	 /* Caller-defined */
+	void *owner; /* Caller-defined */
+};
+
+struct delay_queue
+{
+	struct delay_entry *heap;
+	char *bufs;		  /* size * slot_size bytes */
+	char **free;	  /* Stack of free buffers */
+	int size, count, nfree;
+	size_t slot_size;
+	uint64_t pushed;
+	long overflows; /* Packets rejected because the queue was full */
+};
+
+void dq_init(struct delay_queue *dq, int size, size_t slot_size);
+
+/*
+	Queues a packet of len bytes (at most slot_size) to be released at
+release_ns. flags and owner are given back with the packet. Returns the buffer
+the caller must copy the packet into, or NULL if the queue is full.
+*/
+void *dq_push(struct delay_queue *dq, uint64_t release_ns, size_t len, int flags, void *owner);
+
+/* Returns 1 and stores the earliest release date in *release_ns, or 0 if the queue is empty */
+static inline int dq_next(const struct delay_queue *dq, uint64_t *release_ns)
+{
+	if (dq->count == 0)
+		return 0;
+	*release_ns = dq->heap[0].release_ns;
+	return 1;
+}
+
+/*
+	Removes the earliest packet if its release date is <= now_ns and stores it
+in *e, or returns 0. e->buf stays valid until the next dq_push.
+*/
+int dq_pop(struct delay_queue *dq, uint64_t now_ns, struct delay_entry *e);
+
+#endif /* IMPAIR_H */
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define MAX_RINGS 512
+#define OUT_SIZE 65536
+
+__thread struct log_ring *log_ring;
+
+static struct log_ring *rings[MAX_RINGS];
+static int nrings;
+static uint64_t start_ns;
+static volatile int stopping;
+static pthread_t flusher;
+static int flusher_running;
+
+static const struct
+{
+	const char *color;
+	const char *label;
+} kinds[] = {
+	[LOG_TIMER] = {"\x1b[34m", "TIMER"},
+	[LOG_RECEPTION] = {"\x1b[32m", "RECEPTION"},
+	[LOG_SEND] = {"\x1b[35m", "SEND"},
+	[LOG_ERRORS] = {"\x1b[31m", "ERRORS"},
+};
+
+static char out[OUT_SIZE];
+static size_t out_len;
+
+static void out_flush(void)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < out_len)
+	{
+		n = write(STDOUT_FILENO, out + done, out_len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	out_len = 0;
+}
+
+/* Room for at least need bytes in out */
+static char *out_reserve(size_t need)
+{
+	if (out_len + need > OUT_SIZE)
+		out_flush();
+	return out + out_len;
+}
+
+static void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void out_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(out_reserve(256), OUT_SIZE - out_len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		out_len += (size_t)n < OUT_SIZE - out_len ? (size_t)n : OUT_SIZE - out_len - 1;
+}
+
+/*
+	The record as printf would have printed it: the text of the format is
+copied, and every conversion is handed to snprintf on its own, with the
+argument converted back to the type its length modifier says.
+*/
+static void format_record(const struct log_record *rec)
+{
+	const char *p = rec->fmt, *spec;
+	char conv[32];
+	uint64_t a;
+	double d;
+	int arg = 0, longs;
+	size_t len;
+
+	out_printf("%s%10.6f    %s: ", kinds[rec->kind].color, (rec->ts - start_ns) / 1e9, kinds[rec->kind].label);
+	while (*p)
+	{
+		if (*p != '%')
+		{
+			*out_reserve(1) = *p++;
+			out_len++;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			*out_reserve(1) = '%';
+			out_len++;
+			p += 2;
+			continue;
+		}
+		spec = p++;
+		while (*p && strchr("-+ #0123456789.", *p))
+			p++;
+		for (longs = 0; *p && strchr("hlzjt", *p); p++)
+			longs += *p == 'l' || *p == 'z' || *p == 'j' || *p == 't' ? 1 : 0;
+		if (!*p)
+			break;
+		len = p + 1 - spec;
+		if (len >= sizeof(conv) - 3)
+			len = sizeof(conv) - 3;
+		memcpy(conv, spec, len);
+		conv[len] = 0;
+		a = arg < rec->nargs ? rec->args[arg] : 0;
+		arg++;
+		switch (*p++)
+		{
+		case 'd':
+		case 'i':
+		case 'c':
+			if (longs)
+				out_printf(conv, (long long)a);
+			else
+				out_printf(conv, (int)a);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			if (longs)
+				out_printf(conv, (unsigned long long)a);
+			else
+				out_printf(conv, (unsigned)a);
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			memcpy(&d, &a, sizeof(d));
+			out_printf(conv, d);
+			break;
+		case 'p':
+			out_printf(conv, (void *)(uintptr_t)a);
+			break;
+		default: // %s and the rest: only the argument, the pointer may be gone
+			out_printf("<%s: 0x%llx>", conv, (unsigned long long)a);
+		}
+	}
+	out_printf("\x1b[0m\n");
+}
+
+/* Formats what the rings have; returns the records formatted */
+static long drain(void)
+{
+	struct log_ring *r;
+	uint64_t head, tail, dropped;
+	long n = 0;
+	int i, count = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++)
+	{
+		r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+		if (!r)
+			continue; // Counted, not stored yet
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail != head; tail++, n++)
+		{
+			if (count > 1)
+				out_printf("[%d]", r->thread);
+			format_record(&r->records[tail & (LOG_RING_RECORDS - 1)]);
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped)
+			out_printf("\x1b[31m    LOG: %llu records dropped, ring full\x1b[0m\n", (unsigned long long)dropped);
+	}
+	out_flush();
+	return n;
+}
+
+static void *flusher_thread(void *arg)
+{
+	struct timespec pause = {0, 1000000};
+
+	while (!stopping)
+		if (!drain())
+			nanosleep(&pause, NULL); // Nothing to do: 1 ms is far from filling a ring
+	return NULL;
+}
+
+static void log_stop(void)
+{
+	stopping = 1;
+	if (flusher_running)
+		pthread_join(flusher, NULL);
+	flusher_running = 0;
+	drain(); // Only this thread formats now
+}
+
+struct log_ring *log_ring_create(void)
+{
+	struct log_ring *r;
+	int i;
+
+	r = aligned_alloc(64, sizeof(*r));
+	if (!r)
+		return NULL;
+	memset(r, 0, sizeof(*r) - sizeof(r->records));
+	i = __atomic_load_n(&nrings, __ATOMIC_RELAXED);
+	do
+	{
+		if (i >= MAX_RINGS)
+		{
+			free(r);
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&nrings, &i, i + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	r->thread = i;
+	__atomic_store_n(&rings[i], r, __ATOMIC_RELEASE);
+	log_ring = r;
+	return r;
+}
+
+int log_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	errno = pthread_create(&flusher, NULL, flusher_thread, NULL);
+	if (errno)
+		return -1;
+	flusher_running = 1;
+	atexit(log_stop);
+	return 0;
+}
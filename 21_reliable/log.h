@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+	Debug log (-d) kept out of the data path. The DEBUG_* macros of rlib.h
+compile to nothing above LOG_LEVEL (a build option: make LOG_LEVEL=n, or make
+debug for all of them), and the enabled ones do not print: they write a fixed
+size record (timestamp, format, arguments) into a ring of the calling thread.
+A flusher thread formats the records, colors included, and writes them to
+stdout in large blocks; what is left is written at exit.
+
+	The format is kept as the address of the string constant, so only string
+literals can be formats, and the arguments are stored as 64 bits each: up to
+LOG_MAX_ARGS integers or floating point values (no %s, the string may not be
+there any more when the record is formatted). When a ring is full the records
+are dropped, not waited for, and the flusher says how many.
+*/
+
+#ifndef LOG_H
+#define LOG_H
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 0
+#endif
+
+#define LOG_MAX_ARGS 5
+#define LOG_RING_RECORDS 65536 /* Per thread, a power of two: 4 MB */
+
+enum log_kind
+{
+	LOG_TIMER,
+	LOG_RECEPTION,
+	LOG_SEND,
+	LOG_ERRORS,
+};
+
+struct log_record /* 64 bytes */
+{
+	uint64_t ts;		/* CLOCK_MONOTONIC, ns */
+	const char *fmt;	/* Format: a string constant */
+	uint8_t kind;		/* enum log_kind */
+	uint8_t nargs;
+	uint64_t args[LOG_MAX_ARGS]; /* Integers converted to 64 bits, or the bits of a double */
+};
+
+struct log_ring /* One producer (its thread), one consumer (the flusher) */
+{
+	uint64_t head __attribute__((aligned(64))); /* Next record written */
+	uint64_t tail __attribute__((aligned(64))); /* Next record formatted */
+	uint64_t dropped;							/* Records lost because the ring was full */
+	int thread;									/* Order of creation, to tell the threads apart */
+	struct log_record records[LOG_RING_RECORDS];
+};
+
+extern __thread struct log_ring *log_ring;
+
+/* Creates the ring of the calling thread; NULL if there is no memory */
+struct log_ring *log_ring_create(void);
+
+/* Starts the flusher thread and writes what is left at exit. Returns 0, or -1 with errno set */
+int log_start(void);
+
+static inline uint64_t log_double(double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	return u;
+}
+
+static inline uint64_t log_integer(uint64_t i)
+{
+	return i;
+}
+
+static inline void log_write(int kind, const char *fmt, const uint64_t *args, int nargs)
+{
+	struct log_ring *r = log_ring;
+	struct log_record *rec;
+	struct timespec ts;
+
+	if (!r && !(r = log_ring_create()))
+		return;
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS)
+	{
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	rec = &r->records[r->head & (LOG_RING_RECORDS - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->fmt = fmt;
+	rec->kind = kind;
+	rec->nargs = nargs;
+	memcpy(rec->args, args, nargs * sizeof(*args));
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Each argument as 64 bits: the bits of floating point ones, the value of the others */
+#define LOG_ARG(x) _Generic((x), float: log_double, double: log_double, long double: log_double, default: log_integer)(x)
+
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, N, ...) N
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a) , LOG_ARG(a)
+#define LOG_ARGS_2(a, b) , LOG_ARG(a), LOG_ARG(b)
+#define LOG_ARGS_3(a, b, c) , LOG_ARG(a), LOG_ARG(b), LOG_ARG(c)
+#define LOG_ARGS_4(a, b, c, d) , LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d)
+#define LOG_ARGS_5(a, b, c, d, e) , LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d), LOG_ARG(e)
+
+/* A record of kind if opt_debug >= priority; nothing at all if priority > LOG_LEVEL */
+#define LOG(priority, kind, MESSAGE, ...)                                                                           \
+	{                                                                                                               \
+		if ((priority) <= LOG_LEVEL && opt_debug >= (priority))                                                     \
+			log_write(kind, MESSAGE,                                                                                \
+					  (const uint64_t[]){0 LOG_CAT(LOG_ARGS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)} + 1,            \
+					  LOG_NARGS(__VA_ARGS__));                                                                      \
+	}
+
+#endif /* LOG_H */
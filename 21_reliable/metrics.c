@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static struct sockaddr_un addr;
+static int listen_fd = -1;
+static const struct metric_desc *descs;
+static int nmetrics;
+static struct metrics_block *blocks;
+static int nblocks;
+
+/* Copies the values of b into v; returns 0 if its owner did not publish them yet */
+static int metrics_read(const struct metrics_block *b, double *v)
+{
+	uint32_t s1, s2;
+
+	do
+	{
+		while ((s1 = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE)) & 1)
+			; // The owner is writing: a few dozen stores
+		memcpy(v, b->v, nmetrics * sizeof(*v));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+	} while (s1 != s2);
+	return s1 != 0;
+}
+
+static void format_prometheus(FILE *f, double *v, const int *valid)
+{
+	int i, w;
+
+	for (i = 0; i < nmetrics; i++)
+	{
+		fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", descs[i].name, descs[i].help, descs[i].name,
+				descs[i].type == METRIC_COUNTER ? "counter" : "gauge");
+		for (w = 0; w < nblocks; w++)
+			if (valid[w])
+				fprintf(f, "%s{worker=\"%d\"} %.15g\n", descs[i].name, w, v[w * nmetrics + i]);
+	}
+}
+
+static void format_json(FILE *f, double *v, const int *valid)
+{
+	int i, w, first = 1;
+
+	fprintf(f, "{\"workers\":[");
+	for (w = 0; w < nblocks; w++)
+	{
+		if (!valid[w])
+			continue;
+		fprintf(f, "%s{\"worker\":%d", first ? "" : ",", w);
+		for (i = 0; i < nmetrics; i++)
+			fprintf(f, ",\"%s\":%.15g", descs[i].name, v[w * nmetrics + i]);
+		fprintf(f, "}");
+		first = 0;
+	}
+	fprintf(f, "]}\n");
+}
+
+/*
+	Answers one request: an HTTP GET (any path containing "json" gets JSON, the
+others Prometheus text), or a bare line "json" or "prometheus" for a reply
+without HTTP headers.
+*/
+static void serve(int s)
+{
+	struct timeval tv = {1, 0}; // A client that does not send its request does not hold the others for long
+	char req[1024], *path, *end, *body;
+	size_t len = 0, body_len;
+	ssize_t r, done;
+	int http, json, w;
+	double *v = malloc(nblocks * nmetrics * sizeof(*v));
+	int *valid = malloc(nblocks * sizeof(*valid));
+	FILE *f;
+
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (len < sizeof(req) - 1 && (r = read(s, req + len, sizeof(req) - 1 - len)) > 0)
+	{
+		len += r;
+		req[len] = 0;
+		if (!strncmp(req, "GET ", 4) ? strstr(req, "\r\n\r\n") || strstr(req, "\n\n") : strchr(req, '\n') != NULL)
+			break; // End of the HTTP headers, or of the line
+	}
+	req[len] = 0;
+	http = !strncmp(req, "GET ", 4);
+	if (http)
+	{
+		path = req + 4;
+		if ((end = strchr(path, ' ')))
+			*end = 0;
+		json = strstr(path, "json") != NULL;
+	}
+	else
+	{
+		json = !strncmp(req, "json", 4);
+	}
+
+	for (w = 0; w < nblocks; w++)
+		valid[w] = metrics_read(&blocks[w], v + w * nmetrics);
+	f = open_memstream(&body, &body_len);
+	if (json)
+		format_json(f, v, valid);
+	else
+		format_prometheus(f, v, valid);
+	fclose(f);
+
+	if (http)
+		dprintf(s, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+				json ? "application/json" : "text/plain; version=0.0.4", body_len);
+	for (len = 0; len < body_len; len += done)
+		if ((done = write(s, body + len, body_len - len)) <= 0)
+			break;
+	free(body);
+	free(valid);
+	free(v);
+}
+
+static void *metrics_thread(void *arg)
+{
+	int s;
+
+	for (;;)
+	{
+		s = accept(listen_fd, NULL, NULL);
+		if (s < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("metrics: accept");
+			return NULL;
+		}
+		serve(s);
+		close(s);
+	}
+}
+
+static void metrics_unlink(void)
+{
+	unlink(addr.sun_path);
+}
+
+int metrics_start(const char *path, const struct metric_desc *desc, int n, struct metrics_block *b, int nb)
+{
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	descs = desc;
+	nmetrics = n;
+	blocks = b;
+	nblocks = nb;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		return -1;
+	unlink(path); // Left behind by a previous run that did not exit normally
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0)
+		return -1;
+	atexit(metrics_unlink);
+	errno = pthread_create(&thread, NULL, metrics_thread, NULL);
+	if (errno)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdint.h>
+
+/*
+	Live metrics of the runtime (--metrics PATH), readable at any time from a
+local Unix socket, in Prometheus text format or JSON:
+		curl --unix-socket PATH http://localhost/metrics		(Prometheus)
+		curl --unix-socket PATH http://localhost/metrics.json	(JSON)
+		echo json | nc -U PATH									(no HTTP)
+
+	The counters of the hot path stay plain increments of thread-local
+variables; nothing here is called per packet. Once per event loop iteration
+every worker copies its values into its own metrics_block (a few dozen stores),
+under a sequence lock: the writer makes seq odd while it copies, and a reader
+retries until it gets the same even seq before and after reading the values.
+The blocks are read by a server thread started by metrics_start, so a reader
+never blocks the workers.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_MAX 64 /* Values per block */
+
+enum metric_type
+{
+	METRIC_COUNTER, /* Only grows */
+	METRIC_GAUGE	/* Goes up and down */
+};
+
+struct metric_desc
+{
+	const char *name; /* Prometheus name, also the key in JSON */
+	const char *help;
+	enum metric_type type;
+};
+
+struct metrics_block
+{
+	uint32_t seq; /* Odd while the owner is writing; 0 until the first publication */
+	double v[METRICS_MAX];
+} __attribute__((aligned(64))); /* Blocks of different workers do not share cache lines */
+
+/* Publication, by the thread that owns the block: metrics_write_begin, store the values in v, metrics_write_end */
+static inline void metrics_write_begin(struct metrics_block *b)
+{
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void metrics_write_end(struct metrics_block *b)
+{
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+	Creates the Unix socket at path (replacing a stale one) and starts the
+thread that answers on it. There are n metrics, described by desc, and nblocks
+blocks (one per worker). Returns 0, or -1 with errno set. The socket file is
+removed at exit.
+*/
+int metrics_start(const char *path, const struct metric_desc *desc, int n, struct metrics_block *blocks, int nblocks);
+
+#endif /* METRICS_H */
@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pcap.h"
+
+#define BLOCK_SHB 0x0A0D0D0A
+#define BLOCK_IDB 1
+#define BLOCK_EPB 6
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT 1
+#define OPT_EPB_FLAGS 2
+#define OPT_IF_TSRESOL 9
+#define EPB_HEADER 28 /* Block type, length, interface, timestamp (2), captured and original lengths */
+#define UDP_HEADER 8
+
+#define PAD4(n) (((n) + 3) & ~(size_t)3)
+
+static uint32_t *put32(char *p, uint32_t v)
+{
+	*(uint32_t *)p = v;
+	return (uint32_t *)p;
+}
+
+/* Option code and length, then the value padded to 4 bytes; returns the bytes written */
+static size_t put_option(char *p, uint16_t code, const void *value, uint16_t len)
+{
+	uint16_t h[2] = {code, len};
+
+	memcpy(p, h, sizeof(h));
+	memcpy(p + 4, value, len);
+	memset(p + 4 + len, 0, PAD4(len) - len);
+	return 4 + PAD4(len);
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int pcap_open(struct pcap_ring *r, const char *path, size_t size, uint32_t snaplen, int family)
+{
+	uint16_t idb[4] = {0};
+	uint8_t tsresol = 9; // Timestamps in ns
+	char *p;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (r->fd < 0)
+		return -1;
+	errno = posix_fallocate(r->fd, 0, size); // Otherwise a full disk would be a SIGBUS when the ring gets there
+	if (errno)
+		return -1;
+	r->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, 0);
+	if (r->map == MAP_FAILED)
+		return -1;
+	r->size = size;
+	r->family = family;
+	r->snaplen = snaplen ? snaplen : 0xffffffffu;
+	r->ts_offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+
+	// Section header: byte order magic, version 1.0, unknown section length
+	p = r->map;
+	put32(p, BLOCK_SHB);
+	put32(p + 4, 28);
+	put32(p + 8, 0x1A2B3C4D);
+	put32(p + 12, 1);
+	put32(p + 16, 0xffffffff);
+	put32(p + 20, 0xffffffff);
+	put32(p + 24, 28);
+	p += 28;
+
+	// Interface: raw IPv4 or IPv6 packets, ns timestamps
+	put32(p, BLOCK_IDB);
+	put32(p + 4, 32);
+	idb[0] = family == AF_INET6 ? LINKTYPE_IPV6 : LINKTYPE_IPV4;
+	memcpy(p + 8, idb, 4);
+	put32(p + 12, r->snaplen == 0xffffffffu ? 0 : r->snaplen);
+	put_option(p + 16, OPT_IF_TSRESOL, &tsresol, 1);
+	put32(p + 24, OPT_ENDOFOPT);
+	put32(p + 28, 32);
+	p += 32;
+
+	r->start = r->head = r->tail = p - r->map;
+	return 0;
+}
+
+/* Made-up IP and UDP headers of a datagram of len bytes; returns their length */
+static size_t put_ip_udp(struct pcap_ring *r, char *p, const struct sockaddr_storage *src, const struct sockaddr_storage *dst, size_t len)
+{
+	const struct sockaddr_in *s4 = (const void *)src, *d4 = (const void *)dst;
+	const struct sockaddr_in6 *s6 = (const void *)src, *d6 = (const void *)dst;
+	uint16_t *udp;
+	size_t ip_len;
+
+	if (r->family == AF_INET6)
+	{
+		ip_len = 40;
+		put32(p, htonl(6u << 28));
+		*(uint16_t *)(p + 4) = htons(UDP_HEADER + len);
+		p[6] = IPPROTO_UDP;
+		p[7] = 64;
+		memset(p + 8, 0, 32);
+		if (src->ss_family == AF_INET6)
+			memcpy(p + 8, &s6->sin6_addr, 16);
+		if (dst->ss_family == AF_INET6)
+			memcpy(p + 24, &d6->sin6_addr, 16);
+		udp = (uint16_t *)(p + ip_len);
+		udp[0] = src->ss_family == AF_INET6 ? s6->sin6_port : 0;
+		udp[1] = dst->ss_family == AF_INET6 ? d6->sin6_port : 0;
+	}
+	else
+	{
+		ip_len = 20;
+		p[0] = 0x45;
+		p[1] = 0;
+		*(uint16_t *)(p + 2) = htons(ip_len + UDP_HEADER + len);
+		*(uint16_t *)(p + 4) = htons(r->ip_id++);
+		*(uint16_t *)(p + 6) = htons(0x4000); // Don't fragment
+		p[8] = 64;
+		p[9] = IPPROTO_UDP;
+		*(uint16_t *)(p + 10) = 0; // No checksum: Wireshark does not check it by default
+		put32(p + 12, src->ss_family == AF_INET ? s4->sin_addr.s_addr : 0);
+		put32(p + 16, dst->ss_family == AF_INET ? d4->sin_addr.s_addr : 0);
+		udp = (uint16_t *)(p + ip_len);
+		udp[0] = src->ss_family == AF_INET ? s4->sin_port : 0;
+		udp[1] = dst->ss_family == AF_INET ? d4->sin_port : 0;
+	}
+	udp[2] = htons(UDP_HEADER + len);
+	udp[3] = 0;
+	return ip_len + UDP_HEADER;
+}
+
+/* Drops the oldest block */
+static void drop_oldest(struct pcap_ring *r)
+{
+	uint32_t len = *(uint32_t *)(r->map + r->tail + 4);
+
+	r->tail += len;
+	r->overwritten++;
+	if (r->tail >= r->wrap || len < EPB_HEADER) // Not a block: someone else wrote to the file, start over
+	{ // All the blocks before the wrap are gone
+		r->tail = r->start;
+		r->wrapped = 0;
+	}
+}
+
+uint32_t *pcap_write(struct pcap_ring *r, uint64_t ts_ns, uint32_t flags, const char *comment, const struct sockaddr_storage *src,
+					 const struct sockaddr_storage *dst, const struct iovec *iov, int iovcnt)
+{
+	size_t hdr_len = (r->family == AF_INET6 ? 40 : 20) + UDP_HEADER;
+	size_t total = 0, cap, n, copied;
+	size_t comment_len = comment ? strlen(comment) : 0;
+	size_t block;
+	uint32_t *epb_flags;
+	char *p;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	cap = total < r->snaplen ? total : r->snaplen;
+	block = EPB_HEADER + PAD4(hdr_len + cap) + 8 + (comment ? 4 + PAD4(comment_len) : 0) + 4 + 4;
+	if (block > (r->size - r->start) / 2)
+		return NULL;
+	if (r->head + block > r->size)
+	{ // No room before the end: go back to the start, the blocks from tail to here are the oldest
+		while (r->wrapped)
+			drop_oldest(r);
+		r->wrap = r->head;
+		r->head = r->start;
+		r->wrapped = 1;
+	}
+	while (r->wrapped && r->tail < r->head + block)
+		drop_oldest(r); // Make room
+
+	ts_ns += r->ts_offset;
+	p = r->map + r->head;
+	put32(p, BLOCK_EPB);
+	put32(p + 4, block);
+	put32(p + 8, 0);
+	put32(p + 12, ts_ns >> 32);
+	put32(p + 16, ts_ns);
+	put32(p + 20, hdr_len + cap);
+	put32(p + 24, hdr_len + total);
+	p += EPB_HEADER;
+	put_ip_udp(r, p, src, dst, total);
+	for (i = 0, copied = 0; i < iovcnt && copied < cap; i++, copied += n)
+	{
+		n = iov[i].iov_len < cap - copied ? iov[i].iov_len : cap - copied;
+		memcpy(p + hdr_len + copied, iov[i].iov_base, n);
+	}
+	memset(p + hdr_len + cap, 0, PAD4(hdr_len + cap) - (hdr_len + cap));
+	p += PAD4(hdr_len + cap);
+	p += put_option(p, OPT_EPB_FLAGS, &flags, 4);
+	epb_flags = (uint32_t *)(p - 4);
+	if (comment)
+		p += put_option(p, OPT_COMMENT, comment, comment_len);
+	put32(p, OPT_ENDOFOPT);
+	put32(p + 4, block);
+
+	r->head += block;
+	r->packets++;
+	return epb_flags;
+}
+
+void pcap_close(struct pcap_ring *r)
+{
+	size_t before, after;
+	char *tmp;
+
+	if (!r->map)
+		return;
+	if (r->wrapped)
+	{ // Oldest blocks (tail to wrap) first, then the ones at the start
+		before = r->wrap - r->tail;
+		after = r->head - r->start;
+		tmp = malloc(after);
+		if (!tmp)
+		{
+			perror("pcap");
+			return;
+		}
+		memcpy(tmp, r->map + r->start, after);
+		memmove(r->map + r->start, r->map + r->tail, before);
+		memcpy(r->map + r->start + before, tmp, after);
+		free(tmp);
+		r->head = r->start + before + after;
+	}
+	munmap(r->map, r->size);
+	r->map = NULL;
+	if (ftruncate(r->fd, r->head) < 0)
+		perror("pcap");
+	close(r->fd);
+}
@@ -0,0 +1,68 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+	Packet capture of the runtime (--pcap FILE), in pcapng format, written to a
+memory-mapped file of fixed size used as a ring: when it is full, the oldest
+packets are overwritten. pcap_close puts the packets back in order and
+truncates the file, so what is left is a regular pcapng file for Wireshark or
+tshark (the ring only exists while the program runs).
+
+	Every packet is an Enhanced Packet Block with:
+		- A timestamp in ns: CLOCK_MONOTONIC plus the offset to CLOCK_REALTIME
+	when the capture started, so intervals are monotonic and dates are real.
+		- An IPv4 or IPv6 header and a UDP header made up from the addresses of
+	the ends (the local one may be the wildcard address), followed by the
+	datagram as sent: the connection header with -n, then the packet (cksum,
+	len, ackno, seqno, data; host byte order).
+		- epb_flags: direction (inbound or outbound) and bit 24 (CRC error) for
+	corrupted packets, sent or received.
+		- A comment for the packets that never reached the network: "lost" by
+	the emulator, or "dropped" because a queue was full.
+	Writing a packet is filling in about 70 bytes of headers plus one memcpy
+per piece of the datagram (usually one), and never allocates.
+*/
+
+#ifndef PCAP_H
+#define PCAP_H
+
+#define PCAP_OUTBOUND 2 /* epb_flags direction */
+#define PCAP_INBOUND 1
+#define PCAP_CRC_ERROR (1u << 24)
+
+struct pcap_ring
+{
+	char *map;		   /* The whole file */
+	size_t size;	   /* Bytes mapped */
+	size_t start;	   /* Offset of the first packet block, after the section and interface headers */
+	size_t head;	   /* Offset where the next block goes */
+	size_t tail;	   /* Offset of the oldest block */
+	size_t wrap;	   /* While wrapped: end of the blocks before head went back to start */
+	int wrapped;	   /* Non-zero if the blocks go from tail to wrap, then from start to head */
+	int fd;
+	int family;		   /* AF_INET or AF_INET6: all the addresses are of this family */
+	uint32_t snaplen;  /* Bytes of each datagram kept, at most */
+	uint64_t ts_offset; /* CLOCK_REALTIME - CLOCK_MONOTONIC when opened */
+	uint16_t ip_id;
+	long packets;	   /* Written */
+	long overwritten;  /* Older packets lost when the ring wrapped */
+};
+
+/* Creates path, size bytes long. snaplen 0 keeps whole datagrams. Returns 0, or -1 with errno set */
+int pcap_open(struct pcap_ring *r, const char *path, size_t size, uint32_t snaplen, int family);
+
+/*
+	Writes a datagram made of iovcnt pieces, sent from src to dst at ts_ns
+(CLOCK_MONOTONIC). flags are the epb_flags; comment is NULL or a string
+constant. Returns the epb_flags of the block, so that bits known later can be
+added, or NULL if the datagram was not written.
+*/
+uint32_t *pcap_write(struct pcap_ring *r, uint64_t ts_ns, uint32_t flags, const char *comment, const struct sockaddr_storage *src,
+					 const struct sockaddr_storage *dst, const struct iovec *iov, int iovcnt);
+
+/* Puts the blocks in order, truncates the file to them and closes it */
+void pcap_close(struct pcap_ring *r);
+
+#endif /* PCAP_H */
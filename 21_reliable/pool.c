@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+void pool_init(struct packet_pool *p, int size, size_t slot_size)
+{
+	int i;
+
+	p->slot_size = (slot_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+	p->base = aligned_alloc(POOL_ALIGN, size * p->slot_size);
+	p->free = malloc(size * sizeof(*p->free));
+	p->refs = calloc(size, sizeof(*p->refs));
+	if (!p->base || !p->free || !p->refs)
+	{
+		fprintf(stderr, "packet pool: out of memory allocating %d buffers of %zu bytes\n", size, p->slot_size);
+		abort();
+	}
+	// Hand out the lowest addresses first
+	for (i = 0; i < size; i++)
+		p->free[i] = (struct packet *)(p->base + (size_t)(size - 1 - i) * p->slot_size);
+	p->size = p->nfree = p->min_free = size;
+}
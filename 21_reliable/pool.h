@@ -0,0 +1,78 @@
+#include <stddef.h>
+
+/*
+	Fixed-size pool of packet buffers. All the buffers are allocated once, at
+startup, in a single cache-line aligned block; getting and releasing a buffer
+just pops or pushes a pointer on the free stack, so the hot path never calls
+malloc. Buffers are slot_size bytes (rounded up to POOL_ALIGN), so every buffer
+starts on its own cache line.
+	Every buffer has a reference count: pool_get hands it out with one reference,
+pool_hold adds one (the transmit queue, while it sends a payload from the
+buffer by reference) and pool_put drops one; the buffer is free again when the
+last one goes.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_ALIGN 64
+
+struct packet; /* packet_t, see rlib.h */
+
+struct packet_pool
+{
+	char *base;		  /* size * slot_size bytes */
+	struct packet **free; /* Stack of free buffers */
+	int size;		  /* Buffers in the pool */
+	int nfree;		  /* Buffers in the free stack */
+	int min_free;	  /* Lowest nfree so far */
+	size_t slot_size; /* Bytes per buffer */
+	int *refs;		  /* References to each buffer, 0 if it is free */
+};
+
+/* Allocates size buffers of at least slot_size bytes, all free */
+void pool_init(struct packet_pool *p, int size, size_t slot_size);
+
+/* Index of the buffer holding address ptr */
+static inline int pool_index(const struct packet_pool *p, const void *ptr)
+{
+	return ((const char *)ptr - p->base) / p->slot_size;
+}
+
+/* Non-zero if ptr points into one of the buffers */
+static inline int pool_contains(const struct packet_pool *p, const void *ptr)
+{
+	return (const char *)ptr >= p->base && (const char *)ptr < p->base + (size_t)p->size * p->slot_size;
+}
+
+/* Returns a free buffer, or NULL if all of them are in use */
+static inline struct packet *pool_get(struct packet_pool *p)
+{
+	struct packet *pkt;
+
+	if (p->nfree == 0)
+		return NULL;
+	if (--p->nfree < p->min_free)
+		p->min_free = p->nfree;
+	pkt = p->free[p->nfree];
+	p->refs[pool_index(p, pkt)] = 1;
+	return pkt;
+}
+
+/* Adds a reference to the buffer that holds ptr (anywhere inside it), and returns the buffer */
+static inline struct packet *pool_hold(struct packet_pool *p, const void *ptr)
+{
+	int i = pool_index(p, ptr);
+
+	p->refs[i]++;
+	return (struct packet *)(p->base + (size_t)i * p->slot_size);
+}
+
+/* Drops a reference to a buffer obtained with pool_get or pool_hold: it is free after the last one */
+static inline void pool_put(struct packet_pool *p, struct packet *pkt)
+{
+	if (--p->refs[pool_index(p, pkt)] == 0)
+		p->free[p->nfree++] = pkt;
+}
+
+#endif /* POOL_H */
@@ -1,79 +1,503 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "rlib.h"
+#include "scoreboard.h"
 
-static char last_payload[MAX_PAYLOAD]; 
-static int last_payload_size;          
-static int waiting_for_ack;            
-static uint32_t next_seqno;            
-static uint32_t expected_seqno;        
-static long timeout_val;               
+/*
+    Two ARQ variants share the same state:
+        - Go-Back-N (default): ACKs are cumulative (ackno = next expected seqno),
+      the receiver drops out-of-order frames and a timeout resends the whole
+      window: as many frames as the effective window allows at once, the
+      rest as ACKs open it. The receiver answers every out-of-order frame with
+      the ACK of the gap, so DUP_THRESH duplicate ACKs also resend the window,
+      as a loss instead of a timeout (fast retransmit).
+        - Selective Repeat (-r): ACKs confirm a single frame (ackno = seqno),
+      the receiver buffers out-of-order frames and every frame has its own
+      retransmission timer (timer number = seqno % window), so only the frames
+      that were lost are resent.
+        - Selective Repeat with SACK (-r -k): ACKs are cumulative plus a bitmap
+      of the frames received after the cumulative point. The sender merges
+      them into its scoreboard and resends a hole as soon as DUP_THRESH later
+      frames have been confirmed, without waiting for its timer.
+    In both, timers use the adaptive RTO kept by the runtime (GET_RTO). Frames
+    are timestamped when first sent and, following Karn's algorithm, only
+    frames that were never retransmitted produce RTT samples.
+    Receivers delay cumulative ACKs (Go-Back-N and SACK): one ACK covers
+    c.ack_every in-order frames, or whatever arrived in the c.ack_delay ns
+    since the first frame not yet confirmed. Out-of-order frames, and frames
+    that fill a gap, are confirmed at once so the sender learns about holes
+    without delay. Plain Selective Repeat ACKs name a single frame and can not
+    be coalesced.
+    The frames in flight are also limited by the runtime congestion window
+    (CONGESTION_WINDOW), which is told about every ACK, loss and timeout.
+    All the state of a connection lives in a struct connection, created by
+    connection_initialization and passed back by the runtime to every
+    callback, so one process can run many connections (-n).
+*/
 
-void connection_initialization(int window_size, long timeout_in_ns) {
-    waiting_for_ack = 0;
-    next_seqno = 1;      
-    expected_seqno = 1; 
-    timeout_val = timeout_in_ns; 
-    last_payload_size = 0;
+// In-flight frame kept for retransmission. Slot for seqno s is s % window.
+struct tx_slot {
+    uint32_t seqno;
+    int size;
+    int retransmitted;  // Its ACK can not be used as an RTT sample
+    uint64_t sent_at;   // Time of the first transmission, in ns
+    packet_t *buf;      // Pool buffer holding the payload, sent by reference; freed when the frame is acknowledged
+};
 
+// Out-of-order frame waiting for the gap before it to be filled (Selective Repeat)
+struct rx_slot {
+    packet_t *pkt;  // Received packet, kept with PACKET_KEEP instead of copied
+};
+
+// Timer of the delayed ACK; frame timers use 0 (Go-Back-N) or seqno % window (Selective Repeat)
+#define ACK_TIMER (TIMER_COUNT - 1)
+
+struct connection {
+    struct tx_slot *tx_ring;  // Sender ring buffer, window_size slots
+    struct rx_slot *rx_ring;  // Receiver reorder buffer, window_size slots
+    int window;               // Max. unacknowledged frames in flight (-w)
+    uint32_t base_seqno;      // Oldest unacknowledged seqno
+    uint32_t next_seqno;      // Next seqno to be used by send_callback
+    uint32_t expected_seqno;
+    uint32_t recovery_seqno;  // Losses of frames below it belong to the last congestion event
+    uint32_t resend_seqno;    // Go-Back-N: the frames in [resend_seqno, next_seqno) must be sent again after a loss
+    int dup_acks;             // Go-Back-N: ACKs of base_seqno received since it last moved
+    // Selective Repeat scoreboards, bit per seqno
+    struct scoreboard acked;     // Sender: frames confirmed in [base_seqno, next_seqno)
+    struct scoreboard received;  // Receiver: frames buffered in [expected_seqno, expected_seqno + window)
+    uint32_t rx_high;            // Receiver: highest seqno buffered + 1
+    uint32_t high_sacked;        // Sender: highest seqno confirmed + 1
+    uint32_t lost_scan;          // Sender: the holes below it were already resent by SACK recovery
+    int unacked_frames;          // Receiver: in-order frames not confirmed yet
+    int sack_peer;               // Receiver: the peer accepts SACKs
+};
+
+// A hole is considered lost once this many later frames were confirmed (as the duplicate ACK threshold of TCP)
+#define DUP_THRESH 3
+
+void *connection_initialization(int window_size, long timeout_in_ns) {
+    struct connection *cn = xmalloc(sizeof(*cn));
+
+    memset(cn, 0, sizeof(*cn));
+    cn->window = window_size;
+    cn->base_seqno = 1;
+    cn->next_seqno = 1;
+    cn->expected_seqno = 1;
+    cn->recovery_seqno = 1;
+    cn->resend_seqno = 1;
+    cn->rx_high = cn->high_sacked = cn->lost_scan = 1;
+    cn->tx_ring = xmalloc(cn->window * sizeof(*cn->tx_ring));
+    memset(cn->tx_ring, 0, cn->window * sizeof(*cn->tx_ring));
+    if (c.selective_repeat) {
+        cn->rx_ring = xmalloc(cn->window * sizeof(*cn->rx_ring));
+        memset(cn->rx_ring, 0, cn->window * sizeof(*cn->rx_ring));
+        sb_init(&cn->acked, cn->window);
+        sb_init(&cn->received, cn->window);
+    }
+    return cn;
 }
 
-void receive_callback(packet_t *pkt, size_t pkt_size) {
-    if (VALIDATE_CHECKSUM(pkt) == 0) {
-        return; 
+void connection_destroy(void *state) {
+    struct connection *cn = state;
+
+    // Frames in flight and out-of-order frames still hold pool buffers
+    for (int i = 0; i < cn->window; i++) {
+        if (cn->tx_ring[i].buf) {
+            PACKET_FREE(cn->tx_ring[i].buf);
+        }
+        if (cn->rx_ring && cn->rx_ring[i].pkt) {
+            PACKET_FREE(cn->rx_ring[i].pkt);
+        }
     }
+    free(cn->tx_ring);
+    if (c.selective_repeat) {
+        free(cn->rx_ring);
+        sb_free(&cn->acked);
+        sb_free(&cn->received);
+    }
+    free(cn);
+}
 
-    if (IS_ACK_PACKET(pkt)) {
-        if (waiting_for_ack && pkt->ackno > (next_seqno - 1)) {
-            CLEAR_TIMER(0);           
-            waiting_for_ack = 0;
-            RESUME_TRANSMISSION();    
+static void rtt_sample(struct tx_slot *slot) {
+    if (!slot->retransmitted) {
+        RTT_SAMPLE(CURRENT_TIME_NS() - slot->sent_at);
+    }
+}
 
+// ackno field of our data packets: offers SACK to the peer if enabled
+static uint32_t data_ackno() {
+    return c.sack ? SACK_PERMITTED : 0;
+}
+
+// Frames that can be in flight: the flow control window, limited by the congestion window
+static int effective_window(struct connection *cn) {
+    int cwnd = CONGESTION_WINDOW();
+    return cwnd < cn->window ? cwnd : cn->window;
+}
+
+// The frames in [from, to) are acknowledged: their buffers go back to the pool
+static void release_frames(struct connection *cn, uint32_t from, uint32_t to) {
+    for (uint32_t s = from; s != to; s++) {
+        struct tx_slot *slot = &cn->tx_ring[s % cn->window];
+        PACKET_FREE(slot->buf);
+        slot->buf = NULL;
+    }
+}
+
+// Go-Back-N: sends again the frames pending since the last timeout, as many as the window allows
+static void gbn_resend(struct connection *cn) {
+    if (cn->resend_seqno - cn->base_seqno > cn->next_seqno - cn->base_seqno) {
+        cn->resend_seqno = cn->base_seqno;  // Below the window: those were acknowledged meanwhile
+    }
+    while (cn->resend_seqno != cn->next_seqno && cn->resend_seqno - cn->base_seqno < effective_window(cn)) {
+        struct tx_slot *slot = &cn->tx_ring[cn->resend_seqno % cn->window];
+        slot->retransmitted = 1;
+        SEND_DATA_PACKET_REF(slot->size + DATA_PACKET_HEADER, 0, slot->seqno, slot->buf->data);
+        cn->resend_seqno++;
+    }
+}
 
+static void gbn_receive_ack(struct connection *cn, uint32_t ackno) {
+    // Cumulative ACK: ackno is the next seqno the receiver expects
+    if (ackno > cn->base_seqno && ackno <= cn->next_seqno) {
+        rtt_sample(&cn->tx_ring[(ackno - 1) % cn->window]);
+        CC_ON_ACK(ackno - cn->base_seqno);
+        release_frames(cn, cn->base_seqno, ackno);
+        cn->base_seqno = ackno;
+        ACKNOWLEDGED_UP_TO(cn->base_seqno);
+        if (cn->base_seqno == cn->next_seqno) {
+            CLEAR_TIMER(0);
+        } else {
+            SET_TIMER(0, GET_RTO());
         }
-    } 
-    else {
-        if (pkt->seqno == expected_seqno) {
-            ACCEPT_DATA(pkt->data, pkt->len - DATA_PACKET_HEADER); 
-            expected_seqno++; 
+        cn->dup_acks = 0;
+        gbn_resend(cn);
+        RESUME_TRANSMISSION();
+    } else if (ackno == cn->base_seqno && cn->base_seqno != cn->next_seqno && ++cn->dup_acks == DUP_THRESH) {
+        // Later frames arrive but base_seqno does not: it was lost. Once per window, as in the timeout
+        if (cn->base_seqno >= cn->recovery_seqno) {
+            CC_ON_LOSS();
+            cn->recovery_seqno = cn->next_seqno;
         }
-        
-        SEND_ACK_PACKET(expected_seqno);
+        cn->resend_seqno = cn->base_seqno;
+        gbn_resend(cn);
+        SET_TIMER(0, GET_RTO());
     }
 }
 
-void send_callback() {
-    if (waiting_for_ack) {
-        PAUSE_TRANSMISSION(); 
+// Marks frame seqno as confirmed (Selective Repeat). Returns 1 if it was not confirmed yet
+static int sr_ack_frame(struct connection *cn, uint32_t seqno) {
+    if (sb_test(&cn->acked, seqno)) {
+        return 0;
+    }
+    sb_set(&cn->acked, seqno);
+    CLEAR_TIMER(seqno % cn->window);
+    rtt_sample(&cn->tx_ring[seqno % cn->window]);
+    if (seqno >= cn->high_sacked) {
+        cn->high_sacked = seqno + 1;
+    }
+    return 1;
+}
+
+// Slides the window over the confirmed frames at its start
+static void sr_advance_base(struct connection *cn) {
+    uint32_t new_base = sb_find_first_zero(&cn->acked, cn->base_seqno, cn->next_seqno);
+
+    if (new_base == cn->base_seqno) {
+        return;
+    }
+    sb_clear_range(&cn->acked, cn->base_seqno, new_base);  // Bits are reused by seqno + window
+    release_frames(cn, cn->base_seqno, new_base);
+    cn->base_seqno = new_base;
+    ACKNOWLEDGED_UP_TO(cn->base_seqno);
+    RESUME_TRANSMISSION();
+}
+
+// Resends a frame whose timer has not expired yet, because it is known to be lost
+static void sr_retransmit(struct connection *cn, uint32_t seqno) {
+    struct tx_slot *slot = &cn->tx_ring[seqno % cn->window];
+
+    if (seqno >= cn->recovery_seqno) {
+        CC_ON_LOSS();
+        cn->recovery_seqno = cn->next_seqno;
+    }
+    slot->retransmitted = 1;
+    SEND_DATA_PACKET_REF(slot->size + DATA_PACKET_HEADER, data_ackno(), seqno, slot->buf->data);
+    SET_TIMER(seqno % cn->window, GET_RTO());
+}
+
+static void sr_receive_ack(struct connection *cn, uint32_t ackno) {
+    if (ackno < cn->base_seqno || ackno >= cn->next_seqno) {
+        return;  // Duplicate ACK for a frame already out of the window
+    }
+    if (sr_ack_frame(cn, ackno)) {
+        CC_ON_ACK(1);
+    }
+    if (ackno == cn->base_seqno) {
+        sr_advance_base(cn);
+    }
+}
+
+/*
+    Resends the holes below high_sacked that have at least DUP_THRESH confirmed
+    frames above them. Holes are visited in order and a hole with fewer
+    confirmed frames above ends the scan (the ones after it have even fewer),
+    so every hole is examined once per SACK and resent at most once.
+*/
+static void sack_retransmit_holes(struct connection *cn) {
+    uint32_t from = cn->lost_scan > cn->base_seqno ? cn->lost_scan : cn->base_seqno;
+
+    if (from >= cn->high_sacked) {
         return;
     }
+    int above = sb_count(&cn->acked, from, cn->high_sacked);
+
+    while (above >= DUP_THRESH) {
+        uint32_t hole = sb_find_first_zero(&cn->acked, from, cn->high_sacked);
+        if (hole == cn->high_sacked) {
+            break;
+        }
+        above -= sb_count(&cn->acked, from, hole);
+        if (above < DUP_THRESH) {
+            break;
+        }
+        sr_retransmit(cn, hole);
+        from = cn->lost_scan = hole + 1;
+    }
+}
 
+static void sack_receive_ack(struct connection *cn, const struct sack_packet *sp) {
+    uint32_t ackno = sp->ackno;
+    int nwords = (sp->len - SACK_PACKET_HEADER) / sizeof(uint64_t);
+    int newly = 0;
 
-    char buffer[MAX_PAYLOAD];
-    int bytes_read = READ_DATA_FROM_APP_LAYER(buffer, MAX_PAYLOAD);
+    if (ackno < cn->base_seqno || ackno > cn->next_seqno || nwords > SACK_WORDS) {
+        return;  // Older than what we already know
+    }
+    // Cumulative part: every frame before ackno that was not confirmed yet
+    for (uint32_t s = sb_find_first_zero(&cn->acked, cn->base_seqno, ackno); s != ackno; s = sb_find_first_zero(&cn->acked, s + 1, ackno)) {
+        newly += sr_ack_frame(cn, s);
+    }
+    // Selective part: walk the set bits of each word
+    for (int w = 0; w < nwords; w++) {
+        for (uint64_t bits = sp->sack[w]; bits; bits &= bits - 1) {
+            uint32_t s = ackno + 1 + 64 * w + __builtin_ctzll(bits);
+            if (s >= cn->next_seqno) {
+                break;
+            }
+            newly += sr_ack_frame(cn, s);
+        }
+    }
+    if (newly) {
+        CC_ON_ACK(newly);
+    }
+    sr_advance_base(cn);
+    sack_retransmit_holes(cn);
+}
 
+// Confirms everything received so far to a SACK-capable sender
+static void send_sack(struct connection *cn) {
+    uint64_t sack[SACK_WORDS];
+    int nbits = 0;
+
+    if (cn->rx_high > cn->expected_seqno + 1) {
+        nbits = cn->rx_high - cn->expected_seqno - 1;
+        if (nbits > 64 * SACK_WORDS) {
+            nbits = 64 * SACK_WORDS;
+        }
+        sb_extract(&cn->received, cn->expected_seqno + 1, nbits, sack);
+    }
+    SEND_SACK_PACKET(cn->expected_seqno, sack, (nbits + 63) / 64);
+}
+
+// Sends the cumulative ACK (SACK if the peer accepts it) for everything received so far
+static void send_ack_now(struct connection *cn) {
+    if (cn->sack_peer) {
+        send_sack(cn);
+    } else {
+        SEND_ACK_PACKET(cn->expected_seqno);
+    }
+    if (cn->unacked_frames) {
+        cn->unacked_frames = 0;
+        CLEAR_TIMER(ACK_TIMER);
+    }
+}
+
+// A frame arrived in order and did not fill a gap: its ACK may wait
+static void delay_ack(struct connection *cn) {
+    if (++cn->unacked_frames >= c.ack_every) {
+        send_ack_now(cn);
+    } else if (cn->unacked_frames == 1) {
+        SET_TIMER(ACK_TIMER, c.ack_delay);
+    }
+}
+
+static void sr_receive_data(struct connection *cn, packet_t *pkt) {
+    uint32_t seqno = pkt->seqno;
+
+    cn->sack_peer = c.sack && (pkt->ackno & SACK_PERMITTED);
+    // Frames below the window were already delivered: their ACK was lost, confirm them again
+    if (seqno < cn->expected_seqno) {
+        if (cn->sack_peer) {
+            send_ack_now(cn);
+        } else {
+            SEND_ACK_PACKET(seqno);
+        }
+        return;
+    }
+    if (seqno - cn->expected_seqno >= cn->window) {
+        return;  // Beyond the reorder buffer, the sender will retransmit it
+    }
+
+    // In order with nothing buffered after it: the only case where the ACK can be delayed
+    int in_order = seqno == cn->expected_seqno && cn->rx_high <= seqno;
+    if (seqno == cn->expected_seqno) {
+        // The frame the application is waiting for: deliver it straight from the receive buffer
+        ACCEPT_DATA(pkt->data, pkt->len - DATA_PACKET_HEADER);
+        cn->expected_seqno++;
+    } else if (!sb_test(&cn->received, seqno)) {
+        if (!PACKET_KEEP(pkt)) {
+            return;  // No buffer to hold it, the sender will retransmit it
+        }
+        sb_set(&cn->received, seqno);
+        cn->rx_ring[seqno % cn->window].pkt = pkt;
+        if (seqno >= cn->rx_high) {
+            cn->rx_high = seqno + 1;
+        }
+    }
+
+    // Deliver the contiguous run of buffered frames after it
+    while (sb_test(&cn->received, cn->expected_seqno)) {
+        struct rx_slot *slot = &cn->rx_ring[cn->expected_seqno % cn->window];
+        ACCEPT_DATA(slot->pkt->data, slot->pkt->len - DATA_PACKET_HEADER);
+        PACKET_FREE(slot->pkt);
+        slot->pkt = NULL;
+        sb_clear(&cn->received, cn->expected_seqno);
+        cn->expected_seqno++;
+    }
+    if (!cn->sack_peer) {
+        SEND_ACK_PACKET(seqno);
+    } else if (in_order) {
+        delay_ack(cn);
+    } else {
+        send_ack_now(cn);
+    }
+}
+
+void receive_callback(void *state, packet_t *pkt, size_t pkt_size) {
+    struct connection *cn = state;
+
+    if (VALIDATE_CHECKSUM(pkt) == 0) {
+        return;
+    }
+
+    if (IS_ACK_PACKET(pkt)) {
+        if (IS_SACK_PACKET(pkt)) {
+            if (c.sack) {
+                sack_receive_ack(cn, (struct sack_packet *)pkt);
+            }
+        } else if (c.selective_repeat) {
+            sr_receive_ack(cn, pkt->ackno);
+        } else {
+            gbn_receive_ack(cn, pkt->ackno);
+        }
+    }
+    else if (c.selective_repeat) {
+        sr_receive_data(cn, pkt);
+    }
+    else {
+        if (pkt->seqno == cn->expected_seqno) {
+            ACCEPT_DATA(pkt->data, pkt->len - DATA_PACKET_HEADER);
+            cn->expected_seqno++;
+            delay_ack(cn);
+        } else {
+            send_ack_now(cn);  // Duplicate ACK: tells the sender where the gap starts
+        }
+    }
+}
+
+void send_callback(void *state) {
+    struct connection *cn = state;
+
+    if (cn->next_seqno - cn->base_seqno >= effective_window(cn)) {
+        PAUSE_TRANSMISSION();
+        return;
+    }
+
+    struct tx_slot *slot = &cn->tx_ring[cn->next_seqno % cn->window];
+    if (!slot->buf && !(slot->buf = PACKET_ALLOC())) {
+        return;  // Pool exhausted, try again when frames are acknowledged
+    }
+    int bytes_read = READ_DATA_FROM_APP_LAYER(slot->buf->data, c.payload);
 
     if (bytes_read > 0) {
-        memcpy(last_payload, buffer, bytes_read);
-        last_payload_size = bytes_read;
+        slot->seqno = cn->next_seqno;
+        slot->size = bytes_read;
+        slot->retransmitted = 0;
+        slot->sent_at = CURRENT_TIME_NS();
+        SEND_DATA_PACKET_REF(bytes_read + DATA_PACKET_HEADER, data_ackno(), cn->next_seqno, slot->buf->data);
 
+        if (c.selective_repeat) {
+            SET_TIMER(cn->next_seqno % cn->window, GET_RTO());
+        } else if (cn->base_seqno == cn->next_seqno) {
+            SET_TIMER(0, GET_RTO());
+        }
+        if (cn->resend_seqno == cn->next_seqno) {
+            cn->resend_seqno++;  // Nothing pending to resend: keep it at the end of the window
+        }
+        cn->next_seqno++;
 
-        SEND_DATA_PACKET(bytes_read + DATA_PACKET_HEADER, 0, next_seqno, last_payload);
-        
-        SET_TIMER(0, timeout_val); 
-        
-        next_seqno++;
-        waiting_for_ack = 1; 
-        PAUSE_TRANSMISSION(); 
+        if (cn->next_seqno - cn->base_seqno >= effective_window(cn)) {
+            PAUSE_TRANSMISSION();
+        }
     }
 }
 
-void timer_callback(int timer_number) {
-    if (timer_number == 0 && waiting_for_ack) {
-        SEND_DATA_PACKET(last_payload_size + DATA_PACKET_HEADER, 0, next_seqno - 1, last_payload);
-        SET_TIMER(0, timeout_val); 
+void timer_callback(void *state, int timer_number) {
+    struct connection *cn = state;
+
+    if (timer_number == ACK_TIMER) {
+        send_ack_now(cn);
+        return;
+    }
+    if (c.selective_repeat) {
+        // Selective Repeat: resend only the frame owning this timer
+        struct tx_slot *slot = &cn->tx_ring[timer_number];
+        if (slot->seqno >= cn->base_seqno && slot->seqno < cn->next_seqno && !sb_test(&cn->acked, slot->seqno)) {
+            // Back off once per loss event, i.e. when the oldest frame times out, not for every frame
+            if (slot->seqno == cn->base_seqno) {
+                RTO_BACKOFF();
+            }
+            // A frame lost twice means nothing gets through; otherwise cut the window once per window of data
+            if (slot->seqno == cn->base_seqno && slot->retransmitted) {
+                CC_ON_TIMEOUT();
+                cn->recovery_seqno = cn->next_seqno;
+            } else if (slot->seqno >= cn->recovery_seqno) {
+                CC_ON_LOSS();
+                cn->recovery_seqno = cn->next_seqno;
+            }
+            slot->retransmitted = 1;
+            SEND_DATA_PACKET_REF(slot->size + DATA_PACKET_HEADER, data_ackno(), slot->seqno, slot->buf->data);
+            SET_TIMER(timer_number, GET_RTO());
+        }
+        return;
+    }
 
+    if (timer_number != 0 || cn->base_seqno == cn->next_seqno) {
+        return;
     }
-}
\ No newline at end of file
+
+    // Go-Back-N: the whole outstanding window goes again, but only as much as the (now smaller) effective window
+    // right away; the rest follows as ACKs open it (gbn_resend)
+    RTO_BACKOFF();
+    CC_ON_TIMEOUT();
+    cn->recovery_seqno = cn->next_seqno;
+    cn->dup_acks = 0;
+    cn->resend_seqno = cn->base_seqno;
+    gbn_resend(cn);
+    SET_TIMER(0, GET_RTO());
+}
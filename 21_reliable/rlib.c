@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* sendmmsg, recvmmsg, pthread_setaffinity_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -9,15 +10,40 @@
 #include <getopt.h>
 #include <assert.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <signal.h>
 #include <time.h>
 #include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <linux/filter.h>
 
 #include "rlib.h"
+#include "timer_wheel.h"
+#include "congestion.h"
+#include "pool.h"
+#include "checksum.h"
+#include "impair.h"
+#include "conntable.h"
+#include "metrics.h"
+#include "hist.h"
+#include "pcap.h"
+#include "sim.h"
+
+#ifdef SIMULATION /* make sim */
+#define clock_gettime sim_clock_gettime /* Every date comes from the virtual clock, see sim.h */
+static const int simulation = 1;
+#else
+static const int simulation = 0;
+#endif
 
 /*
 	This code is adapted for Universidad del Atlantico - "Redes de Ordenadores"
@@ -36,56 +62,255 @@ char *progname;
 int opt_debug;
 struct config_common c;
 
-int nfd;					  /* network file descriptor */
+__thread int nfd;					  /* network file descriptor */
 struct sockaddr_storage peer; /* network peer */
-int continue_execution;
+volatile sig_atomic_t continue_execution; /* Cleared to stop: on errors, or by SIGINT / SIGTERM */
 
 // synthetic_traffic:
 //  If >0, it means we use the synthetic traffic generator; the application sends a flow of messages
 //  If ==0, the console is used as the input/output of the application (default config)
 static int synthetic_traffic;
-int synth_tr_start;
+__thread int synth_tr_start;
 int synth_data_block;
-int synth_tx_index;
-int synth_rx_index;
-int synth_tx_index_1024;
-int synth_rx_index_1024;
-
-static int rpoll;	   /* If >0, it means we need to poll the input (console). The value is the offset into cevents array */
-static int npoll;	   /* If >0, it means we need to poll the network. The value is the offset into cevents array */
-static int rfd;		   /* input file descriptor */
-static int wfd;		   /* output file descriptor */
-static char read_eof;  /* zero if haven't received EOF */
-static char write_err; /* zero if it's okay to write to wfd */
-static char xoff;	   /* non-zero to pause reading */
+#define SYNTH_STAMP_OFFSET 1 /* Synthetic blocks: index byte, then the CLOCK_REALTIME date they were generated (if they are long enough) */
+
+// Fixed-size transfer (--bytes / --blocks): an end that starts sends exactly transfer_blocks synthetic blocks
+#define TRANSFER_LINGER_NS MAX_RTO_NS /* Once everything arrived, quiet time before leaving: the peer would have resent its last block by then */
+static long long transfer_blocks;			 /* 0: the synthetic traffic never ends */
+static int transfer_ends, transfer_ends_done; /* Ends run by this process (2 in a simulation), and the ones whose transfer is complete */
+static __thread uint64_t transfer_tx_end;	 /* CLOCK_MONOTONIC date the last block sent was acknowledged, 0 until then */
+static __thread uint64_t transfer_rx_start;	 /* CLOCK_REALTIME date the first block received was generated by the other end... */
+static __thread uint64_t transfer_rx_end;	 /* ... and the last one was accepted here, 0 until then */
+static __thread int transfer_done;
+
+static __thread int rpoll;	   /* If >0, it means we need to poll the input (console). The value is the offset into cevents array */
+static __thread int npoll;	   /* If >0, it means we need to poll the network. The value is the offset into cevents array */
+static __thread int rfd;		   /* input file descriptor */
+static __thread int wfd;		   /* output file descriptor */
+static __thread char read_eof;  /* zero if haven't received EOF */
+static __thread char write_err; /* zero if it's okay to write to wfd */
+static __thread char xoff;	   /* non-zero to pause reading */
 
 static void conn_mkevents(void);
-static int debug_recv(int s, packet_t *buf, size_t len, int flags, struct sockaddr_storage *from);
+static uint64_t monotonic_ns();
+static uint64_t realtime_ns();
+static void transfer_progress();
+void print_stats();
 int compareDates(struct timespec time1, struct timespec time2);
 
-static struct pollfd *cevents;
-static int ncevents;
-static int *evreaders;
-static struct pollfd net_polling;
-
-static int paused_transmission; // 0: packets can be transmitted; >0: do not generate traffic (never call
-static packet_t *packet_ptr;
-static packet_t *corrupted_packet;
+static __thread struct pollfd *cevents;
+static __thread int ncevents;
+static __thread int *evreaders;
+
+// Event loop backend
+#define EPOLL_BATCH 16
+#define IDLE_WAKEUP_NS 1000000000 /* With no timers set, still wake up every second so that print_stats keeps its cadence */
+static int busy_poll;			  /* If >0, spin on check_events (low latency); otherwise sleep in wait_events */
+static __thread int epfd = -1;			  /* epoll instance of the blocking backend */
+static __thread int tfd = -1;			  /* timerfd armed to the earliest timer deadline */
+static __thread uint64_t tfd_armed_ns;	  /* Date the timerfd is armed to, 0 if it is not armed */
+static __thread uint32_t rfd_events;		  /* Events currently requested on rfd */
+static __thread int rfd_always_ready;	  /* rfd can not be watched by epoll (regular file), it is always readable */
+
+static __thread packet_t *packet_ptr;
+static size_t packet_size; // Largest packet: a data packet with c.payload bytes, or a full SACK packet
+
+// Batched datagram I/O (sendmmsg / recvmmsg)
+#define DEFAULT_IO_BATCH 32
+#define MAX_IO_BATCH 1024
+static int io_batch;	  /* Max. datagrams per sendmmsg / recvmmsg call (-m) */
+static __thread struct iovec *rx_iov;
+static __thread struct mmsghdr *tx_msgs, *rx_msgs;
+static __thread packet_t **rx_pkts; /* Pool buffers the next recvmmsg call receives into */
+static __thread int rx_current;	   /* Index in rx_pkts of the packet being delivered */
+static __thread struct sockaddr_storage *rx_addrs; /* Source address of each received message (-n) */
+static __thread uint64_t rx_now_ns;	   /* Date of the last recvmmsg call */
+static __thread struct packet_pool pool;
+static __thread long tx_syscalls, rx_syscalls;	   /* sendmmsg / recvmmsg calls */
+static __thread long tx_datagrams, rx_datagrams;	   /* Packets sent and received, however many were coalesced per message */
+static __thread long long received_bytes;		   /* Bytes received, headers included */
+
+// UDP segmentation offload (-g): GSO on send, GRO on receive
+#define GSO_MAX_SEGMENTS 64	   /* Kernel limit of segments per GSO message (UDP_MAX_SEGMENTS) */
+#define GSO_MAX_BYTES 65507	   /* A GSO message still has to fit in one UDP datagram */
+#define GRO_BUFFER_SIZE 65536  /* Receive buffer for a coalesced GRO message */
+static int udp_offload;
+static __thread int *tx_segs; /* Packets in each message of the current batch */
+static __thread union
+{
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr align;
+} *tx_cmsgs; /* UDP_SEGMENT control message of each GSO message */
+static __thread union
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+} *rx_cmsgs;		/* UDP_GRO control message of each received message */
+static __thread char *gro_bufs; /* io_batch receive buffers of GRO_BUFFER_SIZE bytes, the packets are split from them */
+#define POOL_SPARE 64 /* Buffers beyond the bound computed from the window, see init_pool */
+#define SOCKET_BUFFER_OVERHEAD 1024 /* Kernel bookkeeping per datagram charged to the socket buffers (approx.) */
+
+// Transmit queues: packets wait here until the socket accepts them
+#define MIN_TX_QUEUE 256
+#define MAX_TX_QUEUE 65536
+struct tx_queue
+{
+	char *pkts;			/* Ring of queued packets, slot_size bytes each */
+	struct iovec *iov;	/* Two iovecs per slot: the packet in the slot, then the payload if it is sent by reference */
+	char *corrupt;		/* Non-zero if the packet in the slot was corrupted */
+	struct conn **conn; /* Connection that sent the packet in the slot */
+	packet_t **held;	/* Pool buffer of the payload sent by reference, held until the packet is sent; NULL if none */
+	int size;			/* Capacity of the ring */
+	int head;			/* Slot of the oldest queued packet */
+	int count;			/* Queued packets */
+};
+static __thread struct tx_queue retx_q;	/* Retransmissions, sent before anything in data_q */
+static __thread struct tx_queue data_q;	/* New data and ACKs */
+static __thread int txq_backpressure;	/* Non-zero while the queue is too full to accept new data */
+static __thread int tx_blocked;			/* Non-zero while waiting for the socket to become writable */
+static size_t slot_size;		/* Bytes of a transmit slot or pool buffer: the connection header (-n) and a packet */
 
 // Variables related to timers
-int active_timers;
-int timer_set[TIMER_COUNT];					 // If >0, the given timer is set, and the expiration time is in the corresponding field in timer_exp_date
-struct timespec timer_exp_date[TIMER_COUNT]; // Contains the specific date (in ns) in which each timer expires
+static __thread struct timer_wheel timers; // Pending SET_TIMER deadlines, indexed by timer number
+#define IMPAIR_TIMER TIMER_COUNT  // Runtime timer, beyond the protocol's: release of the delay queue
+#define CONN_TIMER_BASE (IMPAIR_TIMER + 1) // With -n, the protocol timers are allocated from here on, see conn_timer_id
+
+// Network impairment emulator (see impair.h)
+static struct impair_config impair_cfg; /* Set from the command line */
+static __thread struct impair impair;
+static __thread struct delay_queue delay_q;		/* Packets held by the emulator, only allocated if some packets can be delayed */
+#define DELAYED_URGENT 1				/* delay_entry flags */
+#define DELAYED_CORRUPT 2
+#define DEFAULT_REORDER_DELAY_NS 1000000L
+
+// Retransmission timeout estimator (Jacobson/Karels), all values in ns
+struct rtt_estimator
+{
+	long srtt;	  /* Smoothed RTT */
+	long rttvar;  /* RTT variation */
+	long rto;	   /* Current retransmission timeout: SRTT + max(G, 4 RTTVAR), doubled once per backoff */
+	int backoff;   /* Consecutive backoffs applied to rto */
+	long samples;  /* Valid RTT samples so far */
+	long timeouts; /* Retransmission timeouts so far */
+	uint32_t backoff_base;	/* Frames acknowledged (acked_seqno) at the last timeout... */
+	uint32_t backoff_fresh; /* ... and the first seqno sent after it: once it is acknowledged the backoff ends */
+};
+
+// Congestion control
+static const struct cc_ops *cc_algorithm; /* Selected with -c */
+static FILE *cwnd_trace;				  /* If not NULL, every change of the window is logged here (-C) */
+static __thread double cc_last_traced;			  /* Window written in the last trace line */
+static __thread long cc_losses, cc_timeouts;
+static __thread double cc_sum, cc_min, cc_max;	  /* Window statistics since the last print_stats */
+static __thread long cc_count;
+
+/*
+	Connections. Without -n there is a single one, over a connected socket. With
+-n the socket is unconnected: every datagram starts with a struct conn_header
+carrying the connection ID, and the connection is found in conn_table from the
+source address and that ID. Connections the peer opens are created when their
+first packet arrives, and destroyed after CONN_IDLE_NS without receiving
+anything. Every API call acts on "cur", the connection whose callback is
+running.
+*/
+struct conn_header
+{
+	uint32_t id;	   /* Network byte order */
+	uint32_t reserved; /* Keeps the packet that follows 8-byte aligned */
+};
+
+struct conn_timer
+{
+	int number; /* Timer number of the protocol, -1 if the entry is empty */
+	int id;		/* Timer of the wheel */
+};
+
+struct conn
+{
+	struct conn_key key;	   /* Peer address and connection ID; the connection table points here */
+	void *state;			   /* Returned by connection_initialization */
+	struct rtt_estimator rtt;
+	struct cc_state cc;
+	uint32_t max_seqno_sent;   /* Highest seqno sent so far, to tell retransmissions apart */
+	uint32_t acked_seqno;	   /* Every frame below it was acknowledged (ACKNOWLEDGED_UP_TO) */
+	int paused;				   /* PAUSE_TRANSMISSION was called: the connection is not in the ready list */
+	struct conn *ready_prev, *ready_next;
+	int queued;				   /* Packets in the transmit and delay queues */
+	int passive;			   /* Opened by the peer: destroyed when idle */
+	int index;				   /* Position in conns */
+	uint64_t last_rx_ns;	   /* Date of the last packet received */
+	struct conn_timer *timers; /* Open-addressing map from timer number to wheel timer (-n only) */
+	int timers_mask;		   /* Entries - 1 */
+	int ntimers;			   /* Entries in use */
+	int synth_tx_index, synth_tx_index_1024; /* Synthetic traffic: index of the next block generated... */
+	int synth_rx_index, synth_rx_index_1024; /* ... and accepted */
+	long long synth_tx_blocks, synth_rx_blocks; /* Blocks generated and accepted, for a fixed-size transfer */
+};
+
+#define DEFAULT_MAX_CONNS 1024
+#define CONN_IDLE_NS 10000000000ULL /* 10 s */
+#define CONN_SWEEP_NS 1000000000ULL /* Idle connections are looked for once per second */
+static int multi_conn;				/* Non-zero with -n */
+static int open_conns;				/* Connections opened at startup (-n) */
+static int max_conns;				/* Max. connections at once (--max-conns) */
+static size_t wire_prefix;			/* Bytes before the packet in every datagram: sizeof(struct conn_header) with -n, 0 otherwise */
+static __thread struct conn *cur;			/* Connection whose callback is running */
+static __thread struct conn *main_conn;		/* The connection without -n; otherwise the first one opened (while it lasts), shown in the stats and the -C trace */
+static __thread struct conn **conns;			/* Every open connection */
+static __thread int nconns;
+static __thread struct conn *ready_head, *ready_tail; /* Connections that are not paused, served round-robin by the synthetic generator */
+static __thread struct conn_table conn_table;
+static __thread int *timer_free;				/* Stack of free wheel timers (-n) */
+static __thread int ntimer_free;
+static __thread struct conn **timer_conn;	/* Connection and timer number of each wheel timer (-n) */
+static __thread int *timer_number;
+static __thread int ntimer_ids;				/* Wheel timers allocated so far, above IMPAIR_TIMER */
+static __thread uint64_t last_sweep_ns;
+static __thread long conns_created, conns_closed, conns_refused;
+
+/*
+	Worker threads (-j). Every worker runs the whole runtime on its own socket,
+bound with SO_REUSEPORT to the same port as the others: event loop, timers,
+packet pool, transmit queues and connections. All that state is thread-local
+(__thread); only the configuration, set before the workers start, is shared.
+The kernel steers every datagram to the socket of the worker that owns its
+connection (see open_worker_sockets), so the workers never talk to each other.
+*/
+#define MAX_WORKERS 256
+struct worker
+{
+	pthread_t thread;
+	int index;
+	int fd; /* Socket of the worker */
+};
+static int nworkers;		 /* Worker threads (-j); 0: the main thread runs the runtime */
+static int pin_workers;		 /* Non-zero: worker i runs on the i-th CPU only (--pin) */
+static struct worker *workers;
+static int start_fd = -1;	 /* eventfd: the user pressed enter, the workers can start sending */
+static uint64_t impair_seed; /* Worker i uses impair_seed + i */
+static __thread int worker_index;
+static struct sockaddr_storage sim_addr; /* Simulation: address of both ends, each one sees the other at "peer" (see main) */
+static struct sim_config sim_cfg;
 
 // Stats
-long receivedPackets, receivedCorrectPackets, receivedCorruptPackets;
-long sentPackets, sent_correct_packets, sent_corrupt_packets;
-long long generated_app_bytes, accepted_app_bytes;			  // Correct application bytes, not headers
-long long sent_bytes, sent_correct_bytes, sent_corrupt_bytes; // Overall: Headers + application, including correct and corrupt packets
-struct timespec start_rx_time;								  // The time of the first received packet. Valid if receivedPackets > 0
-struct timespec start_tx_time;								  // The time of the first generated packet. Valid if generatedBytes > 0
-int printed_stats;
-struct timespec last_stat_print_time;
+__thread long receivedPackets, receivedCorrectPackets, receivedCorruptPackets;
+__thread long sentPackets, sent_correct_packets, sent_corrupt_packets;
+__thread long sent_dropped_packets; // Dropped before reaching the network because the transmit (or delay) queue was full
+__thread long long tx_copied_bytes;					  // Bytes copied into the transmit queue (headers and copied payloads)
+__thread long sent_ack_packets, received_data_packets; // ACKs (plain or SACK) sent, correct data packets received
+static __thread long retransmitted_packets;			   // Data packets sent again (seqno already sent)
+static __thread long discarded_data_packets;		   // Correct data packets the protocol neither delivered nor kept: duplicates (or out of order, with Go-Back-N)
+__thread long long generated_app_bytes, accepted_app_bytes;			  // Correct application bytes, not headers
+__thread long long sent_bytes, sent_correct_bytes, sent_corrupt_bytes; // Overall: Headers + application, including correct and corrupt packets
+// Latency histograms: the interval since the last report, merged into the whole run when it is printed
+static __thread struct hist *ack_latency, *ack_latency_run; // Data packet sent to its ACK, from RTT_SAMPLE (so first transmissions only)
+static __thread struct hist *app_latency, *app_latency_run; // Synthetic blocks, from the sender's READ_DATA_FROM_APP_LAYER to ACCEPT_DATA here
+__thread struct timespec start_rx_time;								  // The time of the first received packet. Valid if receivedPackets > 0
+__thread struct timespec start_tx_time;								  // The time of the first generated packet. Valid if generatedBytes > 0
+static __thread uint64_t start_tx_ns;								  // Origin of the times in the congestion window trace
+__thread int printed_stats;
+static __thread int final_report; // Set for the last print_stats: printed whatever the time since the previous one (or since the start)
+__thread struct timespec last_stat_print_time;
 
 struct chunk
 {
@@ -128,86 +353,451 @@ void print_pkt(const packet_t *buf, const char *op, int n)
 	errno = saved_errno;
 }
 
+static void ready_append(struct conn *cn)
+{
+	cn->ready_next = NULL;
+	cn->ready_prev = ready_tail;
+	if (ready_tail)
+		ready_tail->ready_next = cn;
+	else
+		ready_head = cn;
+	ready_tail = cn;
+}
+
+static void ready_remove(struct conn *cn)
+{
+	if (cn->ready_prev)
+		cn->ready_prev->ready_next = cn->ready_next;
+	else
+		ready_head = cn->ready_next;
+	if (cn->ready_next)
+		cn->ready_next->ready_prev = cn->ready_prev;
+	else
+		ready_tail = cn->ready_prev;
+}
+
+/* Non-zero when no protocol can be asked for more data, either by its own request or because of the transmit queue */
+static int transmission_paused()
+{
+	return !ready_head || txq_backpressure;
+}
+
+/* Start of the datagram holding pkt: the connection header (-n) goes right before the packet */
+static inline char *wire_start(const packet_t *pkt)
+{
+	return (char *)pkt - wire_prefix;
+}
+
+/* Starts or stops waiting for the network socket to become writable (POLLOUT / EPOLLOUT) */
+static void set_tx_blocked(int blocked)
+{
+	struct epoll_event ev;
+
+	if (tx_blocked == blocked)
+		return;
+	tx_blocked = blocked;
+	if (npoll)
+	{
+		if (blocked)
+			cevents[npoll].events |= POLLOUT;
+		else
+			cevents[npoll].events &= ~POLLOUT;
+	}
+	if (epfd >= 0)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (blocked ? EPOLLOUT : 0);
+		ev.data.fd = nfd;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, nfd, &ev);
+	}
+}
+
+/* Slot of the i-th packet of the next batch: retransmissions are sent before new data */
+static int txq_batch_slot(int i, struct tx_queue **q)
+{
+	*q = &retx_q;
+	if (i >= retx_q.count)
+	{
+		i -= retx_q.count;
+		*q = &data_q;
+	}
+	return ((*q)->head + i) % (*q)->size;
+}
+
+static void txq_pop(struct tx_queue *q, int n)
+{
+	q->head = (q->head + n) % q->size;
+	q->count -= n;
+}
+
+/* Bytes of the packet in a transmit queue slot, as it goes on the wire */
+static size_t txq_slot_len(const struct tx_queue *q, int idx)
+{
+	return q->iov[2 * idx].iov_len + q->iov[2 * idx + 1].iov_len;
+}
+
 /*
- * Sends a packet to the other end of the connection, size of the whole packet "len"
+ * Fills tx_msgs with the next batch of at most io_batch messages, taken from the first
+ * "pending" queued packets. Without offload every packet is a message. With UDP GSO (-g)
+ * a message carries a run of consecutive slots of one queue: their iovecs are contiguous,
+ * so the run is passed as is, and the kernel splits it back into datagrams of the size of
+ * the first one (UDP_SEGMENT). Only the last packet of a run may be shorter.
+ * Return value: number of messages; tx_segs[m] is the number of packets in message m
  */
-int SEND_PACKET(const packet_t *pkt, size_t len)
+static int txq_build_batch(int pending)
 {
-	int n, i, rv;
-	float random_val;
-	random_val = ((float)rand() / (RAND_MAX * 1.0));
+	struct tx_queue *q, *q2;
+	struct cmsghdr *cm;
+	size_t size, next, total;
+	int m, i, k, idx, idx2;
 
-	assert(sentPackets >= 0);
-	sentPackets++;
+	for (m = i = 0; m < io_batch && i < pending; m++, i += k)
+	{
+		idx = txq_batch_slot(i, &q);
+		size = total = txq_slot_len(q, idx);
+		for (k = 1; udp_offload && k < GSO_MAX_SEGMENTS && i + k < pending; k++)
+		{
+			idx2 = txq_batch_slot(i + k, &q2);
+			if (q2 != q || idx2 != idx + k)
+				break; // Other queue, or the ring wraps: the iovecs are not contiguous
+			if (multi_conn && q->conn[idx2] != q->conn[idx] && !addreq(&q->conn[idx2]->key.addr, &q->conn[idx]->key.addr))
+				break; // A GSO message has a single destination
+			next = txq_slot_len(q2, idx2);
+			if (next > size || total + next > GSO_MAX_BYTES)
+				break;
+			total += next;
+			if (next < size)
+			{
+				k++;
+				break;
+			}
+		}
+		tx_msgs[m].msg_hdr.msg_iov = &q->iov[2 * idx];
+		tx_msgs[m].msg_hdr.msg_iovlen = 2 * k;
+		tx_segs[m] = k;
+		if (multi_conn)
+		{ // Unconnected socket
+			tx_msgs[m].msg_hdr.msg_name = &q->conn[idx]->key.addr;
+			tx_msgs[m].msg_hdr.msg_namelen = addrsize(&q->conn[idx]->key.addr);
+		}
+		if (k == 1)
+		{
+			tx_msgs[m].msg_hdr.msg_control = NULL;
+			tx_msgs[m].msg_hdr.msg_controllen = 0;
+			continue;
+		}
+		tx_msgs[m].msg_hdr.msg_control = tx_cmsgs[m].buf;
+		tx_msgs[m].msg_hdr.msg_controllen = sizeof(tx_cmsgs[m].buf);
+		cm = CMSG_FIRSTHDR(&tx_msgs[m].msg_hdr);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cm) = size;
+	}
+	return m;
+}
+
+/*
+ * Sends the queued packets, up to io_batch messages per sendmmsg call, until the queues
+ * are empty or the socket buffer is full. In the latter case the rest stays queued and
+ * is sent when the socket becomes writable again.
+ * Return value: number of packets sent, or -1 on a transmission error
+ */
+static int flush_tx()
+{
+	struct tx_queue *q;
+	int sent, batch, pending, total, i, m, npkts, n, idx, from_retx;
 
-	// Check if we can send data...
-	//  wait for events on the sockets, 3.5 second timeout
-	rv = poll(&net_polling, 1, 0);
-	if (rv == -1)
+	total = 0;
+	while ((pending = retx_q.count + data_q.count) > 0)
 	{
-		perror("poll SEND_PACKET"); // error occurred in poll()
+		batch = txq_build_batch(pending);
+		sent = simulation ? sim_sendmmsg(tx_msgs, batch) : sendmmsg(nfd, tx_msgs, batch, 0);
+		tx_syscalls++;
+		if (sent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				set_tx_blocked(1);
+				break;
+			}
+			fprintf(stderr, "Transmission error: %s\n", strerror(errno));
+			continue_execution = 0;
+			return -1;
+		}
+		for (m = npkts = 0; m < sent; m++)
+			npkts += tx_segs[m];
+		for (i = 0; i < npkts; i++)
+		{
+			idx = txq_batch_slot(i, &q);
+			n = txq_slot_len(q, idx);
+			if (q->corrupt[idx])
+			{
+				assert(sent_corrupt_packets >= 0);
+				assert(sent_corrupt_bytes >= 0);
+				sent_corrupt_packets++;
+				sent_corrupt_bytes += n;
+			}
+			else
+			{
+				assert(sent_correct_packets >= 0);
+				sent_correct_packets++;
+				assert(sent_correct_bytes >= 0);
+				sent_correct_bytes += n;
+			}
+			assert(sent_bytes >= 0);
+			sent_bytes += n;
+			q->conn[idx]->queued--;
+			if (q->held[idx])
+			{
+				pool_put(&pool, q->held[idx]);
+				q->held[idx] = NULL;
+			}
+		}
+		tx_datagrams += npkts;
+		from_retx = npkts < retx_q.count ? npkts : retx_q.count;
+		txq_pop(&retx_q, from_retx);
+		txq_pop(&data_q, npkts - from_retx);
+		total += npkts;
+		if (sent < batch)
+		{ // The socket buffer filled up in the middle of the batch
+			set_tx_blocked(1);
+			break;
+		}
 	}
-	else if (rv == 0)
+	if (retx_q.count + data_q.count == 0)
+		set_tx_blocked(0);
+	if (txq_backpressure && data_q.count <= data_q.size / 4)
 	{
-		// printf("Network socket not available to send data!!\n");
+		DEBUG_SEND(1, "Transmission resumed (transmit queue drained)");
+		txq_backpressure = 0;
+	}
+	return total;
+}
+
+/*
+ * Checksum of a packet whose header (with cksum = 0) is hdr and whose payload follows it. hdr_len
+ * must be even. CRC32C is folded into the 16-bit field.
+ */
+static uint16_t packet_checksum(const void *hdr, size_t hdr_len, const void *payload, size_t payload_len)
+{
+	uint32_t crc;
+
+	if (c.checksum == CKSUM_INET)
+		return csum_fold(csum_partial(payload, payload_len, csum_partial(hdr, hdr_len, 0)));
+	crc = crc32c(crc32c(0, hdr, hdr_len), payload, payload_len);
+	return (crc ^ (crc >> 16)) & 0xffff;
+}
+
+/* Returns 1 if the len bytes received in pkt are a complete packet with a valid checksum, 0 otherwise */
+static int verify_checksum(packet_t *pkt, int len)
+{
+	uint16_t received = pkt->cksum;
+
+	if (len != pkt->len || len < ACK_PACKET_SIZE)
+		return 0;
+	pkt->cksum = 0;
+	return packet_checksum(wire_start(pkt), wire_prefix + len, NULL, 0) == received;
+}
+
+// Packet capture (see pcap.h)
+#define DEFAULT_PCAP_MB 64
+static char *pcap_path;						 /* --pcap, NULL if not capturing; with -j, worker i writes pcap_path.i */
+static size_t pcap_size = DEFAULT_PCAP_MB << 20; /* Bytes of the ring file */
+static uint32_t pcap_snaplen;				 /* Bytes kept of every datagram, 0: all */
+static __thread struct pcap_ring pcap;
+static __thread struct sockaddr_storage local_addr; /* Address of the socket, for the made-up IP headers */
+static __thread uint32_t *rx_pcap_flags;			/* Flags of the packet being delivered in the capture, to mark it if it is corrupt */
+
+/* Writes to the capture a packet of cn that never got to the queue or the network, with the reason */
+static void capture_unsent(struct conn *cn, const packet_t *pkt, size_t len, const void *payload, size_t payload_len, const char *why)
+{
+	struct conn_header hdr = {htonl(cn->key.id), 0};
+	struct iovec iov[3] = {{&hdr, wire_prefix}, {(void *)pkt, len}, {(void *)payload, payload_len}};
+
+	pcap_write(&pcap, monotonic_ns(), PCAP_OUTBOUND, why, &local_addr, &cn->key.addr, iov, 3);
+}
+
+/*
+ * Appends a packet to the transmit queue; retransmissions ("urgent") use their own queue,
+ * which is always sent first. When the data queue is 3/4 full, new data is paused until
+ * it drains to 1/4.
+ * The first len bytes of pkt are copied into the queue. They are followed by payload_len
+ * bytes of payload, which are copied too unless by_ref is set: then the queue only keeps
+ * the pointer and sendmmsg gathers header and payload from their own buffers. A payload
+ * in a pool buffer holds a reference to it until it is sent, so the protocol can free
+ * the buffer (e.g. the frame was acknowledged) while the packet is still queued.
+ * If corrupt is set, the packet is corrupted after its checksum is computed. cn is the
+ * connection that sends it.
+ * Return value: len + payload_len, or -1 if the queue was full and the packet was dropped
+ */
+static int txq_enqueue(struct conn *cn, const packet_t *pkt, size_t len, const void *payload, size_t payload_len, int urgent, int by_ref,
+					   int corrupt)
+{
+	struct iovec *iov;
+	struct tx_queue *q = urgent ? &retx_q : &data_q;
+	struct conn_header *hdr;
+	int idx;
+	packet_t *slot;
+
+	if (q->count == q->size)
+	{
+		DEBUG_ERRORS(1, "Transmit queue full, packet dropped");
+		assert(sent_dropped_packets >= 0);
+		sent_dropped_packets++;
+		if (pcap_path)
+			capture_unsent(cn, pkt, len, payload, payload_len, "dropped: transmit queue full");
 		return -1;
 	}
-	else
+	idx = (q->head + q->count) % q->size;
+	q->count++;
+	q->conn[idx] = cn;
+	cn->queued++;
+	slot = (packet_t *)(q->pkts + idx * slot_size + wire_prefix);
+	if (wire_prefix)
 	{
-		assert(net_polling.revents & POLLOUT);
+		hdr = (struct conn_header *)wire_start(slot);
+		hdr->id = htonl(cn->key.id);
+		hdr->reserved = 0;
+	}
+	memcpy(slot, pkt, len);
+	if (payload_len && (!by_ref || corrupt))
+	{ // Corrupted packets always get their own copy: the caller's payload must not be modified
+		memcpy((char *)slot + len, payload, payload_len);
+		len += payload_len;
+		payload_len = 0;
+	}
+	tx_copied_bytes += len;
+	iov = &q->iov[2 * idx];
+	iov[0].iov_len = wire_prefix + len;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = payload_len;
+	q->held[idx] = payload_len && pool_contains(&pool, payload) ? pool_hold(&pool, payload) : NULL;
+	if (c.checksum != CKSUM_SIMULATED)
+	{ // It covers the connection header too
+		slot->cksum = 0;
+		slot->cksum = packet_checksum(wire_start(slot), wire_prefix + len, payload, payload_len);
 	}
-	// check for events on s1:
 
-	if (random_val < c.error_probability)
+	if (corrupt)
 	{ // packet corruption!!
 		DEBUG_ERRORS(1, "Sent packet is corrupted!! (Probability: %f)", c.error_probability);
-		corrupted_packet->cksum = 0; // Simple model!!! 1: checksum OK; 0: checksum fails!!
-		corrupted_packet->len = rand() % 516;
-		corrupted_packet->seqno = rand() % 1024;
+		if (c.checksum == CKSUM_SIMULATED)
+			slot->cksum = 0; // Simple model!!! 1: checksum OK; 0: checksum fails!! Otherwise the receiver finds out
+		slot->len = xoshiro_next(&impair.junk) % (packet_size + 4);
+		slot->seqno = xoshiro_next(&impair.junk) % 1024;
 		if (len > DATA_PACKET_HEADER)
-			for (i = 0; i < (len - DATA_PACKET_HEADER); i++)
-				corrupted_packet->data[i] = rand() % 256;
-		n = send(nfd, corrupted_packet, len, 0);
-		if (n > 0)
-		{
-			assert(sent_corrupt_packets >= 0);
-			assert(sent_corrupt_bytes >= 0);
-			sent_corrupt_packets++;
-			sent_corrupt_bytes += n;
-		}
+			xoshiro_fill(&impair.junk, slot->data, len - DATA_PACKET_HEADER);
+		q->corrupt[idx] = 1;
 	}
 	else
 	{
 		DEBUG_ERRORS(2, "Sent packet is OK (NOT corrupted) (Probability: %f)", c.error_probability);
-		n = send(nfd, pkt, len, 0);
-		if (n > 0)
-		{
-			assert(sent_correct_packets >= 0);
-			sent_correct_packets++;
-			assert(sent_correct_bytes >= 0);
-			sent_correct_bytes += n;
-		}
+		q->corrupt[idx] = 0;
 	}
+	if (pcap_path)
+		pcap_write(&pcap, monotonic_ns(), PCAP_OUTBOUND | (corrupt ? PCAP_CRC_ERROR : 0), NULL, &local_addr, &cn->key.addr, iov, 2);
 
-	if (n < 0)
+	if (LOG_LEVEL > 3 && opt_debug > 3)
+		print_pkt(pkt, "send", len);
+	if (!txq_backpressure && data_q.count >= data_q.size * 3 / 4)
 	{
-		fprintf(stderr, "Transmission error: %s\n", strerror(errno));
-		continue_execution = 0;
-		return n;
+		DEBUG_SEND(1, "Transmission paused (transmit queue full)");
+		txq_backpressure = 1;
 	}
-	if (n != len)
+	// Keep the batches full-sized, the remainder is sent at the end of the main loop iteration
+	if (!tx_blocked && retx_q.count + data_q.count >= io_batch && flush_tx() < 0)
+		return -1;
+	return len + payload_len;
+}
+
+/* Arms IMPAIR_TIMER to the release date of the first delayed packet */
+static void arm_release_timer()
+{
+	uint64_t release_ns;
+
+	if (!dq_next(&delay_q, &release_ns))
+		return;
+	if (timers.active == 0)
+		tw_expire(&timers, monotonic_ns()); // Idle wheel: this only brings its clock up to date
+	tw_set(&timers, IMPAIR_TIMER, release_ns);
+}
+
+/* Moves the delayed packets whose release date has come to the transmit queue */
+static void release_delayed()
+{
+	struct delay_entry e;
+	uint64_t now = monotonic_ns();
+
+	while (dq_pop(&delay_q, now, &e))
 	{
-		// printf("Error: Sent %d bytes, but packet size is %d bytes\n", n, len);
-		continue_execution = 0;
-		return n;
-		// assert(n==len);
+		((struct conn *)e.owner)->queued--;
+		txq_enqueue(e.owner, (packet_t *)e.buf, e.len, NULL, 0, e.flags & DELAYED_URGENT, 0, e.flags & DELAYED_CORRUPT);
 	}
-	assert(sent_bytes >= 0);
-	sent_bytes += n;
-	if (opt_debug > 3)
-		print_pkt(pkt, "send", n);
-	fflush(stdout);
-	return n;
+	arm_release_timer();
+}
+
+/*
+ * Sends a packet of the current connection through the impairment emulator (see impair.h):
+ * it can be lost, duplicated or corrupted, and it is held in the delay queue if it must be
+ * delayed. Arguments as in txq_enqueue.
+ * Return value: len + payload_len (also when the emulator loses it), or -1 if it was dropped
+ * because a queue was full
+ */
+static int txq_push(const packet_t *pkt, size_t len, const void *payload, size_t payload_len, int urgent, int by_ref)
+{
+	uint64_t delay;
+	int copies, corrupt;
+	char *buf;
+
+	if (impair_lose(&impair))
+	{
+		DEBUG_ERRORS(1, "Sent packet is lost");
+		if (pcap_path)
+			capture_unsent(cur, pkt, len, payload, payload_len, "lost by the emulator");
+		return len + payload_len;
+	}
+	for (copies = 1 + impair_duplicate(&impair); copies > 0; copies--)
+	{
+		corrupt = impair_corrupt(&impair);
+		delay = impair_delay(&impair);
+		if (!delay)
+		{
+			if (txq_enqueue(cur, pkt, len, payload, payload_len, urgent, by_ref, corrupt) < 0)
+				return -1;
+			continue;
+		}
+		// Delayed packets are stored whole: the payload may be gone by the time they are released
+		buf = dq_push(&delay_q, monotonic_ns() + delay, len + payload_len, (urgent ? DELAYED_URGENT : 0) | (corrupt ? DELAYED_CORRUPT : 0), cur);
+		if (!buf)
+		{
+			DEBUG_ERRORS(1, "Delay queue full, packet dropped");
+			sent_dropped_packets++;
+			if (pcap_path)
+				capture_unsent(cur, pkt, len, payload, payload_len, "dropped: delay queue full");
+			return -1;
+		}
+		cur->queued++;
+		memcpy(buf, pkt, len);
+		if (payload_len)
+			memcpy(buf + len, payload, payload_len);
+		if (delay_q.heap[0].buf == buf)
+			arm_release_timer(); // It is the first packet to be released now
+	}
+	return len + payload_len;
+}
+
+/*
+ * Sends a packet to the other end of the connection, size of the whole packet "len"
+ * The packet goes through the transmit queue; it is never lost because the socket is
+ * momentarily not writable.
+ */
+int SEND_PACKET(const packet_t *pkt, size_t len)
+{
+	assert(len <= packet_size);
+	assert(sentPackets >= 0);
+	sentPackets++;
+	return txq_push(pkt, len, NULL, 0, 0, 0);
 }
 
 /*
@@ -215,21 +805,42 @@ int SEND_PACKET(const packet_t *pkt, size_t len)
  * This function is valid ONLY for data packets (not ACK).
  * Return value: 1 -> all the bytes were correctly sent; 0 -> Couldn't transmit all the bytes in the packet
  */
-int SEND_DATA_PACKET(uint16_t length, uint32_t ackno, uint32_t seqno, void *data)
+/* Common part of SEND_DATA_PACKET and SEND_DATA_PACKET_REF: only the header is built here, the payload goes straight to the queue */
+static int send_data(uint16_t length, uint32_t ackno, uint32_t seqno, const void *data, int by_ref)
 {
-	int n, data_length;
+	int n;
 
+	assert(length >= DATA_PACKET_HEADER && length <= DATA_PACKET_HEADER + c.payload);
 	packet_ptr->cksum = 1;
 	packet_ptr->len = length;
 	packet_ptr->ackno = ackno;
 	packet_ptr->seqno = seqno;
-	data_length = length - DATA_PACKET_HEADER;
-	memcpy(&(packet_ptr->data), data, data_length);
-	n = SEND_PACKET(packet_ptr, length);
+	assert(sentPackets >= 0);
+	sentPackets++;
+	// A seqno that was already sent is a retransmission: it goes ahead of new data
+	n = txq_push(packet_ptr, DATA_PACKET_HEADER, data, length - DATA_PACKET_HEADER, seqno <= cur->max_seqno_sent, by_ref);
+	if (seqno > cur->max_seqno_sent)
+		cur->max_seqno_sent = seqno;
+	else
+		retransmitted_packets++;
 	DEBUG_SEND(1, "Data packet sent, seq. index %d\n", seqno);
 	return (n == length);
 }
 
+int SEND_DATA_PACKET(uint16_t length, uint32_t ackno, uint32_t seqno, void *data)
+{
+	return send_data(length, ackno, seqno, data, 0);
+}
+
+/*
+ * Like SEND_DATA_PACKET, but the payload is not copied: the transmit queue references it until
+ * the packet is handed to the kernel.
+ */
+int SEND_DATA_PACKET_REF(uint16_t length, uint32_t ackno, uint32_t seqno, const void *data)
+{
+	return send_data(length, ackno, seqno, data, 1);
+}
+
 /*
  * Sends a packet to the other end of the connection, specifying each field of the packet in the function options
  * This function is valid ONLY for ACK packets (not DATA).
@@ -241,11 +852,34 @@ int SEND_ACK_PACKET(uint32_t ackno)
 	packet_ptr->cksum = 1;
 	packet_ptr->len = ACK_PACKET_SIZE;
 	packet_ptr->ackno = ackno;
+	sent_ack_packets++;
 	n = SEND_PACKET(packet_ptr, ACK_PACKET_SIZE);
 	DEBUG_SEND(1, "ACK packet sent, ACK index: %d", ackno);
 	return (n == ACK_PACKET_SIZE);
 }
 
+/*
+ * Sends a SACK packet: cumulative ackno plus nwords words of selective ACK bitmap.
+ * Return value: 1 -> all the bytes were correctly sent; 0 -> Couldn't transmit all the bytes in the packet
+ */
+int SEND_SACK_PACKET(uint32_t ackno, const uint64_t *sack, int nwords)
+{
+	struct sack_packet *sp = (struct sack_packet *)packet_ptr;
+	int n, len = SACK_PACKET_HEADER + nwords * sizeof(uint64_t);
+
+	assert(nwords >= 0 && nwords <= SACK_WORDS);
+	sp->cksum = 1;
+	sp->len = len;
+	sp->ackno = ackno;
+	sp->seqno = SACK_SEQNO;
+	sp->reserved = 0;
+	memcpy(sp->sack, sack, nwords * sizeof(uint64_t));
+	sent_ack_packets++;
+	n = SEND_PACKET(packet_ptr, len);
+	DEBUG_SEND(1, "SACK packet sent, ACK index: %d, %d bitmap words", ackno, nwords);
+	return (n == len);
+}
+
 /*
  * Accepts the data in a packet, with size _n. Note that _buf is a pointer to the data field in the packet, and
  * _n is the size of the data field only, not the size of the whole packet
@@ -256,13 +890,14 @@ int ACCEPT_DATA(const void *_buf, size_t _n)
 	int n = _n;
 	int indexDiff;
 	uint8_t firstByte;
+	uint64_t stamp, now;
 
 	if (synthetic_traffic)
 	{ // The first byte indicates the sequence
-		assert((synth_rx_index + 1) % 256 == synth_rx_index_1024 % 256);
+		assert((cur->synth_rx_index + 1) % 256 == cur->synth_rx_index_1024 % 256);
 		if (_n != synth_data_block)
 		{
-			printf("Accepted block of %d bytes, but the application sends blocks of %d bytes.\n", n, synth_data_block);
+			printf("Accepted block of %d bytes, but the application sends blocks of %d bytes (both ends must use the same -b).\n", n, synth_data_block);
 			pause();
 			exit(-1);
 		}
@@ -273,22 +908,22 @@ int ACCEPT_DATA(const void *_buf, size_t _n)
 			firstByte += 255;
 		}
 		assert(firstByte >= 0);
-		if (firstByte != synth_rx_index)
+		if (firstByte != cur->synth_rx_index)
 		{
-			indexDiff = (synth_rx_index - firstByte) % 256;
+			indexDiff = (cur->synth_rx_index - firstByte) % 256;
 			if (indexDiff == 0)
 			{
-				// printf("synth_rx_index = %d, firstByte = %d\n", synth_rx_index, firstByte);
+				// printf("synth_rx_index = %d, firstByte = %d\n", cur->synth_rx_index, firstByte);
 				fflush(stdout);
 			}
 			assert(indexDiff != 0);
 			if (indexDiff > 0)
 			{
-				printf("Error: Duplicated (or corrupt) block received. Expected index: %d, Received: %d\n", synth_rx_index, firstByte);
+				printf("Error: Duplicated (or corrupt) block received. Expected index: %d, Received: %d\n", cur->synth_rx_index, firstByte);
 			}
 			else
 			{
-				printf("Error: Missing block in the accepted data!! (or corrupted data accepted). Expected index: %d, Received: %d\n", synth_rx_index,
+				printf("Error: Missing block in the accepted data!! (or corrupted data accepted). Expected index: %d, Received: %d\n", cur->synth_rx_index,
 					   firstByte);
 			}
 			fflush(stdout);
@@ -299,11 +934,22 @@ int ACCEPT_DATA(const void *_buf, size_t _n)
 		{
 			// printf("\t\tAccepted block %d\n", firstByte);
 		}
-		synth_rx_index = (synth_rx_index + 1) % 256;
-		synth_rx_index_1024 = (synth_rx_index_1024 + 1) % 1024;
-		assert(synth_rx_index >= 0);
-		assert(synth_rx_index_1024 >= 0);
-		assert((synth_rx_index + 1) % 256 == synth_rx_index_1024 % 256);
+		if (accepted_app_bytes == 0)
+			transfer_rx_start = realtime_ns(); // Blocks too short to carry their date: from the first one accepted
+		if (n >= SYNTH_STAMP_OFFSET + (int)sizeof(uint64_t))
+		{
+			memcpy(&stamp, buf + SYNTH_STAMP_OFFSET, sizeof(stamp));
+			now = realtime_ns();
+			if (now >= stamp) // Clocks of different hosts may not agree
+				hist_record(app_latency, now - stamp);
+			if (accepted_app_bytes == 0)
+				transfer_rx_start = stamp;
+		}
+		cur->synth_rx_index = (cur->synth_rx_index + 1) % 256;
+		cur->synth_rx_index_1024 = (cur->synth_rx_index_1024 + 1) % 1024;
+		assert(cur->synth_rx_index >= 0);
+		assert(cur->synth_rx_index_1024 >= 0);
+		assert((cur->synth_rx_index + 1) % 256 == cur->synth_rx_index_1024 % 256);
 	}
 	else
 	{
@@ -326,18 +972,29 @@ int ACCEPT_DATA(const void *_buf, size_t _n)
 	}
 	assert(accepted_app_bytes >= 0);
 	accepted_app_bytes += _n;
+	if (transfer_blocks && ++cur->synth_rx_blocks == transfer_blocks)
+	{ // The last block, in order
+		transfer_rx_end = realtime_ns();
+		transfer_progress();
+	}
 	return n;
 }
 
 int READ_DATA_FROM_APP_LAYER(void *buf, size_t _n)
 {
 	int r, n;
+	uint64_t stamp;
 
 	n = _n;
 
 	if (synthetic_traffic)
 	{
-		assert((synth_tx_index + 1) % 256 == synth_tx_index_1024 % 256);
+		assert((cur->synth_tx_index + 1) % 256 == cur->synth_tx_index_1024 % 256);
+		if (transfer_blocks && cur->synth_tx_blocks == transfer_blocks)
+		{ // All of them were generated: the generator stops
+			synth_tr_start = 0;
+			return 0;
+		}
 		if (n < synth_data_block)
 		{
 			printf("Error: receiving buffer is smaller than the application block size. Use a buffer of at least %d bytes in your implementation\n",
@@ -345,15 +1002,21 @@ int READ_DATA_FROM_APP_LAYER(void *buf, size_t _n)
 			pause();
 			exit(-1);
 		}
-		memset(buf, synth_tx_index, n);
+		memset(buf, cur->synth_tx_index, n);
+		if (n >= SYNTH_STAMP_OFFSET + (int)sizeof(uint64_t))
+		{ // After the index byte: the date it was generated, for the app-to-app latency at the receiver
+			stamp = realtime_ns();
+			memcpy((char *)buf + SYNTH_STAMP_OFFSET, &stamp, sizeof(stamp));
+		}
 		r = n;
 		DEBUG_SEND(1, "Data block of %d bytes generated", n);
-		DEBUG_SEND(1, "Block index: %d (%d)", synth_tx_index_1024 - 1, synth_tx_index);
+		DEBUG_SEND(1, "Block index: %d (%d)", cur->synth_tx_index_1024 - 1, cur->synth_tx_index);
 		// printf("Block %d generated\n", synth_tx_index);
-		synth_tx_index = (synth_tx_index + 1) % 256;
-		synth_tx_index_1024 = (synth_tx_index_1024 + 1) % 1024;
-		assert(synth_tx_index >= 0);
-		assert((synth_tx_index + 1) % 256 == synth_tx_index_1024 % 256);
+		cur->synth_tx_index = (cur->synth_tx_index + 1) % 256;
+		cur->synth_tx_index_1024 = (cur->synth_tx_index_1024 + 1) % 1024;
+		cur->synth_tx_blocks++;
+		assert(cur->synth_tx_index >= 0);
+		assert((cur->synth_tx_index + 1) % 256 == cur->synth_tx_index_1024 % 256);
 	}
 	else
 	{
@@ -383,6 +1046,94 @@ int READ_DATA_FROM_APP_LAYER(void *buf, size_t _n)
 	return r;
 }
 
+/* Current CLOCK_MONOTONIC date, in ns */
+static uint64_t monotonic_ns()
+{
+	struct timespec curr_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &curr_time);
+	return (uint64_t)curr_time.tv_sec * 1000000000 + curr_time.tv_nsec;
+}
+
+/* Current CLOCK_REALTIME date, in ns: comparable between hosts whose clocks are synchronized */
+static uint64_t realtime_ns()
+{
+	struct timespec curr_time;
+
+	clock_gettime(CLOCK_REALTIME, &curr_time);
+	return (uint64_t)curr_time.tv_sec * 1000000000 + curr_time.tv_nsec;
+}
+
+/* Allocates a wheel timer for timer "number" of connection cn */
+static int timer_id_alloc(struct conn *cn, int number)
+{
+	int id, cap;
+
+	if (ntimer_free == 0)
+	{ // Every wheel timer allocated so far is in use: grow the reverse maps
+		cap = ntimer_ids ? 2 * ntimer_ids : 1024;
+		timer_conn = realloc(timer_conn, cap * sizeof(*timer_conn));
+		timer_number = realloc(timer_number, cap * sizeof(*timer_number));
+		timer_free = realloc(timer_free, cap * sizeof(*timer_free));
+		if (!timer_conn || !timer_number || !timer_free)
+		{
+			fprintf(stderr, "%s: out of memory allocating %d timers\n", progname, cap);
+			abort();
+		}
+		for (id = cap - 1; id >= ntimer_ids; id--)
+			timer_free[ntimer_free++] = CONN_TIMER_BASE + id;
+		ntimer_ids = cap;
+	}
+	id = timer_free[--ntimer_free];
+	timer_conn[id - CONN_TIMER_BASE] = cn;
+	timer_number[id - CONN_TIMER_BASE] = number;
+	return id;
+}
+
+/*
+ * Wheel timer of timer "number" of the connection. Without -n there is one connection and
+ * numbers are used as they are. With -n every connection maps the numbers it uses to wheel
+ * timers, allocated the first time it sets each number and kept until it is destroyed.
+ * Return value: the wheel timer, or -1 if the number was never set and create is 0
+ */
+static int conn_timer_id(struct conn *cn, int number, int create)
+{
+	struct conn_timer *old;
+	int i, j, size;
+
+	if (!multi_conn)
+		return number;
+	for (i = number & cn->timers_mask; cn->timers[i].number >= 0; i = (i + 1) & cn->timers_mask)
+		if (cn->timers[i].number == number)
+			return cn->timers[i].id;
+	if (!create)
+		return -1;
+	if (2 * (cn->ntimers + 1) > cn->timers_mask + 1)
+	{ // Keep the map at most half full
+		old = cn->timers;
+		size = cn->timers_mask + 1;
+		cn->timers = xmalloc(2 * size * sizeof(*cn->timers));
+		cn->timers_mask = 2 * size - 1;
+		for (i = 0; i < 2 * size; i++)
+			cn->timers[i].number = -1;
+		for (j = 0; j < size; j++)
+		{
+			if (old[j].number < 0)
+				continue;
+			for (i = old[j].number & cn->timers_mask; cn->timers[i].number >= 0; i = (i + 1) & cn->timers_mask)
+				;
+			cn->timers[i] = old[j];
+		}
+		free(old);
+		for (i = number & cn->timers_mask; cn->timers[i].number >= 0; i = (i + 1) & cn->timers_mask)
+			;
+	}
+	cn->timers[i].number = number;
+	cn->timers[i].id = timer_id_alloc(cn, number);
+	cn->ntimers++;
+	return cn->timers[i].id;
+}
+
 /*
  * Sets the timer timer_number to expire in delay_in_ns ns.
  * If the timer is already set, it is overwritten.
@@ -392,34 +1143,24 @@ int READ_DATA_FROM_APP_LAYER(void *buf, size_t _n)
  */
 long SET_TIMER(int timer_number, long delay_in_ns)
 {
-	struct timespec curr_time, timer_new_time, timer_old_time;
+	uint64_t curr_time, old_exp_date;
+	int was_set, id;
 
-	clock_gettime(CLOCK_MONOTONIC, &curr_time);
+	assert(timer_number >= 0 && timer_number < TIMER_COUNT);
+	id = conn_timer_id(cur, timer_number, 1);
+	curr_time = monotonic_ns();
 	DEBUG_TIMER(1, "TIMER SET to expire in %ld ns", delay_in_ns);
-	DEBUG_TIMER(2, "Current time: %d s %ld ns", (int)curr_time.tv_sec, curr_time.tv_nsec);
-	timer_new_time.tv_sec = curr_time.tv_sec;
-	timer_new_time.tv_nsec = curr_time.tv_nsec + delay_in_ns;
-	if (timer_new_time.tv_nsec > 1000000000)
-	{
-		timer_new_time.tv_sec += timer_new_time.tv_nsec / 1000000000;
-		timer_new_time.tv_nsec %= 1000000000;
-	}
-	timer_old_time = timer_exp_date[timer_number];
-	timer_exp_date[timer_number] = timer_new_time;
-	DEBUG_TIMER(2, "Expiration time: %d s %ld ns", (int)timer_new_time.tv_sec, timer_new_time.tv_nsec);
-	if (timer_set[timer_number])
+	DEBUG_TIMER(2, "Current time: %llu ns", (unsigned long long)curr_time);
+	if (timers.active == 0)
+		tw_expire(&timers, curr_time); // Idle wheel: this only brings its clock up to date
+	was_set = tw_pending(&timers, id, &old_exp_date);
+	tw_set(&timers, id, curr_time + delay_in_ns);
+	DEBUG_TIMER(2, "Expiration time: %llu ns", (unsigned long long)(curr_time + delay_in_ns));
+	if (was_set)
 	{ // The timer was already set!
-		assert(active_timers > 0);
-		assert(active_timers <= TIMER_COUNT);
-		return compareDates(timer_old_time, curr_time);
-	}
-	else
-	{ // The timer was not set!
-		assert(active_timers < TIMER_COUNT);
-		active_timers++;
-		timer_set[timer_number] = 1;
-		return -1;
+		return (long)(old_exp_date - curr_time);
 	}
+	return -1;
 }
 
 /*
@@ -429,23 +1170,14 @@ long SET_TIMER(int timer_number, long delay_in_ns)
  */
 long CLEAR_TIMER(int timer_number)
 {
-	struct timespec curr_time;
+	uint64_t exp_date;
+	int id = conn_timer_id(cur, timer_number, 0);
 
-	if (active_timers == 0)
-		return -1;
-	assert(active_timers > 0);
-	if (timer_set[timer_number])
-	{
-		timer_set[timer_number] = 0; // Unset the timer!
-		DEBUG_TIMER(2, "Timer %d cleared", timer_number);
-		active_timers--;
-		clock_gettime(CLOCK_MONOTONIC, &curr_time);
-		return (compareDates(timer_exp_date[timer_number], curr_time));
-	}
-	else
-	{
+	if (id < 0 || !tw_pending(&timers, id, &exp_date))
 		return -1;
-	}
+	tw_clear(&timers, id);
+	DEBUG_TIMER(2, "Timer %d cleared", timer_number);
+	return (long)(exp_date - monotonic_ns());
 }
 
 int VALIDATE_CHECKSUM(const packet_t *pkt)
@@ -466,15 +1198,160 @@ int VALIDATE_CHECKSUM(const packet_t *pkt)
 	return pkt->cksum;
 }
 
+uint64_t CURRENT_TIME_NS()
+{
+	return monotonic_ns();
+}
+
+/*
+ * RTO = (SRTT + max(RTO_GRANULARITY_NS, 4 RTTVAR)) * 2^backoff, clamped to [MIN_RTO_NS, MAX_RTO_NS].
+ * Before the first sample, the base is -t
+ */
+static void update_rto(struct rtt_estimator *rtt)
+{
+	long margin = 4 * rtt->rttvar;
+	int i;
+
+	if (margin < RTO_GRANULARITY_NS)
+		margin = RTO_GRANULARITY_NS;
+	rtt->rto = rtt->samples ? rtt->srtt + margin : c.timeout;
+	if (rtt->rto < MIN_RTO_NS && rtt->samples)
+		rtt->rto = MIN_RTO_NS;
+	for (i = 0; i < rtt->backoff && rtt->rto < MAX_RTO_NS; i++)
+		rtt->rto *= 2;
+	if (rtt->rto > MAX_RTO_NS)
+		rtt->rto = MAX_RTO_NS;
+}
+
+void RTT_SAMPLE(long rtt_ns)
+{
+	struct rtt_estimator *rtt = &cur->rtt;
+	long err;
+
+	if (rtt->samples == 0)
+	{ // First measurement
+		rtt->srtt = rtt_ns;
+		rtt->rttvar = rtt_ns / 2;
+	}
+	else
+	{ // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|;  SRTT = 7/8 SRTT + 1/8 R
+		err = rtt->srtt - rtt_ns;
+		if (err < 0)
+			err = -err;
+		rtt->rttvar += (err - rtt->rttvar) / 4;
+		rtt->srtt += (rtt_ns - rtt->srtt) / 8;
+	}
+	rtt->samples++;
+	rtt->backoff = 0; // A frame sent once was confirmed within the RTO: the backoff is no longer needed
+	update_rto(rtt);
+	if (rtt_ns >= 0)
+		hist_record(ack_latency, rtt_ns);
+	DEBUG_TIMER(2, "RTT sample %ld ns: SRTT %ld ns, RTTVAR %ld ns, RTO %ld ns", rtt_ns, rtt->srtt, rtt->rttvar, rtt->rto);
+}
+
+void RTO_BACKOFF()
+{
+	struct rtt_estimator *rtt = &cur->rtt;
+
+	rtt->timeouts++;
+	if (cur->acked_seqno != rtt->backoff_base)
+		rtt->backoff = 0; // The base moved since the last timeout: a new loss, the RTO backs off once more, not twice
+	rtt->backoff_base = cur->acked_seqno;
+	rtt->backoff_fresh = cur->max_seqno_sent + 1;
+	if (rtt->rto < MAX_RTO_NS || rtt->backoff == 0)
+		rtt->backoff++;
+	update_rto(rtt);
+	DEBUG_TIMER(1, "Retransmission timeout, RTO backs off to %ld ns", rtt->rto);
+}
+
+long GET_RTO()
+{
+	return cur->rtt.rto;
+}
+
+/*
+ * Logs the window after an event (a: ack, l: loss, t: timeout); ACKs are only logged when the integer window changes.
+ * The statistics cover every connection, the trace only main_conn (of the first worker, with -j).
+ */
+static void trace_cwnd(char event)
+{
+	if (cc_count == 0 || cur->cc.cwnd < cc_min)
+		cc_min = cur->cc.cwnd;
+	if (cc_count == 0 || cur->cc.cwnd > cc_max)
+		cc_max = cur->cc.cwnd;
+	cc_sum += cur->cc.cwnd;
+	cc_count++;
+	if (!cwnd_trace || cur != main_conn || worker_index != 0 || (event == 'a' && (int)cur->cc.cwnd == (int)cc_last_traced))
+		return;
+	fprintf(cwnd_trace, "%.6f,%c,%.2f,%.2f\n", (monotonic_ns() - start_tx_ns) / 1e9, event, cur->cc.cwnd, cur->cc.ssthresh);
+	cc_last_traced = cur->cc.cwnd;
+}
+
+int CONGESTION_WINDOW()
+{
+	return (int)cur->cc.cwnd;
+}
+
+void CC_ON_ACK(int acked)
+{
+	cc_algorithm->on_ack(&cur->cc, acked, monotonic_ns(), cur->rtt.samples ? cur->rtt.srtt : c.timeout);
+	trace_cwnd('a');
+}
+
+void CC_ON_LOSS()
+{
+	cc_losses++;
+	cc_algorithm->on_loss(&cur->cc, monotonic_ns());
+	DEBUG_SEND(1, "Congestion: loss, window %.1f frames", cur->cc.cwnd);
+	trace_cwnd('l');
+}
+
+void CC_ON_TIMEOUT()
+{
+	cc_timeouts++;
+	cc_algorithm->on_timeout(&cur->cc, monotonic_ns());
+	DEBUG_SEND(1, "Congestion: timeout, window %.1f frames", cur->cc.cwnd);
+	trace_cwnd('t');
+}
+
+void ACKNOWLEDGED_UP_TO(uint32_t seqno)
+{
+	cur->acked_seqno = seqno;
+	if (cur->rtt.backoff && seqno > cur->rtt.backoff_fresh)
+	{ // A frame first sent after the last timeout got through: the backed-off RTO is no longer needed (Karn)
+		cur->rtt.backoff = 0;
+		update_rto(&cur->rtt);
+	}
+	if (transfer_blocks && !transfer_tx_end && cur->synth_tx_blocks == transfer_blocks && cur->acked_seqno > cur->max_seqno_sent)
+	{ // The last block was generated and every frame sent so far (the last one included) is acknowledged
+		transfer_tx_end = monotonic_ns();
+		transfer_progress();
+	}
+}
+
+static void init_congestion_control()
+{
+	cc_losses = cc_timeouts = 0;
+	cc_sum = cc_count = 0;
+	cc_last_traced = -1;
+	start_tx_ns = monotonic_ns();
+}
+
 void PAUSE_TRANSMISSION()
 {
 	DEBUG_SEND(1, "Transmission paused");
-	paused_transmission = 1;
+	if (cur->paused)
+		return;
+	cur->paused = 1;
+	ready_remove(cur);
 }
 void RESUME_TRANSMISSION()
 {
 	DEBUG_SEND(1, "Transmission resumed");
-	paused_transmission = 0;
+	if (!cur->paused)
+		return;
+	cur->paused = 0;
+	ready_append(cur);
 }
 
 static void conn_mkevents(void)
@@ -534,17 +1411,487 @@ static void conn_mkevents(void)
 	ncevents = n;  // Network
 	evreaders = r; // Read
 
-	net_polling.fd = nfd;
-	net_polling.events = POLLOUT;
+}
+
+/*
+ * Opens a connection to addr with the given ID and lets the protocol initialize it. Like the
+ * single connection always did, it starts ready to send.
+ * Return value: the connection, or NULL if max_conns are already open
+ */
+static struct conn *conn_create(const struct sockaddr_storage *addr, uint32_t id, int passive)
+{
+	struct conn *cn;
+	int i;
+
+	if (nconns == max_conns)
+	{
+		conns_refused++;
+		return NULL;
+	}
+	cn = xmalloc(sizeof(*cn));
+	memset(cn, 0, sizeof(*cn));
+	cn->key.addr = *addr;
+	cn->key.id = id;
+	cn->passive = passive;
+	cn->last_rx_ns = monotonic_ns();
+	cn->synth_tx_index = cn->synth_rx_index = 1;
+	cn->synth_tx_index_1024 = cn->synth_rx_index_1024 = 2;
+	update_rto(&cn->rtt); // The RTO starts at -t until the first RTT sample
+	cn->cc.max_cwnd = c.window;
+	cc_algorithm->init(&cn->cc);
+	if (multi_conn)
+	{
+		cn->timers = xmalloc(8 * sizeof(*cn->timers));
+		cn->timers_mask = 7;
+		for (i = 0; i < 8; i++)
+			cn->timers[i].number = -1;
+		ct_insert(&conn_table, &cn->key);
+	}
+	cn->index = nconns;
+	conns[nconns++] = cn;
+	if (!main_conn)
+		main_conn = cn;
+	ready_append(cn);
+	conns_created++;
+	cur = cn;
+	cn->state = connection_initialization(c.window, c.timeout);
+	return cn;
+}
+
+/* Closes a connection (-n only): its timers are cleared, then the protocol releases its state */
+static void conn_destroy(struct conn *cn)
+{
+	int i, id;
+
+	for (i = 0; i <= cn->timers_mask; i++)
+	{
+		if (cn->timers[i].number < 0)
+			continue;
+		id = cn->timers[i].id;
+		tw_clear(&timers, id);
+		timer_conn[id - CONN_TIMER_BASE] = NULL;
+		timer_free[ntimer_free++] = id;
+	}
+	free(cn->timers);
+	if (!cn->paused)
+		ready_remove(cn);
+	ct_remove(&conn_table, &cn->key);
+	conns[cn->index] = conns[--nconns];
+	conns[cn->index]->index = cn->index;
+	if (main_conn == cn)
+		main_conn = nconns ? conns[0] : NULL;
+	cur = cn;
+	connection_destroy(cn->state);
+	cur = main_conn;
+	free(cn);
+	conns_closed++;
+}
+
+/* Destroys the connections opened by the peer that received nothing for CONN_IDLE_NS, once none of their packets is queued */
+static void expire_idle_conns()
+{
+	uint64_t now = monotonic_ns();
+	int i;
+
+	if (now - last_sweep_ns < CONN_SWEEP_NS)
+		return;
+	last_sweep_ns = now;
+	for (i = nconns - 1; i >= 0; i--) // Backwards: conn_destroy moves the last connection into the hole
+		if (conns[i]->passive && conns[i]->queued == 0 && now - conns[i]->last_rx_ns >= CONN_IDLE_NS)
+			conn_destroy(conns[i]);
 }
 
 void generateSyntheticData()
 {
-	if (paused_transmission)
+	struct conn *cn;
+	int i;
+
+	// The application is always ready to generate a flow of data!! Generate a burst that fills one batch,
+	// one block per ready connection in turn
+	for (i = 0; i < io_batch && !transmission_paused() && synth_tr_start && continue_execution; i++)
+	{
+		cn = cur = ready_head;
+		if (cn != ready_tail)
+		{ // Round-robin: it goes to the back of the list
+			ready_remove(cn);
+			ready_append(cn);
+		}
+		send_callback(cn->state);
+	}
+}
+
+/* The input (console) is ready: either start the synthetic generator or let the protocol read from it */
+static void input_readable()
+{
+	xoff = 1;
+	cevents[rpoll].events &= ~POLLIN;
+	if (synthetic_traffic)
+	{
+		synth_tr_start = 1;
+	}
+	else
+	{
+		send_callback(main_conn->state);
+	}
+}
+
+static void network_error()
+{
+	char addr[NI_MAXHOST] = "unknown";
+	char port[NI_MAXSERV] = "unknown";
+	getnameinfo((const struct sockaddr *)&peer, sizeof(peer), addr, sizeof(addr), port, sizeof(port),
+				NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+	fprintf(stderr, "[received ICMP port unreachable;"
+					" assuming peer at %s:%s is dead]\n",
+			addr, port);
+	exit(1);
+}
+
+/* Passes one received datagram of len bytes to the protocol */
+static void deliver_packet(packet_t *pkt, int len)
+{
+	long long accepted = accepted_app_bytes;
+	int data = 0;
+
+	if (c.checksum != CKSUM_SIMULATED)
+	{ // From here on the protocol sees the result as in the simulated model
+		pkt->cksum = verify_checksum(pkt, len);
+	}
+	else if (len != pkt->len)
+	{					// Packet was received incomplete. Corrupt!!!
+		pkt->cksum = 0; // Simple model!!! 1: checksum OK; 0: checksum fails!!
+		pkt->len = xoshiro_next(&impair.junk) % (packet_size + 4);
+		pkt->seqno = xoshiro_next(&impair.junk) % 1024;
+		if (len > DATA_PACKET_HEADER)
+			xoshiro_fill(&impair.junk, pkt->data, len - DATA_PACKET_HEADER);
+	}
+	DEBUG_RECEPTION(1, "Packet received");
+	if (synthetic_traffic && pkt->len > ACK_PACKET_SIZE)
+	{
+		DEBUG_RECEPTION(2, "Bytes received: %d, Length field: %d, SEQ index: %d, ACK index: %d, block %d\n",
+						len, pkt->len, pkt->seqno, pkt->ackno, (unsigned char)pkt->data[0]);
+	}
+	else
+	{
+		DEBUG_RECEPTION(2, "Bytes received: %d, Length field: %d, SEQ index: %d, ACK index: %d",
+						len, pkt->len, pkt->seqno, pkt->ackno);
+	}
+	assert(receivedPackets >= 0);
+	if (receivedPackets == 0)
+	{ // First received packet!! Start the reception timer!!
+		clock_gettime(CLOCK_MONOTONIC, &start_rx_time);
+	}
+	receivedPackets++;
+	if (pkt->cksum == 1)
+	{
+		DEBUG_ERRORS(2, "Received packet is correct (checksum OK)");
+		assert(receivedCorrectPackets >= 0);
+		receivedCorrectPackets++;
+		if (!IS_ACK_PACKET(pkt))
+		{
+			received_data_packets++;
+			data = 1;
+		}
+	}
+	else
+	{
+		DEBUG_ERRORS(1, "Received packet is corrupted (checksum fails!)");
+		assert(receivedCorruptPackets >= 0);
+		receivedCorruptPackets++;
+		if (rx_pcap_flags)
+			*rx_pcap_flags |= PCAP_CRC_ERROR;
+	}
+	receive_callback(cur->state, pkt, len);
+	if (data && accepted_app_bytes == accepted && pkt == rx_pkts[rx_current])
+		discarded_data_packets++; // Not delivered, not kept (PACKET_KEEP replaces it in rx_pkts)
+	// memset(pkt, 0xc9, len); /* for debugging */
+}
+
+/*
+ * Passes a datagram of len bytes, received from "from", to its connection. With -n the
+ * connection is found from the connection header, and created if the peer is opening it.
+ */
+static void receive_datagram(packet_t *pkt, int len, const struct sockaddr_storage *from)
+{
+	struct conn_key *key;
+	uint32_t id;
+	struct iovec iov = {wire_start(pkt), len};
+
+	if (pcap_path)
+		rx_pcap_flags = pcap_write(&pcap, monotonic_ns(), PCAP_INBOUND, NULL, multi_conn ? from : &peer, &local_addr, &iov, 1);
+
+	if (multi_conn)
+	{
+		if (len < (int)wire_prefix)
+			return;
+		id = ntohl(((struct conn_header *)wire_start(pkt))->id);
+		key = ct_find(&conn_table, from, id);
+		if (key)
+			cur = (struct conn *)key; // The key is the first member of struct conn
+		else if (!(cur = conn_create(from, id, 1)))
+			return; // Too many connections: dropped, as if it was lost
+		cur->last_rx_ns = rx_now_ns;
+		len -= wire_prefix;
+	}
+	deliver_packet(pkt, len);
+}
+
+/*
+ * Windows bound the buffers in use: the sender's retransmission buffer and the reorder buffer
+ * (Selective Repeat) of every connection, and the receive batch. Every buffer has room for
+ * the connection header before the packet. A buffer freed while the transmit queue still
+ * sends from it comes back when that packet leaves; POOL_SPARE covers those.
+ */
+static void init_pool()
+{
+	long size = c.selective_repeat ? 2L * c.window : c.window;
+
+	size = size * max_conns + io_batch + POOL_SPARE;
+	if (size > INT_MAX)
+	{
+		fprintf(stderr, "%s: %ld packet buffers needed, too many (reduce -w or --max-conns)\n", progname, size);
+		exit(1);
+	}
+	pool_init(&pool, size, slot_size);
+}
+
+packet_t *PACKET_ALLOC()
+{
+	packet_t *buf = pool_get(&pool);
+
+	return buf ? (packet_t *)((char *)buf + wire_prefix) : NULL;
+}
+
+void PACKET_FREE(packet_t *pkt)
+{
+	pool_put(&pool, (packet_t *)wire_start(pkt));
+}
+
+int PACKET_KEEP(packet_t *pkt)
+{
+	packet_t *replacement;
+
+	assert(pkt == rx_pkts[rx_current]);
+	replacement = PACKET_ALLOC();
+	if (!replacement)
+	{
+		DEBUG_ERRORS(1, "Packet pool exhausted, received packet not kept");
+		return 0;
+	}
+	rx_pkts[rx_current] = replacement;
+	if (!udp_offload)
+		rx_iov[rx_current].iov_base = wire_start(replacement); // With GRO the datagrams are received elsewhere and copied into rx_pkts
+	return 1;
+}
+
+/* Segment size of a message received with GRO: the datagrams it carries are this long, except maybe the last one */
+static int gro_segment_size(struct msghdr *msg, int len)
+{
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+			return *(int *)CMSG_DATA(cm);
+	return len; // A single datagram
+}
+
+static void payload_mismatch()
+{ // Corruption never makes a packet longer: the peer sends larger payloads than ours (or uses -n and we do not)
+	fprintf(stderr, "[received a datagram of more than %zu bytes: the other end uses a larger payload, both must use the same -b (and -n)]\n",
+			slot_size);
+	exit(1);
+}
+
+/*
+ * Datagrams are waiting in the network socket: drain up to io_batch messages with one recvmmsg
+ * call. Without offload every message is a datagram, received straight into a pool buffer.
+ * With GRO a message can carry many datagrams (all from the same source); each one is copied
+ * into a pool buffer, so the protocol sees the same packets (and can PACKET_KEEP them) either way.
+ */
+static void network_readable()
+{
+	int i, n, len, seg, off;
+	char *buf;
+
+	for (i = 0; i < io_batch && (udp_offload || multi_conn); i++)
+	{ // recvmmsg overwrites them
+		if (udp_offload)
+			rx_msgs[i].msg_hdr.msg_controllen = sizeof(rx_cmsgs[i].buf);
+		if (multi_conn)
+			rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addrs[i]);
+	}
+	n = simulation ? sim_recvmmsg(rx_msgs, io_batch, &peer) : recvmmsg(nfd, rx_msgs, io_batch, 0, NULL);
+	rx_syscalls++;
+	if (n < 0)
+	{
+		if (errno != EAGAIN)
+		{
+			perror("recvmmsg");
+			pause();
+		}
 		return;
-	send_callback(); // The application is always ready to generate a flow of data!!
+	}
+	if (multi_conn || transfer_blocks)
+		rx_now_ns = monotonic_ns();
+	for (i = 0; i < n; i++)
+	{
+		len = rx_msgs[i].msg_len;
+		received_bytes += len;
+		if (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			payload_mismatch();
+		if (!udp_offload)
+		{
+			if (LOG_LEVEL > 3 && opt_debug > 3)
+				print_pkt(rx_pkts[i], "recv", len - wire_prefix);
+			rx_datagrams++;
+			rx_current = i;
+			receive_datagram(rx_pkts[i], len, &rx_addrs[i]); // The protocol may keep it (PACKET_KEEP)
+			continue;
+		}
+		buf = rx_iov[i].iov_base;
+		seg = gro_segment_size(&rx_msgs[i].msg_hdr, len);
+		if (seg > slot_size)
+			payload_mismatch();
+		for (off = 0; off < len; off += seg)
+		{
+			if (seg > len - off)
+				seg = len - off;
+			memcpy(wire_start(rx_pkts[0]), buf + off, seg);
+			if (LOG_LEVEL > 3 && opt_debug > 3)
+				print_pkt(rx_pkts[0], "recv", seg - wire_prefix);
+			rx_datagrams++;
+			rx_current = 0;
+			receive_datagram(rx_pkts[0], seg, &rx_addrs[i]);
+		}
+	}
+}
+
+/* Each queue has room for a full window of every connection (e.g. a whole Go-Back-N retransmission) and some batches */
+static void init_tx_queue(struct tx_queue *q)
+{
+	long size = (long)c.window * max_conns + 4 * io_batch;
+	int i;
+
+	if (size < MIN_TX_QUEUE)
+		size = MIN_TX_QUEUE;
+	if (size > MAX_TX_QUEUE)
+		size = MAX_TX_QUEUE;
+	q->size = size;
+	q->pkts = xmalloc(q->size * slot_size);
+	q->iov = xmalloc(2 * q->size * sizeof(*q->iov));
+	q->corrupt = xmalloc(q->size * sizeof(*q->corrupt));
+	q->conn = xmalloc(q->size * sizeof(*q->conn));
+	q->held = xmalloc(q->size * sizeof(*q->held));
+	for (i = 0; i < q->size; i++)
+	{
+		q->iov[2 * i].iov_base = q->pkts + i * slot_size;
+		q->held[i] = NULL;
+	}
+	q->head = q->count = 0;
 }
 
+/* The delay queue holds what the senders can have in flight (window and retransmissions) plus the other end's ACKs */
+static void init_delay_queue()
+{
+	long size = 2L * c.window * max_conns + 4 * io_batch;
+
+	if (size < MIN_TX_QUEUE)
+		size = MIN_TX_QUEUE;
+	if (size > MAX_TX_QUEUE)
+		size = MAX_TX_QUEUE;
+	dq_init(&delay_q, size, packet_size);
+}
+
+/*
+ * The default socket buffers (~200 KB) only hold a few datagrams of the largest payloads,
+ * so the receive buffer would overflow long before the window is full. They are enlarged
+ * to hold a window of every connection and a batch; the kernel caps the size at
+ * net.core.{r,w}mem_max.
+ */
+static void size_socket_buffers()
+{
+	int opts[2] = {SO_SNDBUF, SO_RCVBUF};
+	int i, want, size;
+	long bytes;
+	socklen_t len;
+
+	bytes = ((long)c.window * max_conns + io_batch) * (long)(slot_size + SOCKET_BUFFER_OVERHEAD);
+	want = bytes < INT_MAX / 2 ? bytes : INT_MAX / 2; // The kernel doubles the value it is given
+	for (i = 0; i < 2; i++)
+	{
+		len = sizeof(size);
+		if (getsockopt(nfd, SOL_SOCKET, opts[i], &size, &len) < 0 || size >= want)
+			continue;
+		setsockopt(nfd, SOL_SOCKET, opts[i], &want, sizeof(want));
+		len = sizeof(size);
+		getsockopt(nfd, SOL_SOCKET, opts[i], &size, &len);
+		if (size < want)
+			fprintf(stderr, "[socket %s buffer: %d bytes, %d wanted; raise net.core.%cmem_max]\n", i ? "receive" : "send", size, want,
+					i ? 'r' : 'w');
+	}
+}
+
+/* Enables UDP GSO and GRO on the socket (-g), or disables the offload if the kernel does not support them */
+static void init_offload()
+{
+	int zero = 0, one = 1;
+
+	if (!udp_offload)
+		return;
+	// UDP_SEGMENT 0 keeps the socket default (no segmentation): the size goes in each message
+	if (setsockopt(nfd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) < 0 || setsockopt(nfd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+	{
+		fprintf(stderr, "[UDP GSO/GRO not available: %s; offload disabled]\n", strerror(errno));
+		udp_offload = 0;
+	}
+}
+
+/* Allocates the transmit queues and the batches used by sendmmsg and recvmmsg */
+static void init_io_batches()
+{
+	int i;
+
+	init_tx_queue(&retx_q);
+	init_tx_queue(&data_q);
+	txq_backpressure = tx_blocked = 0;
+
+	rx_pkts = xmalloc(io_batch * sizeof(*rx_pkts));
+	rx_addrs = xmalloc(io_batch * sizeof(*rx_addrs));
+	rx_iov = xmalloc(io_batch * sizeof(*rx_iov));
+	tx_msgs = xmalloc(io_batch * sizeof(*tx_msgs));
+	tx_segs = xmalloc(io_batch * sizeof(*tx_segs));
+	if (udp_offload)
+	{
+		tx_cmsgs = xmalloc(io_batch * sizeof(*tx_cmsgs));
+		rx_cmsgs = xmalloc(io_batch * sizeof(*rx_cmsgs));
+		gro_bufs = xmalloc((size_t)io_batch * GRO_BUFFER_SIZE);
+	}
+	rx_msgs = xmalloc(io_batch * sizeof(*rx_msgs));
+	memset(tx_msgs, 0, io_batch * sizeof(*tx_msgs));
+	memset(rx_msgs, 0, io_batch * sizeof(*rx_msgs));
+	for (i = 0; i < io_batch; i++)
+	{
+		tx_msgs[i].msg_hdr.msg_iovlen = 2;
+		rx_pkts[i] = PACKET_ALLOC();
+		rx_iov[i].iov_base = wire_start(rx_pkts[i]);
+		rx_iov[i].iov_len = slot_size;
+		rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+		rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		if (multi_conn)
+			rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+		if (udp_offload)
+		{
+			rx_iov[i].iov_base = gro_bufs + (size_t)i * GRO_BUFFER_SIZE;
+			rx_iov[i].iov_len = GRO_BUFFER_SIZE;
+			rx_msgs[i].msg_hdr.msg_control = rx_cmsgs[i].buf;
+		}
+	}
+}
+
+/*
+ * Busy-poll backend (-l): checks every descriptor without blocking. The main loop
+ * spins on it, which gives the lowest latency at the cost of a whole core.
+ */
 void check_events()
 {
 	int i;
@@ -560,128 +1907,213 @@ void check_events()
 
 	for (i = 1; i < ncevents; i++)
 	{
+		if ((cevents[i].fd == nfd) && (cevents[i].revents & POLLOUT))
+		{
+			flush_tx();
+		}
 		if (cevents[i].revents & (POLLIN | POLLERR | POLLHUP))
 		{
 			if (evreaders[i])
 			{
-				if ((cevents[i].fd == rfd) && (!paused_transmission))
+				if ((cevents[i].fd == rfd) && (!transmission_paused()))
 				{
-					xoff = 1;
-					cevents[i].events &= ~POLLIN;
-					if (synthetic_traffic)
-					{
-						synth_tr_start = 1;
-					}
-					else
-					{
-						send_callback();
-					}
+					input_readable();
 				}
 				else if (cevents[i].fd == nfd && (cevents[i].revents & (POLLERR | POLLHUP)))
 				{
-					char addr[NI_MAXHOST] = "unknown";
-					char port[NI_MAXSERV] = "unknown";
-					getnameinfo((const struct sockaddr *)&peer, sizeof(peer), addr, sizeof(addr), port, sizeof(port),
-								NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
-					fprintf(stderr, "[received ICMP port unreachable;"
-									" assuming peer at %s:%s is dead]\n",
-							addr, port);
-					exit(1);
+					network_error();
 				}
 				else if (cevents[i].fd == nfd)
 				{
-					packet_t pkt;
-					// printf("Packet received!!! \n");
-					int len = debug_recv(nfd, &pkt, sizeof(pkt), 0, NULL);
-					if (len < 0)
-					{
-						if (errno != EAGAIN)
-						{
-							perror("recv");
-							pause();
-						}
-					}
-					else
-					{
-						if (len != pkt.len)
-						{				   // Packet was received incomplete. Corrupt!!!
-							pkt.cksum = 0; // Simple model!!! 1: checksum OK; 0: checksum fails!!
-							pkt.len = rand() % 516;
-							pkt.seqno = rand() % 1024;
-							if (len > DATA_PACKET_HEADER)
-								for (i = 0; i < (len - DATA_PACKET_HEADER); i++)
-									pkt.data[i] = rand() % 256;
-						}
-						DEBUG_RECEPTION(1, "Packet received");
-						if (synthetic_traffic && pkt.len > ACK_PACKET_SIZE)
-						{
-							DEBUG_RECEPTION(2, "Bytes received: %d, Length field: %d, SEQ index: %d, ACK index: %d, block %d\n",
-											len, pkt.len, pkt.seqno, pkt.ackno, (unsigned char)pkt.data[0]);
-						}
-						else
-						{
-							DEBUG_RECEPTION(2, "Bytes received: %d, Length field: %d, SEQ index: %d, ACK index: %d",
-											len, pkt.len, pkt.seqno, pkt.ackno);
-						}
-						assert(receivedPackets >= 0);
-						if (receivedPackets == 0)
-						{ // First received packet!! Start the reception timer!!
-							clock_gettime(CLOCK_MONOTONIC, &start_rx_time);
-						}
-						receivedPackets++;
-						if (pkt.cksum == 1)
-						{
-							DEBUG_ERRORS(2, "Received packet is correct (checksum OK)");
-							assert(receivedCorrectPackets >= 0);
-							receivedCorrectPackets++;
-						}
-						else
-						{
-							DEBUG_ERRORS(1, "Received packet is corrupted (checksum fails!)");
-							assert(receivedCorruptPackets >= 0);
-							receivedCorruptPackets++;
-						}
-						receive_callback(&pkt, len);
-						// memset(&pkt, 0xc9, len); /* for debugging */
-					}
+					network_readable();
 				}
 			}
 			else
 			{
-				perror("evreaders");
-				pause();
-				exit(1);
+				perror("evreaders");
+				pause();
+				exit(1);
+			}
+		}
+		if (cevents[i].revents & (POLLHUP | POLLERR))
+		{
+			/* If stderr has an error, the tester has probably died, so exit
+			 * immediately. */
+			if (cevents[i].fd == 2)
+			{
+				perror("POLLHUP | POLLERR");
+				pause();
+				exit(1);
+			}
+			cevents[i].fd = -1;
+		}
+		cevents[i].revents = 0;
+	}
+}
+
+/* Adds fd to the epoll set. Returns -1 (errno EPERM) for files that epoll can not watch, e.g. regular files */
+static int epoll_add(int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Blocking backend (default): the network socket, the console and a timerfd are registered in an epoll set */
+static void init_epoll()
+{
+	epfd = epoll_create1(0);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epfd < 0 || tfd < 0)
+	{
+		perror("epoll/timerfd");
+		exit(1);
+	}
+	if (epoll_add(nfd, EPOLLIN) < 0 || epoll_add(tfd, EPOLLIN) < 0)
+	{
+		perror("epoll_ctl");
+		exit(1);
+	}
+	epoll_add(2, 0); /* Do catch errors on stderr (not possible if it is a regular file) */
+	rfd_events = 0;
+	if (epoll_add(rfd, 0) < 0)
+	{
+		if (errno != EPERM)
+		{
+			perror("epoll_ctl");
+			exit(1);
+		}
+		rfd_always_ready = 1; // A regular file or /dev/null: it is always readable
+	}
+	tfd_armed_ns = 0;
+}
+
+/* Requests input events only while the protocol can take more data, so that a ready console does not keep waking us up */
+static void update_input_events()
+{
+	struct epoll_event ev;
+	uint32_t events = (!read_eof && !xoff && !transmission_paused()) ? EPOLLIN : 0;
+
+	if (rfd_always_ready || events == rfd_events || rpoll == 0)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = rfd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, rfd, &ev);
+	rfd_events = events;
+}
+
+/* Arms the timerfd to the earliest timer deadline (or an idle wake-up for print_stats), only if it changed */
+static void arm_wakeup()
+{
+	struct itimerspec its;
+	uint64_t deadline, now;
+
+	if (!tw_next_expiry(&timers, &deadline))
+	{
+		now = monotonic_ns();
+		if (tfd_armed_ns > now)
+			return; // An idle wake-up is already pending
+		deadline = now + IDLE_WAKEUP_NS;
+	}
+	if (deadline == tfd_armed_ns)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000000;
+	its.it_value.tv_nsec = deadline % 1000000000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1; // A zero date would disarm the timerfd
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	tfd_armed_ns = deadline;
+}
+
+/*
+ * Blocking backend: sleeps until a packet, console input or the next timer
+ * deadline. It never sleeps while the synthetic generator has data to send.
+ */
+void wait_events()
+{
+	struct epoll_event ev[EPOLL_BATCH];
+	uint64_t expirations;
+	int i, n, timeout, want_input;
+
+	update_input_events();
+	want_input = rpoll && !read_eof && !xoff && !transmission_paused();
+	if ((synthetic_traffic && synth_tr_start && !transmission_paused()) || (rfd_always_ready && want_input))
+	{
+		timeout = 0;
+	}
+	else
+	{
+		arm_wakeup();
+		timeout = -1;
+	}
+
+	n = epoll_wait(epfd, ev, EPOLL_BATCH, timeout);
+	if (n < 0 && errno != EINTR)
+		perror("epoll_wait");
+	for (i = 0; i < n; i++)
+	{
+		if (ev[i].data.fd == tfd)
+		{
+			if (read(tfd, &expirations, sizeof(expirations)) > 0)
+				tfd_armed_ns = 0;
+		}
+		else if (ev[i].data.fd == nfd)
+		{
+			if (ev[i].events & (EPOLLERR | EPOLLHUP))
+				network_error();
+			if (ev[i].events & EPOLLOUT)
+				flush_tx();
+			if (ev[i].events & EPOLLIN)
+				network_readable();
+		}
+		else if (ev[i].data.fd == rfd)
+		{
+			if (!transmission_paused())
+				input_readable();
+			if ((ev[i].events & (EPOLLERR | EPOLLHUP)) && read_eof)
+			{
+				epoll_ctl(epfd, EPOLL_CTL_DEL, rfd, NULL);
+				rpoll = 0;
 			}
 		}
-		if (cevents[i].revents & (POLLHUP | POLLERR))
+		else if (ev[i].events & (EPOLLERR | EPOLLHUP))
 		{
 			/* If stderr has an error, the tester has probably died, so exit
 			 * immediately. */
-			if (cevents[i].fd == 2)
-			{
-				perror("POLLHUP | POLLERR");
-				pause();
-				exit(1);
-			}
-			cevents[i].fd = -1;
+			perror("EPOLLHUP | EPOLLERR");
+			exit(1);
 		}
-		cevents[i].revents = 0;
 	}
+	if (rfd_always_ready && want_input && !transmission_paused())
+		input_readable();
 }
 
-uint16_t cksum(const void *_data, int len)
+/*
+ * Simulation backend (make sim): gives the turn to the other end until a packet arrives or
+ * the next timer deadline comes, or only lets it run at the same date while the synthetic
+ * generator has data to send.
+ */
+static void sim_wait_events()
 {
-	const uint8_t *data = _data;
-	uint32_t sum;
+	uint64_t deadline;
+
+	if (synth_tr_start && !transmission_paused())
+		deadline = 0;
+	else if (!tw_next_expiry(&timers, &deadline))
+		deadline = SIM_NEVER;
+	sim_wait(deadline);
+	if (sim_readable())
+		network_readable();
+}
 
-	for (sum = 0; len >= 2; data += 2, len -= 2)
-		sum += data[0] << 8 | data[1];
-	if (len > 0)
-		sum += data[0] << 8;
-	while (sum > 0xffff)
-		sum = (sum >> 16) + (sum & 0xffff);
-	sum = htons(~sum);
-	return sum ? sum : 0xffff;
+uint16_t cksum(const void *_data, int len)
+{
+	return csum_fold(csum_partial(_data, len, 0)); // Same result as the former byte-pair loop (csum_bytepair)
 }
 
 int make_async(int s)
@@ -721,6 +2153,44 @@ int addreq(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
 	abort();
 }
 
+/* FNV-1a over the bytes addreq compares */
+static uint32_t fnv1a(uint32_t h, const void *_data, size_t len)
+{
+	const unsigned char *data = _data;
+
+	while (len--)
+		h = (h ^ *data++) * 16777619u;
+	return h;
+}
+
+uint32_t addrhash(const struct sockaddr_storage *ss)
+{
+	uint32_t h = fnv1a(2166136261u, &ss->ss_family, sizeof(ss->ss_family));
+
+	switch (ss->ss_family)
+	{
+	case AF_INET:
+	{
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+		h = fnv1a(h, &sin->sin_addr, sizeof(sin->sin_addr));
+		return fnv1a(h, &sin->sin_port, sizeof(sin->sin_port));
+	}
+	case AF_INET6:
+	{
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+		h = fnv1a(h, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+		return fnv1a(h, &sin6->sin6_port, sizeof(sin6->sin6_port));
+	}
+	case AF_UNIX:
+	{
+		const struct sockaddr_un *sun = (const struct sockaddr_un *)ss;
+		return fnv1a(h, sun->sun_path, strlen(sun->sun_path));
+	}
+	}
+	fprintf(stderr, "addrhash: unknown address family %d\n", ss->ss_family);
+	abort();
+}
+
 size_t addrsize(const struct sockaddr_storage *ss)
 {
 	switch (ss->ss_family)
@@ -874,28 +2344,9 @@ int connect_to(int dgram, const struct sockaddr_storage *ss)
 	return s;
 }
 
-static int debug_recv(int s, packet_t *buf, size_t len, int flags, struct sockaddr_storage *from)
-{
-	socklen_t socklen = sizeof(*from);
-	int n;
-	if (from)
-		n = recvfrom(s, buf, len, flags, (struct sockaddr *)from, &socklen);
-	else
-		n = recv(s, buf, len, flags);
-	if (opt_debug > 3)
-		print_pkt(buf, "recv", n);
-	return n;
-}
-
 void initialize_timers()
 {
-	int i;
-	active_timers = 0;
-	for (i = 0; i < TIMER_COUNT; i++)
-	{
-		timer_set[i] = 0;
-		// Note that timer_exp_date[i] never needs to be set, since its value is only valid when timer_set[i] > 0
-	}
+	tw_init(&timers, monotonic_ns());
 }
 
 /*
@@ -947,32 +2398,94 @@ float diffDatesSeconds(struct timespec time1, struct timespec time2)
 void check_timers()
 {
 	int i;
-	struct timespec current_time;
 
-	if (active_timers > 0)
+	if (timers.active == 0)
+		return;
+	// Only the timers that are due are visited, regardless of how many are set
+	while ((i = tw_expire(&timers, monotonic_ns())) >= 0)
 	{
-		clock_gettime(CLOCK_MONOTONIC, &current_time);
-		for (i = 0; i < TIMER_COUNT; i++)
+		DEBUG_TIMER(1, "Timer %d expires", i);
+		if (i == IMPAIR_TIMER)
 		{
-			if (timer_set[i])
-			{
-				if (compareDates(current_time, timer_exp_date[i]) > 0)
-				{					  // The timer has expired!
-					timer_set[i] = 0; // clear the timer, it is expiring now!
-					active_timers--;
-					assert(active_timers >= 0);
-					DEBUG_TIMER(1, "Timer %d expires", i);
-					timer_callback(i);
-				}
-			}
+			release_delayed();
+		}
+		else if (multi_conn)
+		{
+			cur = timer_conn[i - CONN_TIMER_BASE];
+			timer_callback(cur->state, timer_number[i - CONN_TIMER_BASE]);
+		}
+		else
+		{
+			timer_callback(main_conn->state, i);
 		}
 	}
 }
 
+/* Name of the threads whose reports must be told apart: the workers (-j), or the two ends of a simulation. NULL if there is only one */
+static const char *thread_name()
+{
+	return simulation ? "END" : nworkers ? "WORKER" : NULL;
+}
+
+/* Times of a completed fixed-size transfer: of the blocks sent, until the last ACK, and of the ones received, until the last one is accepted */
+static void transfer_report(int sending, int receiving)
+{
+	long long bytes = transfer_blocks * synth_data_block;
+	struct rusage ru;
+	char label[32] = "", cpu[32] = "";
+	double t;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	if (!simulation) // Not the virtual clock: the simulation would not repeat
+		snprintf(cpu, sizeof(cpu), "; CPU: %.3f s", ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+	if (thread_name())
+		snprintf(label, sizeof(label), "%s %d ", thread_name(), worker_index);
+	if (sending)
+	{
+		t = (transfer_tx_end - ((uint64_t)start_tx_time.tv_sec * 1000000000 + start_tx_time.tv_nsec)) / 1e9;
+		printf("\t%sTRANSFER SENT: %lld bytes (%lld blocks) in %.6f s, %.2f Mbps (first block generated to last one acknowledged); "
+			   "retransmissions: %ld (%.2f%% of the data packets); overhead: %.4f bytes sent per application byte%s\n",
+			   label, bytes, transfer_blocks, t, t > 0 ? bytes * 8 / t / 1e6 : 0.0, retransmitted_packets,
+			   retransmitted_packets * 100.0 / (sentPackets - sent_ack_packets), (double)sent_bytes / bytes, cpu);
+	}
+	if (receiving)
+	{
+		t = (int64_t)(transfer_rx_end - transfer_rx_start) / 1e9; // Dates of two hosts: their clocks must agree
+		printf("\t%sTRANSFER RECEIVED: %lld bytes (%lld blocks) in %.6f s, %.2f Mbps (first block generated at the other end to last one accepted); "
+			   "discarded: %ld data packets (duplicates or out of order); overhead: %.4f bytes received per application byte%s\n",
+			   label, bytes, transfer_blocks, t, t > 0 ? bytes * 8 / t / 1e6 : 0.0, discarded_data_packets, (double)received_bytes / bytes, cpu);
+	}
+}
+
+/*
+ * Fixed-size transfer: the end is done once every block it sent was acknowledged and every block it
+ * receives was accepted (if it does both). It stops at once if it only sent; if it received, when
+ * nothing arrived for TRANSFER_LINGER_NS (see run_worker), since the ACK of the last block may be
+ * lost and that block sent again. A simulation stops when both ends are done.
+ */
+static void transfer_progress()
+{
+	int sending = generated_app_bytes > 0, receiving = accepted_app_bytes > 0;
+
+	if (transfer_done || (sending && !transfer_tx_end) || (receiving && !transfer_rx_end))
+		return;
+	transfer_done = 1;
+	transfer_report(sending, receiving);
+	final_report = 1; // The totals now: lingering would only make the speeds lower
+	print_stats();
+	final_report = 0;
+	if (__atomic_add_fetch(&transfer_ends_done, 1, __ATOMIC_SEQ_CST) == transfer_ends && (simulation || !receiving))
+		continue_execution = 0;
+}
+
 void print_stats()
 {
 	struct timespec current_time;
 	float TxSpeed, RxSpeed, TxTime, RxTime;
+	double cwnd;
+	FILE *out = stdout;
+	char *report;
+	size_t report_len;
 
 	if (printed_stats || receivedPackets || generated_app_bytes)
 	{ // At least one timer is started!!
@@ -983,65 +2496,540 @@ void print_stats()
 		return; // We have no stats to print yet
 	}
 	// diffDatesSeconds(struct timespec time1, struct timespec time2) {
-	if (printed_stats && diffDatesSeconds(current_time, last_stat_print_time) < 10)
+	if (printed_stats && !final_report && diffDatesSeconds(current_time, last_stat_print_time) < 10)
 	{
 		return;
 	}
 	// No retunn, so it's time to print stats!
+	if (thread_name())
+		out = open_memstream(&report, &report_len); // Written at once below, so that the reports of the workers do not mix
 	TxTime = diffDatesSeconds(current_time, start_tx_time);
-	if (generated_app_bytes && TxTime > 10)
+	if (generated_app_bytes && (TxTime > 10 || (final_report && TxTime > 0)))
 	{
 
-		printf("\n\tTX STATS: Packets: %ld, Bytes: %lld, Aver. speed: ", sentPackets, sent_bytes);
+		fprintf(out, "\n\tTX STATS: Packets: %ld (%ld dropped, queue full), Bytes: %lld (%.1f per packet copied by the runtime), Aver. speed: ",
+			   sentPackets, sent_dropped_packets, sent_bytes, sentPackets ? (double)tx_copied_bytes / sentPackets : 0.0);
 		TxSpeed = 8.0 * sent_bytes / TxTime;
 		if (TxSpeed <= 10000)
 		{ // < 10 kbps
-			printf(" %.2f bps\n", TxSpeed);
+			fprintf(out, " %.2f bps\n", TxSpeed);
 		}
 		else if (TxSpeed <= 1000000)
 		{ // < 1 Mbps
-			printf(" %.2f kbps\n", TxSpeed / 1000.0);
+			fprintf(out, " %.2f kbps\n", TxSpeed / 1000.0);
 		}
 		else
 		{
-			printf(" %.2f Mbps\n", TxSpeed / 1000000.0);
+			fprintf(out, " %.2f Mbps\n", TxSpeed / 1000000.0);
+		}
+		if (main_conn)
+		{ // With -n, the RTT and the window are those of one connection; the rest covers all of them
+			fprintf(out, "\tRTT STATS: SRTT: %.3f ms, RTTVAR: %.3f ms, RTO: %.3f ms (%ld samples, %ld timeouts)\n", main_conn->rtt.srtt / 1e6,
+				   main_conn->rtt.rttvar / 1e6, main_conn->rtt.rto / 1e6, main_conn->rtt.samples, main_conn->rtt.timeouts);
+			cwnd = main_conn->cc.cwnd;
+			fprintf(out, "\tCC STATS (%s): cwnd: %.1f frames (since last report: min %.1f, avg %.1f, max %.1f), ssthresh: %.1f, losses: %ld, timeouts: %ld\n",
+				   cc_algorithm->name, cwnd, cc_count ? cc_min : cwnd, cc_count ? cc_sum / cc_count : cwnd, cc_count ? cc_max : cwnd,
+				   main_conn->cc.ssthresh, cc_losses, cc_timeouts);
 		}
+		cc_sum = cc_count = 0;
+		if (ack_latency->count)
+			hist_print(out, "ACK LATENCY (since last report)", ack_latency);
+		fprintf(out, "\tTX SYSCALLS%s: %ld sendmmsg calls, %.2f per MB sent (%.1f packets per call)\n", udp_offload ? " (GSO)" : "", tx_syscalls,
+			   sent_bytes ? tx_syscalls * 1e6 / sent_bytes : 0.0, tx_syscalls ? (double)tx_datagrams / tx_syscalls : 0.0);
+		if (impair_enabled(&impair))
+			fprintf(out, "\tIMPAIR STATS (seed %llu): lost: %ld (%ld in bursts), corrupted: %ld, duplicated: %ld, delayed: %ld (%ld reordered, %d held now, %ld dropped)\n",
+				   (unsigned long long)impair.seed, impair.lost, impair.burst_lost, impair.corrupted, impair.duplicated, impair.delayed,
+				   impair.reordered, delay_q.count, delay_q.overflows);
 	}
 	RxTime = diffDatesSeconds(current_time, start_rx_time);
-	if (receivedPackets && RxTime > 10)
+	if (receivedPackets && (RxTime > 10 || (final_report && RxTime > 0)))
 	{
-		printf("\tRX STATS: Packets: %ld (%.1f%% corrupt), App. bytes: %lld, Aver. speed (app. level): ", receivedPackets,
+		fprintf(out, "\tRX STATS: Packets: %ld (%.1f%% corrupt), App. bytes: %lld, Aver. speed (app. level): ", receivedPackets,
 			   receivedCorruptPackets * 100.0 / receivedPackets, accepted_app_bytes);
 		RxSpeed = 8.0 * accepted_app_bytes / RxTime;
 		if (RxSpeed <= 10000)
 		{ // < 10 kbps
-			printf(" %.2f bps\n", RxSpeed);
+			fprintf(out, " %.2f bps\n", RxSpeed);
 		}
 		else if (RxSpeed <= 1000000)
 		{ // < 1 Mbps
-			printf(" %.2f kbps\n", RxSpeed / 1000.0);
+			fprintf(out, " %.2f kbps\n", RxSpeed / 1000.0);
 		}
 		else
 		{
-			printf(" %.2f Mbps\n", RxSpeed / 1000000.0);
+			fprintf(out, " %.2f Mbps\n", RxSpeed / 1000000.0);
 		}
+		if (app_latency->count)
+			hist_print(out, "APP LATENCY (since last report)", app_latency);
+		fprintf(out, "\tRX SYSCALLS%s: %ld recvmmsg calls, %.2f per MB received (%.1f packets per call)\n", udp_offload ? " (GRO)" : "", rx_syscalls,
+			   received_bytes ? rx_syscalls * 1e6 / received_bytes : 0.0, rx_syscalls ? (double)rx_datagrams / rx_syscalls : 0.0);
+		fprintf(out, "\tPOOL STATS: %d buffers of %zu bytes, %d in use (max. %d)\n", pool.size, pool.slot_size, pool.size - pool.nfree,
+			   pool.size - pool.min_free);
+		if (received_data_packets)
+			fprintf(out, "\tACK STATS: %ld ACKs sent for %ld data packets (%.3f ACKs per data packet)\n", sent_ack_packets, received_data_packets,
+				   (double)sent_ack_packets / received_data_packets);
+	}
+	if (multi_conn && ((generated_app_bytes && (TxTime > 10 || final_report)) || (receivedPackets && (RxTime > 10 || final_report))))
+		fprintf(out, "\tCONN STATS: %d open (max. %d), %ld created, %ld closed, %ld refused (too many)\n", nconns, max_conns, conns_created,
+			   conns_closed, conns_refused);
+	hist_merge(ack_latency_run, ack_latency);
+	hist_reset(ack_latency);
+	hist_merge(app_latency_run, app_latency);
+	hist_reset(app_latency);
+	if (thread_name())
+	{
+		fclose(out);
+		if (report_len)
+			printf("\n\t%s %d:\n%s", thread_name(), worker_index, report + (report[0] == '\n'));
+		free(report);
 	}
 	printed_stats = 1;
 	last_stat_print_time.tv_nsec = current_time.tv_nsec;
 	last_stat_print_time.tv_sec = current_time.tv_sec;
 }
 
+/* Latency percentiles of the whole run, at exit */
+static void print_latency_summary()
+{
+	char label[64];
+
+	hist_merge(ack_latency_run, ack_latency);
+	hist_merge(app_latency_run, app_latency);
+	if (ack_latency_run->count)
+	{
+		if (thread_name())
+			snprintf(label, sizeof(label), "%s %d ACK LATENCY (whole run)", thread_name(), worker_index);
+		else
+			snprintf(label, sizeof(label), "ACK LATENCY (whole run)");
+		hist_print(stdout, label, ack_latency_run);
+	}
+	if (app_latency_run->count)
+	{
+		if (thread_name())
+			snprintf(label, sizeof(label), "%s %d APP LATENCY (whole run)", thread_name(), worker_index);
+		else
+			snprintf(label, sizeof(label), "APP LATENCY (whole run)");
+		hist_print(stdout, label, app_latency_run);
+	}
+}
+
+/* Metrics exported with --metrics, see metrics.h. The RTT and congestion window are the ones of the first connection */
+enum
+{
+	M_TX_PACKETS,
+	M_TX_BYTES,
+	M_TX_CORRUPT,
+	M_TX_DROPPED,
+	M_TX_RETRANSMITTED,
+	M_TX_ACKS,
+	M_TX_APP_BYTES,
+	M_TX_SYSCALLS,
+	M_RX_PACKETS,
+	M_RX_BYTES,
+	M_RX_CORRUPT,
+	M_RX_DATA,
+	M_RX_DISCARDED,
+	M_RX_APP_BYTES,
+	M_RX_SYSCALLS,
+	M_CC_LOSSES,
+	M_CC_TIMEOUTS,
+	M_IMPAIR_LOST,
+	M_IMPAIR_CORRUPTED,
+	M_IMPAIR_DUPLICATED,
+	M_IMPAIR_DELAYED,
+	M_CONNS_CREATED,
+	M_CONNS_CLOSED,
+	M_CONNS_REFUSED,
+	M_CONNS,
+	M_SRTT,
+	M_RTTVAR,
+	M_RTO,
+	M_CWND,
+	M_SSTHRESH,
+	M_WINDOW,
+	M_POOL_IN_USE,
+	M_POOL_SIZE,
+	M_RETX_QUEUE,
+	M_DATA_QUEUE,
+	M_DELAY_QUEUE,
+	M_TX_BLOCKED,
+	NMETRICS
+};
+
+static const struct metric_desc metric_descs[NMETRICS] = {
+	[M_TX_PACKETS] = {"reliable_tx_packets_total", "Packets sent by the protocol (data and ACKs), including the ones lost or corrupted by the emulator", METRIC_COUNTER},
+	[M_TX_BYTES] = {"reliable_tx_bytes_total", "Bytes sent by the protocol, headers included", METRIC_COUNTER},
+	[M_TX_CORRUPT] = {"reliable_tx_corrupt_packets_total", "Packets corrupted on purpose (-e)", METRIC_COUNTER},
+	[M_TX_DROPPED] = {"reliable_tx_dropped_packets_total", "Packets dropped because the transmit or delay queue was full", METRIC_COUNTER},
+	[M_TX_RETRANSMITTED] = {"reliable_tx_retransmitted_packets_total", "Data packets sent again", METRIC_COUNTER},
+	[M_TX_ACKS] = {"reliable_tx_ack_packets_total", "ACKs (plain or SACK) sent", METRIC_COUNTER},
+	[M_TX_APP_BYTES] = {"reliable_tx_app_bytes_total", "Application bytes read by the protocol", METRIC_COUNTER},
+	[M_TX_SYSCALLS] = {"reliable_tx_syscalls_total", "sendmmsg calls", METRIC_COUNTER},
+	[M_RX_PACKETS] = {"reliable_rx_packets_total", "Packets received", METRIC_COUNTER},
+	[M_RX_BYTES] = {"reliable_rx_bytes_total", "Bytes received, headers included", METRIC_COUNTER},
+	[M_RX_CORRUPT] = {"reliable_rx_corrupt_packets_total", "Packets received with a wrong checksum", METRIC_COUNTER},
+	[M_RX_DATA] = {"reliable_rx_data_packets_total", "Correct data packets received", METRIC_COUNTER},
+	[M_RX_DISCARDED] = {"reliable_rx_discarded_data_packets_total", "Correct data packets neither delivered nor buffered: duplicates, or out of order with Go-Back-N", METRIC_COUNTER},
+	[M_RX_APP_BYTES] = {"reliable_rx_app_bytes_total", "Application bytes delivered", METRIC_COUNTER},
+	[M_RX_SYSCALLS] = {"reliable_rx_syscalls_total", "recvmmsg calls", METRIC_COUNTER},
+	[M_CC_LOSSES] = {"reliable_cc_losses_total", "Loss events reported to congestion control", METRIC_COUNTER},
+	[M_CC_TIMEOUTS] = {"reliable_cc_timeouts_total", "Timeouts reported to congestion control", METRIC_COUNTER},
+	[M_IMPAIR_LOST] = {"reliable_impair_lost_packets_total", "Packets lost by the emulator", METRIC_COUNTER},
+	[M_IMPAIR_CORRUPTED] = {"reliable_impair_corrupted_packets_total", "Packets corrupted by the emulator", METRIC_COUNTER},
+	[M_IMPAIR_DUPLICATED] = {"reliable_impair_duplicated_packets_total", "Packets sent twice by the emulator", METRIC_COUNTER},
+	[M_IMPAIR_DELAYED] = {"reliable_impair_delayed_packets_total", "Packets held by the emulator", METRIC_COUNTER},
+	[M_CONNS_CREATED] = {"reliable_connections_created_total", "Connections created (-n)", METRIC_COUNTER},
+	[M_CONNS_CLOSED] = {"reliable_connections_closed_total", "Connections closed after being idle (-n)", METRIC_COUNTER},
+	[M_CONNS_REFUSED] = {"reliable_connections_refused_total", "Connections refused, too many (-n)", METRIC_COUNTER},
+	[M_CONNS] = {"reliable_connections", "Connections open", METRIC_GAUGE},
+	[M_SRTT] = {"reliable_srtt_seconds", "Smoothed round-trip time", METRIC_GAUGE},
+	[M_RTTVAR] = {"reliable_rttvar_seconds", "Round-trip time variation", METRIC_GAUGE},
+	[M_RTO] = {"reliable_rto_seconds", "Retransmission timeout", METRIC_GAUGE},
+	[M_CWND] = {"reliable_cwnd_frames", "Congestion window", METRIC_GAUGE},
+	[M_SSTHRESH] = {"reliable_ssthresh_frames", "Slow start threshold", METRIC_GAUGE},
+	[M_WINDOW] = {"reliable_window_frames", "Window of every connection (-w)", METRIC_GAUGE},
+	[M_POOL_IN_USE] = {"reliable_pool_buffers_in_use", "Packet buffers held: frames waiting for their ACK and frames in reorder buffers (window occupancy)", METRIC_GAUGE},
+	[M_POOL_SIZE] = {"reliable_pool_buffers", "Packet buffers in the pool", METRIC_GAUGE},
+	[M_RETX_QUEUE] = {"reliable_retx_queue_packets", "Retransmissions waiting to be sent", METRIC_GAUGE},
+	[M_DATA_QUEUE] = {"reliable_data_queue_packets", "New data and ACKs waiting to be sent", METRIC_GAUGE},
+	[M_DELAY_QUEUE] = {"reliable_delay_queue_packets", "Packets held by the emulator", METRIC_GAUGE},
+	[M_TX_BLOCKED] = {"reliable_tx_blocked", "1 while the socket is not writable", METRIC_GAUGE},
+};
+
+static struct metrics_block *metric_blocks; /* One per worker, NULL without --metrics */
+static char *metrics_path;
+
+/* Copies the stats of this worker to its metrics block; once per event loop iteration */
+static void publish_metrics()
+{
+	struct metrics_block *b = &metric_blocks[worker_index];
+	double *v = b->v;
+
+	metrics_write_begin(b);
+	v[M_TX_PACKETS] = sentPackets;
+	v[M_TX_BYTES] = sent_bytes;
+	v[M_TX_CORRUPT] = sent_corrupt_packets;
+	v[M_TX_DROPPED] = sent_dropped_packets;
+	v[M_TX_RETRANSMITTED] = retransmitted_packets;
+	v[M_TX_ACKS] = sent_ack_packets;
+	v[M_TX_APP_BYTES] = generated_app_bytes;
+	v[M_TX_SYSCALLS] = tx_syscalls;
+	v[M_RX_PACKETS] = receivedPackets;
+	v[M_RX_BYTES] = received_bytes;
+	v[M_RX_CORRUPT] = receivedCorruptPackets;
+	v[M_RX_DATA] = received_data_packets;
+	v[M_RX_DISCARDED] = discarded_data_packets;
+	v[M_RX_APP_BYTES] = accepted_app_bytes;
+	v[M_RX_SYSCALLS] = rx_syscalls;
+	v[M_CC_LOSSES] = cc_losses;
+	v[M_CC_TIMEOUTS] = cc_timeouts;
+	v[M_IMPAIR_LOST] = impair.lost;
+	v[M_IMPAIR_CORRUPTED] = impair.corrupted;
+	v[M_IMPAIR_DUPLICATED] = impair.duplicated;
+	v[M_IMPAIR_DELAYED] = impair.delayed;
+	v[M_CONNS_CREATED] = conns_created;
+	v[M_CONNS_CLOSED] = conns_closed;
+	v[M_CONNS_REFUSED] = conns_refused;
+	v[M_CONNS] = nconns;
+	v[M_SRTT] = main_conn ? main_conn->rtt.srtt / 1e9 : 0;
+	v[M_RTTVAR] = main_conn ? main_conn->rtt.rttvar / 1e9 : 0;
+	v[M_RTO] = main_conn ? main_conn->rtt.rto / 1e9 : 0;
+	v[M_CWND] = main_conn ? main_conn->cc.cwnd : 0;
+	v[M_SSTHRESH] = main_conn ? main_conn->cc.ssthresh : 0;
+	v[M_WINDOW] = c.window;
+	v[M_POOL_IN_USE] = pool.size - pool.nfree;
+	v[M_POOL_SIZE] = pool.size;
+	v[M_RETX_QUEUE] = retx_q.count;
+	v[M_DATA_QUEUE] = data_q.count;
+	v[M_DELAY_QUEUE] = delay_q.count;
+	v[M_TX_BLOCKED] = tx_blocked;
+	metrics_write_end(b);
+}
+
+/*
+	Opens the sockets of the workers, all bound to sl with SO_REUSEPORT. The
+kernel would spread the datagrams by hashing their addresses and ports, but all
+the -n connections with a peer share them, so a classic BPF program steers by
+the connection ID at the start of the payload instead: connection i goes to
+worker i % nworkers, the same one that opens it (see run_worker).
+*/
+static void open_worker_sockets(struct sockaddr_storage *sl)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),			   // A = connection ID (BPF loads are big-endian, as on the wire)
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nworkers), // A %= workers
+		BPF_STMT(BPF_RET | BPF_A, 0),				   // Index of the socket in the group
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+	char portname[NI_MAXSERV] = "?";
+	socklen_t len;
+	int i, s, one = 1;
+
+	workers = xmalloc(nworkers * sizeof(*workers));
+	for (i = 0; i < nworkers; i++)
+	{
+		s = socket(sl->ss_family, SOCK_DGRAM, 0);
+		if (s < 0 || setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 || bind(s, (struct sockaddr *)sl, addrsize(sl)) < 0)
+		{
+			perror("worker socket");
+			exit(1);
+		}
+		if (i == 0)
+		{ // If bound port 0, the others must bind the port the kernel selected
+			len = sizeof(*sl);
+			getsockname(s, (struct sockaddr *)sl, &len);
+			getnameinfo((struct sockaddr *)sl, len, NULL, 0, portname, sizeof(portname), NI_DGRAM | NI_NUMERICSERV);
+		}
+		make_async(s);
+		workers[i].index = i;
+		workers[i].fd = s;
+	}
+	// The program applies to the whole group, and sockets get their index in the order they were bound
+	if (setsockopt(workers[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+	{
+		perror("SO_ATTACH_REUSEPORT_CBPF");
+		exit(1);
+	}
+	fprintf(stderr, "[%d workers listening on UDP port %s]\n", nworkers, portname);
+}
+
+/* Binds the calling worker to one of the CPUs the process may run on (--pin) */
+static void pin_worker(void)
+{
+	cpu_set_t allowed, set;
+	int cpu, n = 0, target;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+	target = worker_index % CPU_COUNT(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && n++ == target)
+			break;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (errno)
+		fprintf(stderr, "[worker %d: can not pin to CPU %d: %s]\n", worker_index, cpu, strerror(errno));
+}
+
+/* Sets up the runtime state of a worker (the main thread without -j) and runs the event loop until the end */
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	int i;
+	socklen_t len;
+	char path[PATH_MAX];
+
+	worker_index = w->index;
+	nfd = w->fd;
+	rfd = nworkers ? start_fd : 0; // read file descriptor 0: stdin
+	wfd = 1;					   // write file descriptor 1: stdout
+	if (pin_workers)
+		pin_worker();
+	if (pcap_path)
+	{
+		len = sizeof(local_addr);
+		if (simulation)
+			local_addr = sim_addr;
+		else
+			getsockname(nfd, (struct sockaddr *)&local_addr, &len);
+		if (thread_name())
+			snprintf(path, sizeof(path), "%s.%d", pcap_path, worker_index);
+		else
+			snprintf(path, sizeof(path), "%s", pcap_path);
+		if (pcap_open(&pcap, path, pcap_size, pcap_snaplen, peer.ss_family) < 0)
+		{
+			perror(path);
+			exit(1);
+		}
+	}
+
+	initialize_timers();
+	impair_init(&impair, &impair_cfg, impair_seed + worker_index);
+	if (impair_enabled(&impair) && worker_index == 0)
+		fprintf(stderr, "[impairments: seed %llu, use --seed %llu to repeat them]\n", (unsigned long long)impair_seed,
+				(unsigned long long)impair_seed);
+	packet_ptr = xmalloc(packet_size);
+	memset(packet_ptr, 0, packet_size);
+	init_pool();
+	init_offload();
+	init_io_batches();
+	if (!simulation)
+		size_socket_buffers();
+	if (impair.delays)
+		init_delay_queue();
+
+	// Stats
+	receivedPackets = receivedCorrectPackets = receivedCorruptPackets = 0;
+	sent_ack_packets = received_data_packets = 0;
+	tx_copied_bytes = 0;
+	sentPackets = sent_correct_packets = sent_corrupt_packets = sent_dropped_packets = 0;
+	generated_app_bytes = accepted_app_bytes = 0;
+	sent_bytes = sent_correct_bytes = sent_corrupt_bytes = 0; // Overall: Headers + application, including correct and corrupt packets
+	printed_stats = 0;
+	ack_latency = xmalloc(sizeof(*ack_latency));
+	ack_latency_run = xmalloc(sizeof(*ack_latency_run));
+	app_latency = xmalloc(sizeof(*app_latency));
+	app_latency_run = xmalloc(sizeof(*app_latency_run));
+	hist_reset(ack_latency);
+	hist_reset(ack_latency_run);
+	hist_reset(app_latency);
+	hist_reset(app_latency_run);
+
+	init_congestion_control();
+	conns = xmalloc(max_conns * sizeof(*conns));
+	if (multi_conn)
+	{
+		ct_init(&conn_table, max_conns);
+		for (i = 1; i <= open_conns; i++)
+		{
+			if (nworkers && i % nworkers != worker_index)
+				continue; // The kernel steers its packets to another worker
+			conn_create(&peer, i, 0);
+		}
+		if (nworkers)
+			fprintf(stderr, "[worker %d: %d connections open, up to %d]\n", worker_index, nconns, max_conns);
+		else
+			fprintf(stderr, "[%d connections open, up to %d]\n", nconns, max_conns);
+	}
+	else
+	{
+		conn_create(&peer, 0, 0);
+	}
+	cur = main_conn;
+	last_sweep_ns = monotonic_ns();
+	conn_mkevents();
+	if (simulation)
+		synth_tr_start = 1; // Nobody presses enter: both ends start sending right away
+	else if (!busy_poll)
+		init_epoll();
+
+	while (continue_execution)
+	{
+		if (simulation)
+			sim_wait_events();
+		else if (busy_poll)
+			check_events();
+		else
+			wait_events();
+		if (synthetic_traffic && !transmission_paused() && synth_tr_start)
+			generateSyntheticData();
+		check_timers();
+		if (multi_conn)
+			expire_idle_conns();
+		if (!tx_blocked)
+			flush_tx();
+		if (busy_poll)
+			sched_yield();
+		print_stats();
+		if (metric_blocks)
+			publish_metrics();
+		if (transfer_done && !simulation && monotonic_ns() - rx_now_ns >= TRANSFER_LINGER_NS)
+			continue_execution = 0;
+	}
+	flush_tx();
+	if (simulation && !transfer_done)
+	{ // Nobody is watching the reports go by: the totals of the whole simulation
+		final_report = 1;
+		print_stats();
+	}
+	print_latency_summary();
+	if (pcap_path)
+	{
+		pcap_close(&pcap);
+		fprintf(stderr, "[%ld packets captured in %s, %ld older ones overwritten]\n", pcap.packets - pcap.overwritten, path, pcap.overwritten);
+	}
+	return NULL;
+}
+
+// Options that only have a long name
+enum
+{
+	OPT_LOSS = 256,
+	OPT_GILBERT,
+	OPT_DUPLICATE,
+	OPT_DELAY,
+	OPT_JITTER,
+	OPT_REORDER,
+	OPT_REORDER_DELAY,
+	OPT_SEED,
+	OPT_MAX_CONNS,
+	OPT_PIN,
+	OPT_METRICS,
+	OPT_PCAP,
+	OPT_PCAP_SIZE,
+	OPT_PCAP_SNAPLEN,
+	OPT_SIM_RATE,
+	OPT_SIM_DELAY,
+	OPT_SIM_QUEUE,
+	OPT_SIM_TIME,
+	OPT_BYTES,
+	OPT_BLOCKS
+};
+
+// Link of the simulation (make sim), see sim.h
+#define DEFAULT_SIM_RATE 10000000ULL /* 10 Mbps */
+#define DEFAULT_SIM_DELAY 5000000ULL /* 5 ms */
+#define DEFAULT_SIM_QUEUE 64
+#define DEFAULT_SIM_TIME 60.0		 /* s */
+
 static void usage(void)
 {
-	fprintf(stderr, "usage: %s listening-port [host:]destination-port [options]\n", progname);
+	if (simulation)
+		fprintf(stderr, "usage: %s [options]\n", progname);
+	else
+		fprintf(stderr, "usage: %s listening-port [host:]destination-port [options]\n", progname);
 	fprintf(stderr, "\tOptions:\t-e E: probability of packet corruption of E%% (default: 0%%)\n");
 	fprintf(stderr, "\t\t\t-w W: Define a window of W frames, which is passed to connection_initialization (default: 1 frame)\n");
 	fprintf(stderr, "\t\t\t-t T: Define a timeout of T nanoseconds, which is passed to connection_initialization (default: 10000000 ns, 10ms)\n");
+	fprintf(stderr, "\t\t\t-r: Use Selective Repeat (per-frame ACKs and receiver reorder buffer) instead of Go-Back-N\n");
+	fprintf(stderr, "\t\t\t-k: Selective ACKs: cumulative ACK plus a bitmap of the frames received after it (requires -r; both ends must use it)\n");
+	fprintf(stderr, "\t\t\t-a N: Delayed ACKs: acknowledge every N in-order frames (default: 1, every frame)\n");
+	fprintf(stderr, "\t\t\t-A T: Send a delayed ACK at most T nanoseconds after the frame it confirms (default: %ld ns)\n", DEFAULT_ACK_DELAY_NS);
+	fprintf(stderr, "\t\t\t-x X: Compute a real checksum of every packet instead of simulating it: inet (16-bit one's complement) or crc32c. Both ends must use the same\n");
+	fprintf(stderr, "\t\t\t--loss P: Lose P%% of the sent packets, independently\n");
+	fprintf(stderr, "\t\t\t--gilbert P,R[,B[,G]]: Burst losses (Gilbert-Elliott): P%% and R%% chance per packet of moving to the bad state and back, B%% loss in the bad state (default: 100%%), G%% in the good one (default: 0%%)\n");
+	fprintf(stderr, "\t\t\t--duplicate P: Send P%% of the packets twice\n");
+	fprintf(stderr, "\t\t\t--delay T: Delay every packet T nanoseconds\n");
+	fprintf(stderr, "\t\t\t--jitter J: Add a uniform random deviation of up to +-J nanoseconds to the delay\n");
+	fprintf(stderr, "\t\t\t--reorder P: Hold P%% of the packets some more time, so that the next ones overtake them\n");
+	fprintf(stderr, "\t\t\t--reorder-delay T: Extra time reordered packets are held (default: %ld ns)\n", DEFAULT_REORDER_DELAY_NS);
+	fprintf(stderr, "\t\t\t--seed S: Seed of the impairments (default: the current time); the same seed gives the same losses, corruptions...\n");
+	fprintf(stderr, "\t\t\t-b B: Send up to B bytes of payload per data packet (default: %d, max: %d). Both ends must use the same\n", DEFAULT_PAYLOAD, MAX_PAYLOAD);
+	fprintf(stderr, "\t\t\t-g: UDP segmentation offload: send runs of equal-sized packets in one GSO message, and receive coalesced ones with GRO\n");
+	fprintf(stderr, "\t\t\t-n N: Multi-connection mode: open N connections to the destination (0: only accept them), each with its own protocol state. The other end must use -n too. Requires -s\n");
+	fprintf(stderr, "\t\t\t--max-conns M: Max. connections at once with -n, including the ones the peer opens (default: N or %d, whichever is larger)\n", DEFAULT_MAX_CONNS);
+	fprintf(stderr, "\t\t\t-j J: Run J worker threads, each with its own socket (SO_REUSEPORT) and share of the -n connections (requires -n; not with -g)\n");
+	fprintf(stderr, "\t\t\t--pin: Pin every worker thread to a different CPU (requires -j)\n");
+	fprintf(stderr, "\t\t\t-l: Low-latency mode: busy-poll the network and the timers instead of sleeping until the next event\n");
+	fprintf(stderr, "\t\t\t-m M: Send and receive up to M datagrams per system call (default: %d, max: %d)\n", DEFAULT_IO_BATCH, MAX_IO_BATCH);
+	fprintf(stderr, "\t\t\t-c C: Congestion control algorithm: none, reno or cubic (default: none)\n");
+	fprintf(stderr, "\t\t\t-C F: Write a CSV trace of the congestion window to file F\n");
 	fprintf(stderr, "\t\t\t-s: Use synthetic traffic, instead of the console, for input-output\n");
-	fprintf(stderr, "\t\t\t-d D: Print debug messages, with verbosity D (possible values 1 to 3)\n");
+	fprintf(stderr, "\t\t\t--bytes N: Send N bytes (rounded up to whole blocks of -b bytes) and exit once they are acknowledged, printing the time it took. Both ends must use the same. Requires -s, not with -n\n");
+	fprintf(stderr, "\t\t\t--blocks N: The same, N blocks of -b bytes\n");
+	fprintf(stderr, "\t\t\t--metrics PATH: Export live counters and gauges on a Unix socket at PATH, in Prometheus text or JSON (see metrics.h)\n");
+	fprintf(stderr, "\t\t\t--pcap F: Capture every packet sent, received, corrupted, lost or dropped to the pcapng file F (F.i for worker i with -j)\n");
+	fprintf(stderr, "\t\t\t--pcap-size M: The capture is a ring of M MB: only the last packets are kept (default: %d MB)\n", DEFAULT_PCAP_MB);
+	fprintf(stderr, "\t\t\t--pcap-snaplen B: Keep only the first B bytes of every datagram (default: all)\n");
+	if (simulation)
+	{
+		fprintf(stderr, "\t\t\tSimulation: both ends run here, with synthetic traffic (-s), over a simulated link and on a virtual clock (see sim.h)\n");
+		fprintf(stderr, "\t\t\t--sim-rate R: Rate of each direction of the link, in bits/s (default: %llu; 0: unlimited)\n", DEFAULT_SIM_RATE);
+		fprintf(stderr, "\t\t\t--sim-delay T: Propagation delay of the link, in nanoseconds (default: %llu ns)\n", DEFAULT_SIM_DELAY);
+		fprintf(stderr, "\t\t\t--sim-queue Q: Packets that can wait to be sent on each direction, the others are dropped (default: %d)\n", DEFAULT_SIM_QUEUE);
+		fprintf(stderr, "\t\t\t--sim-time S: Seconds of virtual time simulated (default: %.0f s)\n", DEFAULT_SIM_TIME);
+	}
+	fprintf(stderr, "\t\t\t-d D: Print debug messages, with verbosity D (possible values 1 to 4, up to the LOG_LEVEL of the build: %d)\n",
+			LOG_LEVEL);
 	exit(1);
 }
 
+static void stop_execution(int sig)
+{
+	continue_execution = 0;
+}
+
 int main(int argc, char **argv)
 {
 	struct option o[] = {
@@ -1050,8 +3038,48 @@ int main(int argc, char **argv)
 		{"synthetic", no_argument, NULL, 's'},
 		{"debug", no_argument, NULL, 'd'},
 		{"window", required_argument, NULL, 'w'},
+		{"selective", no_argument, NULL, 'r'},
+		{"low-latency", no_argument, NULL, 'l'},
+		{"batch", required_argument, NULL, 'm'},
+		{"congestion", required_argument, NULL, 'c'},
+		{"cwnd-trace", required_argument, NULL, 'C'},
+		{"sack", no_argument, NULL, 'k'},
+		{"ack-every", required_argument, NULL, 'a'},
+		{"ack-delay", required_argument, NULL, 'A'},
+		{"checksum", required_argument, NULL, 'x'},
+		{"payload", required_argument, NULL, 'b'},
+		{"gso", no_argument, NULL, 'g'},
+		{"connections", required_argument, NULL, 'n'},
+		{"max-conns", required_argument, NULL, OPT_MAX_CONNS},
+		{"workers", required_argument, NULL, 'j'},
+		{"pin", no_argument, NULL, OPT_PIN},
+		{"metrics", required_argument, NULL, OPT_METRICS},
+		{"pcap", required_argument, NULL, OPT_PCAP},
+		{"pcap-size", required_argument, NULL, OPT_PCAP_SIZE},
+		{"pcap-snaplen", required_argument, NULL, OPT_PCAP_SNAPLEN},
+		{"loss", required_argument, NULL, OPT_LOSS},
+		{"gilbert", required_argument, NULL, OPT_GILBERT},
+		{"duplicate", required_argument, NULL, OPT_DUPLICATE},
+		{"delay", required_argument, NULL, OPT_DELAY},
+		{"jitter", required_argument, NULL, OPT_JITTER},
+		{"reorder", required_argument, NULL, OPT_REORDER},
+		{"reorder-delay", required_argument, NULL, OPT_REORDER_DELAY},
+		{"seed", required_argument, NULL, OPT_SEED},
+		{"sim-rate", required_argument, NULL, OPT_SIM_RATE},
+		{"sim-delay", required_argument, NULL, OPT_SIM_DELAY},
+		{"sim-queue", required_argument, NULL, OPT_SIM_QUEUE},
+		{"sim-time", required_argument, NULL, OPT_SIM_TIME},
+		{"bytes", required_argument, NULL, OPT_BYTES},
+		{"blocks", required_argument, NULL, OPT_BLOCKS},
 		{NULL, 0, NULL, 0}};
-	int opt;
+	int opt, n, i, sim_opts = 0;
+	uint64_t seed, one = 1;
+	struct worker w0, ends[2];
+	void *end_args[2] = {&ends[0], &ends[1]};
+	char sim_local[] = "10.0.0.1:5555", sim_remote[] = "10.0.0.2:5555";
+	double sim_time = DEFAULT_SIM_TIME;
+	long long transfer_bytes = 0;
+	struct pollfd enter = {0, POLLIN, 0};
 	char *local = NULL;
 	char *remote = NULL;
 	// struct sockaddr_storage ss;
@@ -1061,14 +3089,29 @@ int main(int argc, char **argv)
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &sa, NULL);
+	/* SIGINT and SIGTERM end the main loop, so that the final stats are printed; a second one kills the process */
+	sa.sa_handler = stop_execution;
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
 	memset(&c, 0, sizeof(c));
 	c.window = 1;
 	c.timeout = 10000000; // default timer:10 ms
+	c.ack_every = 1;
+	c.ack_delay = DEFAULT_ACK_DELAY_NS;
 	synthetic_traffic = 0;
 	synth_tr_start = 0;
-	synth_data_block = MAX_PAYLOAD;
-	paused_transmission = 0;
+	c.payload = DEFAULT_PAYLOAD;
+	io_batch = DEFAULT_IO_BATCH;
+	cc_algorithm = cc_find("none");
+	memset(&impair_cfg, 0, sizeof(impair_cfg));
+	impair_cfg.ge_loss_bad = 1;
+	impair_cfg.reorder_delay = DEFAULT_REORDER_DELAY_NS;
+	seed = simulation ? 1 : time(NULL); // A simulation is repeatable unless asked otherwise
+	sim_cfg.rate = DEFAULT_SIM_RATE;
+	sim_cfg.delay = DEFAULT_SIM_DELAY;
+	sim_cfg.queue = DEFAULT_SIM_QUEUE;
 
 	progname = strrchr(argv[0], '/');
 	if (progname)
@@ -1076,7 +3119,7 @@ int main(int argc, char **argv)
 	else
 		progname = argv[0];
 
-	while ((opt = getopt_long(argc, argv, "e:w:t:sd:", o, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, "e:w:t:rka:A:x:b:gn:j:lm:c:C:sd:", o, NULL)) != -1)
 	{
 		switch (opt)
 		{
@@ -1091,86 +3134,276 @@ int main(int argc, char **argv)
 		case 't':
 			c.timeout = atoi(optarg);
 			break;
+		case 'r':
+			c.selective_repeat = 1;
+			break;
+		case 'k':
+			c.sack = 1;
+			break;
+		case 'a':
+			c.ack_every = atoi(optarg);
+			break;
+		case 'A':
+			c.ack_delay = atol(optarg);
+			break;
+		case 'x':
+			if (!strcmp(optarg, "inet"))
+				c.checksum = CKSUM_INET;
+			else if (!strcmp(optarg, "crc32c"))
+				c.checksum = CKSUM_CRC32C;
+			else
+				usage();
+			break;
+		case 'g':
+			udp_offload = 1;
+			break;
+		case 'n':
+			multi_conn = 1;
+			open_conns = atoi(optarg);
+			break;
+		case OPT_MAX_CONNS:
+			max_conns = atoi(optarg);
+			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			break;
+		case OPT_PIN:
+			pin_workers = 1;
+			break;
+		case OPT_METRICS:
+			metrics_path = optarg;
+			break;
+		case OPT_PCAP:
+			pcap_path = optarg;
+			break;
+		case OPT_PCAP_SIZE:
+			pcap_size = (size_t)atol(optarg) << 20;
+			break;
+		case OPT_PCAP_SNAPLEN:
+			pcap_snaplen = atoi(optarg);
+			break;
+		case 'l':
+			busy_poll = 1;
+			break;
+		case 'm':
+			io_batch = atoi(optarg);
+			break;
+		case 'c':
+			cc_algorithm = cc_find(optarg);
+			if (!cc_algorithm)
+				usage();
+			break;
+		case 'C':
+			cwnd_trace = fopen(optarg, "w");
+			if (!cwnd_trace)
+			{
+				perror(optarg);
+				exit(1);
+			}
+			break;
 		case 's':
 			synthetic_traffic = 1;
-			synth_tx_index = 1;
-			synth_tx_index_1024 = 2;
-			synth_rx_index = 1;
-			synth_rx_index_1024 = 2;
 			break;
 		case 'd':
 			opt_debug = atoi(optarg);
 			break;
-		// case 'b':
-		// 	synth_data_block = atoi(optarg);
-		// 	break;
+		case OPT_LOSS:
+			impair_cfg.loss = atof(optarg) / 100.0;
+			break;
+		case OPT_GILBERT:
+			n = sscanf(optarg, "%lf,%lf,%lf,%lf", &impair_cfg.ge_p, &impair_cfg.ge_r, &impair_cfg.ge_loss_bad, &impair_cfg.ge_loss_good);
+			if (n < 2)
+				usage();
+			impair_cfg.ge_p /= 100.0;
+			impair_cfg.ge_r /= 100.0;
+			impair_cfg.ge_loss_bad = n > 2 ? impair_cfg.ge_loss_bad / 100.0 : 1;
+			impair_cfg.ge_loss_good = n > 3 ? impair_cfg.ge_loss_good / 100.0 : 0;
+			break;
+		case OPT_DUPLICATE:
+			impair_cfg.duplicate = atof(optarg) / 100.0;
+			break;
+		case OPT_DELAY:
+			impair_cfg.delay = strtoull(optarg, NULL, 10);
+			break;
+		case OPT_JITTER:
+			impair_cfg.jitter = strtoull(optarg, NULL, 10);
+			break;
+		case OPT_REORDER:
+			impair_cfg.reorder = atof(optarg) / 100.0;
+			break;
+		case OPT_REORDER_DELAY:
+			impair_cfg.reorder_delay = strtoull(optarg, NULL, 10);
+			break;
+		case OPT_SEED:
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			c.payload = atoi(optarg);
+			break;
+		case OPT_SIM_RATE:
+			sim_cfg.rate = strtoull(optarg, NULL, 10);
+			sim_opts = 1;
+			break;
+		case OPT_SIM_DELAY:
+			sim_cfg.delay = strtoull(optarg, NULL, 10);
+			sim_opts = 1;
+			break;
+		case OPT_SIM_QUEUE:
+			sim_cfg.queue = atoi(optarg);
+			sim_opts = 1;
+			break;
+		case OPT_SIM_TIME:
+			sim_time = atof(optarg);
+			sim_opts = 1;
+			break;
+		case OPT_BYTES:
+			transfer_bytes = strtoll(optarg, NULL, 10);
+			if (transfer_bytes < 1)
+				usage();
+			break;
+		case OPT_BLOCKS:
+			transfer_blocks = strtoll(optarg, NULL, 10);
+			if (transfer_blocks < 1)
+				usage();
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 
-	if (optind + 2 != argc || c.window < 1 || c.timeout < 10)
+	if (simulation)
+		synthetic_traffic = 1;
+	if (optind + (simulation ? 0 : 2) != argc || (sim_opts && !simulation) || sim_cfg.queue < 1 || sim_time <= 0 ||
+		(simulation && (nworkers || udp_offload)) || c.window < 1 || c.timeout < 10 || io_batch < 1 || io_batch > MAX_IO_BATCH || (c.selective_repeat && c.window >= TIMER_COUNT) ||
+		c.ack_every < 1 || c.ack_delay < 1 || c.payload < 1 || c.payload > MAX_PAYLOAD || (impair_cfg.ge_p > 0 && impair_cfg.ge_r <= 0) ||
+		(c.sack && !c.selective_repeat) || open_conns < 0 || max_conns < 0 || (multi_conn && !synthetic_traffic) || (max_conns && !multi_conn) ||
+		nworkers < 0 || nworkers > MAX_WORKERS || pcap_size < (1 << 20) || (nworkers && (!multi_conn || udp_offload)) || (pin_workers && !nworkers) ||
+		((transfer_bytes || transfer_blocks) && (!synthetic_traffic || multi_conn || (transfer_bytes && transfer_blocks))))
 	{
 		usage();
 	}
-
-	local = argv[optind];
-	remote = argv[optind + 1];
+	if (!multi_conn)
+		max_conns = 1;
+	else if (max_conns < open_conns || max_conns == 0)
+		max_conns = open_conns > DEFAULT_MAX_CONNS ? open_conns : DEFAULT_MAX_CONNS;
+	if (nworkers)
+		max_conns = (max_conns + nworkers - 1) / nworkers; // Per worker
+
+	synth_data_block = c.payload;
+	if (transfer_bytes)
+		transfer_blocks = (transfer_bytes + c.payload - 1) / c.payload;
+	transfer_ends = simulation ? 2 : 1;
+	packet_size = DATA_PACKET_HEADER + c.payload;
+	if (packet_size < sizeof(struct sack_packet))
+		packet_size = sizeof(struct sack_packet);
+	wire_prefix = multi_conn ? sizeof(struct conn_header) : 0;
+	slot_size = wire_prefix + packet_size;
+
+	local = simulation ? sim_local : argv[optind];
+	remote = simulation ? sim_remote : argv[optind + 1];
 
 	struct sockaddr_storage sl, sr;
 
-	if (get_address(&sr, 0, 1, AF_INET, remote) < 0 || get_address(&sl, 1, 1, sr.ss_family, local) < 0 || (nfd = listen_on(1, &sl)) < 0)
+	if (get_address(&sr, 0, 1, AF_INET, remote) < 0 || get_address(&sl, 1, 1, sr.ss_family, local) < 0)
 		exit(1);
-	if (connect(nfd, (struct sockaddr *)&sr, addrsize(&sr)) < 0)
+	peer = sr;
+	sim_addr = sl;
+	impair_seed = seed;
+	impair_cfg.corrupt = c.error_probability;
+	csum_init();
+	if (c.checksum != CKSUM_SIMULATED)
+		fprintf(stderr, "[checksum: %s, %s kernel]\n", c.checksum == CKSUM_INET ? "inet" : "crc32c",
+				c.checksum == CKSUM_INET ? csum_kernel : crc32c_kernel);
+	make_async(0);
+	make_async(1);
+	setbuf(stdout, NULL);
+	if (opt_debug > LOG_LEVEL)
+		fprintf(stderr, "[-d %d: built with LOG_LEVEL %d, rebuild with make LOG_LEVEL=%d or make debug]\n", opt_debug, LOG_LEVEL,
+				opt_debug);
+	if (opt_debug && LOG_LEVEL && log_start() < 0)
 	{
-		perror("connect");
+		perror("log");
 		exit(1);
 	}
-	peer = sr;
-
-	rfd = 0; // read file descriptor 0: stdin
-	wfd = 1; // write file descriptor 1: stdout
-	make_async(rfd);
-	make_async(wfd);
-	make_async(nfd);
-	setbuf(stdout, NULL);
-
-	initialize_timers();
-	srand(time(NULL)); // Random number generator initialization
-	packet_ptr = xmalloc(sizeof(packet_t));
-	memset(packet_ptr, 0, sizeof(packet_t));
-	corrupted_packet = xmalloc(sizeof(packet_t));
-	memset(corrupted_packet, 0, sizeof(packet_t));
-	corrupted_packet->cksum = 0;
-
-	// Stats
-	receivedPackets = receivedCorrectPackets = receivedCorruptPackets = 0;
-	sentPackets = sent_correct_packets = sent_corrupt_packets = 0;
-	generated_app_bytes = accepted_app_bytes = 0;
-	sent_bytes = sent_correct_bytes = sent_corrupt_bytes = 0; // Overall: Headers + application, including correct and corrupt packets
-	printed_stats = 0;
+	if (cwnd_trace)
+		fprintf(cwnd_trace, "time_s,event,cwnd,ssthresh\n");
+	if (metrics_path)
+	{
+		n = simulation ? 2 : nworkers ? nworkers : 1;
+		metric_blocks = aligned_alloc(sizeof(*metric_blocks), n * sizeof(*metric_blocks));
+		memset(metric_blocks, 0, n * sizeof(*metric_blocks));
+		if (metrics_start(metrics_path, metric_descs, NMETRICS, metric_blocks, n) < 0)
+		{
+			perror(metrics_path);
+			exit(1);
+		}
+		fprintf(stderr, "[metrics on %s]\n", metrics_path);
+	}
 
-	connection_initialization(c.window, c.timeout);
-	conn_mkevents();
-	if (synthetic_traffic)
+	if (simulation)
 	{
+		sim_cfg.duration = sim_time * 1e9;
+		sim_cfg.mtu = slot_size;
+		continue_execution = 1;
+		for (i = 0; i < 2; i++)
+		{
+			ends[i].index = i;
+			ends[i].fd = -1;
+		}
+		sim_run(&sim_cfg, run_worker, end_args, &continue_execution);
+	}
+	else if (nworkers)
+	{ // The workers watch start_fd instead of the console: it becomes readable (for all of them) when the user presses enter
+		start_fd = eventfd(0, EFD_NONBLOCK);
+		if (start_fd < 0)
+		{
+			perror("eventfd");
+			exit(1);
+		}
+		open_worker_sockets(&sl);
 		printf("Press enter to start the transmission of data (the other end must be ready!)\n\n");
+		continue_execution = 1;
+		for (i = 0; i < nworkers; i++)
+		{
+			errno = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+			if (errno)
+			{
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		while (poll(&enter, 1, -1) < 0 && errno == EINTR && continue_execution)
+			;
+		if (write(start_fd, &one, sizeof(one)) != sizeof(one))
+			perror("eventfd");
+		for (i = 0; i < nworkers; i++)
+			pthread_join(workers[i].thread, NULL);
 	}
-	continue_execution = 1;
-
-	while (continue_execution)
+	else
 	{
-		check_events();
-		if (synthetic_traffic && !paused_transmission && synth_tr_start)
-			generateSyntheticData();
-		check_timers();
-		sched_yield();
-		print_stats();
+		if ((nfd = listen_on(1, &sl)) < 0)
+			exit(1);
+		if (!multi_conn && connect(nfd, (struct sockaddr *)&sr, addrsize(&sr)) < 0)
+		{
+			perror("connect");
+			exit(1);
+		}
+		make_async(nfd);
+		if (synthetic_traffic)
+		{
+			printf("Press enter to start the transmission of data (the other end must be ready!)\n\n");
+		}
+		continue_execution = 1;
+		w0.index = 0;
+		w0.fd = nfd;
+		run_worker(&w0);
 	}
+	if (cwnd_trace)
+		fclose(cwnd_trace);
 	printf("Application finished!\n");
 	fflush(stdout);
 	fflush(stderr);
 
-	return 0;
+	return transfer_blocks && transfer_ends_done < transfer_ends; // A fixed-size transfer that did not complete (interrupted, or --sim-time too short) fails
 }
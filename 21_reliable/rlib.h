@@ -2,6 +2,8 @@
 #include <sys/types.h>
 #include <stdio.h>
 
+#include "log.h"
+
 /*
 	This code is adapted for Universidad del Atlantico - "Redes de Ordenadores"
 from the code used for the following labs:
@@ -20,10 +22,12 @@ from the code used for the following labs:
 
 	There are two kinds of packets, Data packets and Ack-only packets. You can
 tell the type of a packet by length. Ack packets are 8 bytes, while Data
-packets vary from 12 to 512 bytes.
+packets vary from 12 to 12 + c.payload bytes (512 by default).
 
 	Every Data packet contains a 32-bit sequence number and a variable length
-payload that can vary from 0 up to MAXIMUM_PAYLOAD bytes.
+payload that can vary from 0 up to c.payload bytes. The payload size is chosen
+with -b (DEFAULT_PAYLOAD bytes by default, at most MAX_PAYLOAD) and both ends
+must use the same one.
 
 	Both Data and Ack packets contain the following fields:
 		- cksum: 16-bit checksum. This checksum is automatically calculated
@@ -57,22 +61,54 @@ struct ack_packet
 	uint32_t ackno;
 };
 
-// Defines the reserved space for payload in data packets
-#define MAX_PAYLOAD 500
+// Payload size of data packets: c.payload is set with -b
+#define DEFAULT_PAYLOAD 500
+#define MAX_PAYLOAD 65495 /* Largest UDP datagram over IPv4 (65507 bytes) minus the header */
 
-// Data packets' header comprises 4 fields (12 bytes).
+// Data packets' header comprises 4 fields (12 bytes), followed by up to c.payload bytes of data.
+// The struct has no room for the data: packet buffers come from the runtime (PACKET_ALLOC), sized for c.payload.
 struct packet
 {
 	uint16_t cksum;
 	uint16_t len;
 	uint32_t ackno;
 	uint32_t seqno; // Only valid if len > 8
-	char data[MAX_PAYLOAD];
+	char data[];
 };
 typedef struct packet packet_t;
 
-// This macro allows to diferentiate between ack-only and data packets.
-#define IS_ACK_PACKET(packet) ((packet->len) == ACK_PACKET_SIZE)
+/*
+	Selective ACK (SACK) packets extend the ack-only packet with a bitmap, so a
+single ACK can describe every hole in the window:
+		- ackno: cumulative, all the frames before ackno were received and
+	ackno was not.
+		- seqno: always SACK_SEQNO. Data frames are numbered from 1, so a
+	packet with this seqno can never be taken for data.
+		- sack: bit i of word w is set if the frame ackno + 1 + 64 * w + i was
+	received. Only the first (len - SACK_PACKET_HEADER) / 8 words are sent;
+	frames beyond them are reported as not received.
+	SACK is negotiated: a sender that understands SACK (-k) sets SACK_PERMITTED
+in the ackno field of its data packets, and a receiver answers with SACK packets
+only to data packets carrying it. Everybody else keeps the 8-byte ACK.
+*/
+#define SACK_WORDS 4 /* Up to 256 frames after ackno */
+#define SACK_SEQNO 0
+#define SACK_PERMITTED 0x80000000u
+#define SACK_PACKET_HEADER 16
+
+struct sack_packet
+{
+	uint16_t cksum;
+	uint16_t len;
+	uint32_t ackno;
+	uint32_t seqno;	   // SACK_SEQNO
+	uint32_t reserved; // Keeps the bitmap 8-byte aligned
+	uint64_t sack[SACK_WORDS];
+};
+
+// These macros allow to diferentiate between ack-only (plain or SACK) and data packets.
+#define IS_SACK_PACKET(packet) ((packet)->len >= SACK_PACKET_HEADER && (packet)->seqno == SACK_SEQNO)
+#define IS_ACK_PACKET(packet) ((packet)->len == ACK_PACKET_SIZE || IS_SACK_PACKET(packet))
 
 /*
 	Important notes about the framework:
@@ -106,8 +142,9 @@ traffic). The frames have a checksum field in the header, which is
 automatically calculated and set by the library. However, you have to manually
 verify it using an API function described later. When a corruption occurs and a
 data packet does not receive the corresponding ack, it has to be retransmitted.
-You should have activated a timer for this. There are up to 16 different timers
-(0 to 15) which can be active concurrently. When a timer expires, the
+You should have activated a timer for this. There are up to TIMER_COUNT
+different timers (0 to TIMER_COUNT - 1) which can be active concurrently, so
+every frame in the window can have its own timer. When a timer expires, the
 timer_callback function is called. The timeout of the timers is defined in
 nanoseconds; you have to compile with -lrt for this to work (this is already
 included in the Makefile).
@@ -139,13 +176,34 @@ you do not need to understand the major part of the code in those files.
 */
 
 /*
-	This function is called only once at the beginning of the execution. It
-should initialize all the necessary variables for the protocol. Parameters:
+	The runtime can carry many connections at once (-n), so the protocol must
+not keep its variables in globals: each connection has its own state, which
+connection_initialization allocates and returns. The runtime passes that
+pointer back as the first argument of every callback of the connection. The
+API functions (SEND_DATA_PACKET, SET_TIMER, PAUSE_TRANSMISSION, GET_RTO...)
+always act on the connection whose callback is running; timers, the RTO and
+the congestion window are kept per connection. Without -n there is a single
+connection.
+*/
+
+/*
+	This function is called once for every connection, when it is created. It
+should allocate and initialize all the variables the protocol needs for it, and
+return a pointer to them. Parameters:
 		- int window_size: the size of the window, as declared by the -w flag.
 	This window size can be ignored in stop & wait protocol.
-		- long timeout_in_ns: the timeout value to be used in the protocol.
+		- long timeout_in_ns: the initial timeout value to be used in the
+	protocol. Afterwards, use GET_RTO, which adapts it to the measured RTT.
+*/
+void *connection_initialization(int window_size, long timeout_in_ns);
+
+/*
+	This function is called when the runtime closes a connection (for example,
+one the peer stopped using). It must release everything the state holds,
+including the pool buffers (PACKET_FREE), and the state itself. Its timers
+have already been cleared.
 */
-void connection_initialization(int window_size, long timeout_in_ns);
+void connection_destroy(void *state);
 
 /*
 	This function is called when a packet arrives. The packet can be accessed
@@ -153,17 +211,17 @@ with the pkt pointer. The length (number of bytes received) is also passed.
 Note that you should validate the checksum of the packet using the
 VALIDATE_CHECKSUM API call; if the checksum fails, no field can be trusted.
 */
-void receive_callback(packet_t *pkt, size_t len);
+void receive_callback(void *state, packet_t *pkt, size_t len);
 
 /*
 	This function is called when the application has data to be sent. Note that
 if you call PAUSE_TRANSMISSION this function is never called, until you resume
 the transmission.
 */
-void send_callback();
+void send_callback(void *state);
 
-// This function is called when the timer timer_number expires
-void timer_callback(int timer_number);
+// This function is called when the timer timer_number of the connection expires
+void timer_callback(void *state, int timer_number);
 
 /*
 	Additionally, there are several API functions that allow you to interact
@@ -212,6 +270,37 @@ retrieved from the application when the library calls send_callback.
 */
 int SEND_DATA_PACKET(uint16_t length, uint32_t ackno, uint32_t seqno, void *data);
 
+/*
+	Same as SEND_DATA_PACKET, but the payload is sent by reference instead of
+being copied: the header and the payload are gathered by the kernel from their
+own buffers (sendmsg with two iovecs). The data must stay unchanged until the
+packet leaves the transmit queue, so it has to live in a buffer the protocol
+keeps anyway, such as its retransmission buffer. If it is a pool buffer
+(PACKET_ALLOC), the queue holds a reference to it until the packet is sent, so
+the frame can be PACKET_FREEd as soon as it is acknowledged even if some copy
+of it is still queued: the buffer is reused only after that copy leaves.
+*/
+int SEND_DATA_PACKET_REF(uint16_t length, uint32_t ackno, uint32_t seqno, const void *data);
+
+/*
+	The runtime keeps a pool of packet buffers, allocated at startup with room
+for a window of frames to retransmit and a window of out-of-order frames
+(Selective Repeat) per connection, and the packets of one receive batch. Use it instead of copying
+payloads into your own buffers:
+		- PACKET_ALLOC: returns a free packet buffer, with room for c.payload
+	bytes of data, or NULL if all of them are in use. Read the application data straight into its data field and send
+	it with SEND_DATA_PACKET_REF.
+		- PACKET_FREE: gives a buffer back to the pool.
+		- PACKET_KEEP: only valid for the packet passed to receive_callback,
+	while it runs. The protocol takes ownership of the packet (and must
+	PACKET_FREE it later) and the runtime receives into another buffer.
+	Returns 0 if the pool is exhausted: the packet then stays with the
+	runtime and must not be used after receive_callback returns.
+*/
+packet_t *PACKET_ALLOC();
+void PACKET_FREE(packet_t *pkt);
+int PACKET_KEEP(packet_t *pkt);
+
 /*
 	This function validates the checksum to determine if the packet has been
 corrupted in transit. This function returns 0 if the packet is corrupted and
@@ -219,6 +308,10 @@ corrupted in transit. This function returns 0 if the packet is corrupted and
 		- *pkt is a pointer to the packet to be validated
 	You shall use this function when the library calls receive_callback for a
 data packet in order to detect if you need to send and ack or not for this seqno.
+	By default corruption is simulated (-e) and the cksum field only carries
+the verdict. With -x the runtime computes a real checksum over header and
+payload on send, verifies it when the datagram arrives and leaves the verdict
+in the cksum field, so this function works the same in every mode.
 */
 int VALIDATE_CHECKSUM(const packet_t *pkt);
 
@@ -232,10 +325,21 @@ is not corrupted.
 */
 int SEND_ACK_PACKET(uint32_t ackno);
 
+/*
+	Call this function to send a SACK packet. Parameters:
+		- ackno: the cumulative ACK (next frame expected in order).
+		- sack: bitmap of the frames received after ackno (see struct
+	sack_packet).
+		- nwords: number of bitmap words to send, from 0 to SACK_WORDS.
+	Use it only if the data packets of the peer carry SACK_PERMITTED.
+*/
+int SEND_SACK_PACKET(uint32_t ackno, const uint64_t *sack, int nwords);
+
 /*
 	This function activates a timer that will expire in timer_delay_ns
-nanoseconds. There are 16 different timers available, using numbers from 0 to 15.
-You can set multiple timers concurrently, each of them with its own deadline.
+nanoseconds. Every connection has TIMER_COUNT different timers available, using
+numbers from 0 to TIMER_COUNT - 1. You can set multiple timers concurrently, each of them
+with its own deadline. Setting and clearing a timer takes constant time.
 	You shall use this function when a packet has been sent to determine if that
 packet should be re-transmitted or not based on the reception of an ack for it.
 */
@@ -260,22 +364,92 @@ expected ACKs are received.
 void PAUSE_TRANSMISSION();
 void RESUME_TRANSMISSION();
 
+/*
+	The runtime keeps an adaptive retransmission timeout (RTO) for the
+connection, computed from the measured round-trip time as in TCP
+(Jacobson/Karels, RFC 6298): RTO = SRTT + max(RTO_GRANULARITY_NS, 4 * RTTVAR),
+clamped between MIN_RTO_NS and MAX_RTO_NS. On a steady path RTTVAR decays to
+almost 0; the granularity term keeps a margin above SRTT, so that some more
+queueing or scheduling delay does not fire the timer. The timeout passed to
+connection_initialization (-t) is only the initial RTO.
+		- RTT_SAMPLE: call it when an ACK confirms a frame, with the time elapsed
+	since that frame was sent. Do not call it for frames that were retransmitted,
+	since the ACK may belong to any of the copies (Karn's algorithm).
+		- RTO_BACKOFF: call it when a retransmission timer expires; it doubles
+	the RTO. The RTO stays backed off until an ACK confirms a frame that was
+	never retransmitted (Karn's algorithm, RFC 6298 5.7): the next RTT_SAMPLE,
+	or an ACKNOWLEDGED_UP_TO past the first frame sent after the timeout. ACKs
+	of retransmitted frames say nothing about the RTT. They do show that the
+	path works, though: if the window moved since the previous timeout, a new
+	timeout backs off once from the base RTO instead of doubling it again.
+		- GET_RTO: returns the RTO to be used with SET_TIMER, in nanoseconds.
+		- CURRENT_TIME_NS: returns the current (monotonic) time in nanoseconds,
+	to timestamp the frames you send.
+*/
+void RTT_SAMPLE(long rtt_ns);
+void RTO_BACKOFF();
+long GET_RTO();
+uint64_t CURRENT_TIME_NS();
+
+/*
+	The runtime also runs a congestion control algorithm, selected with -c
+(none, reno or cubic; none by default). It keeps a congestion window, in
+frames, that adapts to losses; the sender should never have more than
+min(window, CONGESTION_WINDOW()) unacknowledged frames in flight.
+		- CONGESTION_WINDOW: returns the current congestion window. With -c none
+	it is always the window passed to connection_initialization.
+		- CC_ON_ACK: call it when an ACK confirms "acked" new frames.
+		- CC_ON_LOSS: call it when a frame is lost but ACKs keep arriving (e.g.
+	a frame timer expires while later frames are confirmed). Call it once per
+	window: losses of frames sent before the previous reduction are the same
+	congestion event.
+		- CC_ON_TIMEOUT: call it when the oldest frame has to be retransmitted
+	again, i.e. nothing is getting through.
+*/
+int CONGESTION_WINDOW();
+void CC_ON_ACK(int acked);
+void CC_ON_LOSS();
+void CC_ON_TIMEOUT();
+
+/*
+	Call ACKNOWLEDGED_UP_TO when the start of your send window moves: every
+frame with a seqno below "seqno" was acknowledged. The runtime uses it to tell
+when a fixed-size transfer (--bytes, --blocks) is complete: the last block was
+generated and every frame sent is acknowledged.
+*/
+void ACKNOWLEDGED_UP_TO(uint32_t seqno);
+
 /*------------------------------------------------------------------------------
 |							YOU CAN STOP READING NOW!!						   |
 |	You do not need to understand from here onwards to do your assignment.	   |
 ------------------------------------------------------------------------------*/
 
-#define TIMER_COUNT 16
+#define TIMER_COUNT 131072 /* Timers are kept in a hierarchical wheel, see timer_wheel.h */
 #define ACK_PACKET_SIZE 8
+#define MIN_RTO_NS 1000000L	   /* 1 ms: timers run late by that much on a busy host */
+#define MAX_RTO_NS 2000000000L /* 2 s */
+#define RTO_GRANULARITY_NS 1000000L /* 1 ms: the least margin of the RTO over SRTT (G in RFC 6298) */
 #define DATA_PACKET_HEADER 12
+#define CKSUM_SIMULATED 0 /* cksum is a flag: 1 correct, 0 corrupted by the error model (-e) */
+#define CKSUM_INET 1	  /* Internet checksum of header + payload */
+#define CKSUM_CRC32C 2	  /* CRC32C of header + payload, folded to 16 bits */
+#define DEFAULT_ACK_DELAY_NS 100000L /* 0.1 ms, below MIN_RTO_NS */
 
 struct config_common
 {
 	int window;	  /* # of unacknowledged packets in flight */
 	long timeout; /* Retransmission timeout in nanoseconds*/
 	float error_probability;
+	int selective_repeat; /* Non-zero: Selective Repeat instead of Go-Back-N (-r) */
+	int sack;			  /* Non-zero: offer and answer selective ACKs (-k), requires -r */
+	int ack_every;		  /* Delayed ACKs: one ACK every ack_every in-order frames (-a) */
+	long ack_delay;		  /* ... or ack_delay ns after the first frame not acknowledged yet (-A) */
+	int checksum;		  /* CKSUM_SIMULATED, or a real checksum computed on every packet (-x) */
+	int payload;		  /* Max. payload of a data packet, in bytes (-b) */
 };
 
+extern struct config_common c; /* Runtime configuration, filled in by main */
+
 /*
 from http://stackoverflow.com/questions/3219393/
 http://en.wikipedia.org/wiki/ANSI_escape_code#Colors
@@ -289,41 +463,11 @@ http://en.wikipedia.org/wiki/ANSI_escape_code#Colors
 #define ANSI_COLOR_BLACK "\x1b[0m"
 #define ANSI_COLOR_RESET ANSI_COLOR_BLACK
 
-#define DEBUG_TIMER(priority, MESSAGE, ...)                                                     \
-	{                                                                                           \
-		if (opt_debug >= priority)                                                              \
-		{                                                                                       \
-			printf(ANSI_COLOR_BLUE "    TIMER: " MESSAGE ANSI_COLOR_RESET "\n", ##__VA_ARGS__); \
-			fflush(stdout);                                                                     \
-		}                                                                                       \
-	}
-
-#define DEBUG_RECEPTION(priority, MESSAGE, ...)                                                      \
-	{                                                                                                \
-		if (opt_debug >= priority)                                                                   \
-		{                                                                                            \
-			printf(ANSI_COLOR_GREEN "    RECEPTION: " MESSAGE ANSI_COLOR_RESET "\n", ##__VA_ARGS__); \
-			fflush(stdout);                                                                          \
-		}                                                                                            \
-	}
-
-#define DEBUG_SEND(priority, MESSAGE, ...)                                                        \
-	{                                                                                             \
-		if (opt_debug >= priority)                                                                \
-		{                                                                                         \
-			printf(ANSI_COLOR_MAGENTA "    SEND: " MESSAGE ANSI_COLOR_RESET "\n", ##__VA_ARGS__); \
-			fflush(stdout);                                                                       \
-		}                                                                                         \
-	}
-
-#define DEBUG_ERRORS(priority, MESSAGE, ...)                                                    \
-	{                                                                                           \
-		if (opt_debug >= priority)                                                              \
-		{                                                                                       \
-			printf(ANSI_COLOR_RED "    ERRORS: " MESSAGE ANSI_COLOR_RESET "\n", ##__VA_ARGS__); \
-			fflush(stdout);                                                                     \
-		}                                                                                       \
-	}
+/* Debug records (-d), see log.h: nothing above LOG_LEVEL, and never printed by the caller */
+#define DEBUG_TIMER(priority, MESSAGE, ...) LOG(priority, LOG_TIMER, MESSAGE, ##__VA_ARGS__)
+#define DEBUG_RECEPTION(priority, MESSAGE, ...) LOG(priority, LOG_RECEPTION, MESSAGE, ##__VA_ARGS__)
+#define DEBUG_SEND(priority, MESSAGE, ...) LOG(priority, LOG_SEND, MESSAGE, ##__VA_ARGS__)
+#define DEBUG_ERRORS(priority, MESSAGE, ...) LOG(priority, LOG_ERRORS, MESSAGE, ##__VA_ARGS__)
 
 #define DEBUG_MSG(priority, COLOR, MESSAGE) \
 	{                                       \
@@ -343,6 +487,9 @@ uint16_t cksum(const void *_data, int len); /* compute TCP-like checksum */
 /* Returns 1 when two addresses equal, 0 otherwise */
 int addreq(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
 
+/* Hash of an address: equal addresses (addreq) have the same hash */
+uint32_t addrhash(const struct sockaddr_storage *ss);
+
 /* Actual size of the real socket address structure stashed in a
  sockaddr_storage. */
 size_t addrsize(const struct sockaddr_storage *ss);
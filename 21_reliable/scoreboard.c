@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scoreboard.h"
+
+void sb_init(struct scoreboard *sb, int nbits)
+{
+	uint32_t bits = 64;
+
+	while (bits < nbits)
+		bits *= 2;
+	sb->words = calloc(bits / 64, sizeof(uint64_t));
+	if (!sb->words)
+	{
+		fprintf(stderr, "scoreboard: out of memory allocating %u bits\n", bits);
+		abort();
+	}
+	sb->mask = bits - 1;
+}
+
+void sb_free(struct scoreboard *sb)
+{
+	free(sb->words);
+	sb->words = NULL;
+}
+
+/* Mask of the n bits (1 <= n <= 64 - off) starting at bit off of a word */
+static uint64_t chunk_mask(int off, uint32_t n)
+{
+	return (n >= 64 ? ~0ULL : (1ULL << n) - 1) << off;
+}
+
+/*
+	The range operations walk [from, to) in chunks that never cross a word
+boundary: each iteration handles the bits from pos to the end of its word (or
+to "to"), and the ring wraps because word indexes come from the masked seqno.
+*/
+void sb_clear_range(struct scoreboard *sb, uint32_t from, uint32_t to)
+{
+	uint32_t pos, bit, n;
+
+	for (pos = from; pos != to; pos += n)
+	{
+		bit = pos & sb->mask;
+		n = 64 - (bit & 63);
+		if (n > to - pos)
+			n = to - pos;
+		sb->words[bit >> 6] &= ~chunk_mask(bit & 63, n);
+	}
+}
+
+uint32_t sb_find_first_zero(const struct scoreboard *sb, uint32_t from, uint32_t to)
+{
+	uint32_t pos, bit, n;
+	uint64_t zeros;
+
+	for (pos = from; pos != to; pos += n)
+	{
+		bit = pos & sb->mask;
+		n = 64 - (bit & 63);
+		if (n > to - pos)
+			n = to - pos;
+		zeros = ~sb->words[bit >> 6] & chunk_mask(bit & 63, n);
+		if (zeros)
+			return pos + (__builtin_ctzll(zeros) - (bit & 63));
+	}
+	return to;
+}
+
+int sb_count(const struct scoreboard *sb, uint32_t from, uint32_t to)
+{
+	uint32_t pos, bit, n;
+	int count = 0;
+
+	for (pos = from; pos != to; pos += n)
+	{
+		bit = pos & sb->mask;
+		n = 64 - (bit & 63);
+		if (n > to - pos)
+			n = to - pos;
+		count += __builtin_popcountll(sb->words[bit >> 6] & chunk_mask(bit & 63, n));
+	}
+	return count;
+}
+
+void sb_extract(const struct scoreboard *sb, uint32_t from, int nbits, uint64_t *out)
+{
+	uint32_t wmask = sb->mask >> 6;
+	uint32_t bit, w;
+	int i, off;
+
+	for (i = 0; i < (nbits + 63) / 64; i++)
+	{
+		bit = (from + 64 * i) & sb->mask;
+		w = bit >> 6;
+		off = bit & 63;
+		out[i] = sb->words[w] >> off;
+		if (off)
+			out[i] |= sb->words[(w + 1) & wmask] << (64 - off);
+	}
+	if (nbits & 63)
+		out[i - 1] &= (1ULL << (nbits & 63)) - 1;
+}
@@ -0,0 +1,60 @@
+#include <stdint.h>
+
+/*
+	Bitmap of sequence numbers, used as the SACK scoreboard: one bit per frame,
+set when the frame has been received (receiver) or acknowledged (sender). It is
+a ring of 2^k bits, so seqno s is bit s & mask and only a window of fewer than
+2^k consecutive seqnos can be tracked at once; bits must be cleared before the
+window slides over them again.
+
+	Range operations work a 64-bit word at a time (find-first-zero with ctz,
+counting with popcount), so scanning a window of tens of thousands of frames
+costs a few hundred word operations. Ranges are [from, to) in seqno space.
+*/
+
+#ifndef SCOREBOARD_H
+#define SCOREBOARD_H
+
+struct scoreboard
+{
+	uint64_t *words;
+	uint32_t mask; /* Number of bits - 1 */
+};
+
+/* Allocates an empty scoreboard able to track at least nbits consecutive seqnos */
+void sb_init(struct scoreboard *sb, int nbits);
+
+/* Frees the bits allocated by sb_init */
+void sb_free(struct scoreboard *sb);
+
+static inline int sb_test(const struct scoreboard *sb, uint32_t seqno)
+{
+	uint32_t bit = seqno & sb->mask;
+	return (sb->words[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline void sb_set(struct scoreboard *sb, uint32_t seqno)
+{
+	uint32_t bit = seqno & sb->mask;
+	sb->words[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+static inline void sb_clear(struct scoreboard *sb, uint32_t seqno)
+{
+	uint32_t bit = seqno & sb->mask;
+	sb->words[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+/* Clears every bit in [from, to) */
+void sb_clear_range(struct scoreboard *sb, uint32_t from, uint32_t to);
+
+/* Returns the first seqno in [from, to) whose bit is clear, or to if all are set */
+uint32_t sb_find_first_zero(const struct scoreboard *sb, uint32_t from, uint32_t to);
+
+/* Number of bits set in [from, to) */
+int sb_count(const struct scoreboard *sb, uint32_t from, uint32_t to);
+
+/* Copies the nbits bits starting at from into out: bit i of the result is the bit of seqno from + i. Trailing bits of the last word are 0 */
+void sb_extract(const struct scoreboard *sb, uint32_t from, int nbits, uint64_t *out);
+
+#endif /* SCOREBOARD_H */
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE /* struct mmsghdr */
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+struct sim_packet
+{
+	uint64_t arrival; /* Virtual date it gets to the other end */
+	size_t len;
+};
+
+/* One direction: packets in flight, in the order they were sent (so also of arrival) */
+struct sim_link
+{
+	char *ring;			 /* Slots of sizeof(struct sim_packet) + mtu bytes */
+	int size;			 /* Slots, a power of two */
+	int head;			 /* Oldest packet */
+	int count;
+	uint64_t busy_until; /* Date the last packet queued is completely sent */
+	long sent, dropped;	 /* Packets given to the link, and dropped because its queue was full */
+	long long bytes;
+};
+
+static struct sim_config cfg;
+static size_t slot;
+static uint64_t now;			  /* The virtual clock */
+static struct sim_link links[2];  /* links[e]: from end e to the other one */
+static uint64_t wake[2];		  /* Date each end wants the turn back */
+static int done[2];				  /* The end returned */
+static sem_t turn[2], back;		  /* Hand the turn to an end, and back to the scheduler */
+static void *(*endpoint_fn)(void *);
+static void **endpoint_arg;
+static __thread int self;		  /* End of the calling thread */
+
+static struct sim_packet *link_slot(struct sim_link *l, int i)
+{
+	return (struct sim_packet *)(l->ring + (size_t)((l->head + i) & (l->size - 1)) * slot);
+}
+
+/* Doubles the ring, keeping the packets in order from the first slot */
+static void link_grow(struct sim_link *l)
+{
+	char *ring = malloc((size_t)2 * l->size * slot);
+	int i;
+
+	if (!ring)
+	{
+		perror("sim");
+		exit(1);
+	}
+	for (i = 0; i < l->count; i++)
+		memcpy(ring + (size_t)i * slot, link_slot(l, i), slot);
+	free(l->ring);
+	l->ring = ring;
+	l->size *= 2;
+	l->head = 0;
+}
+
+/* Date the first packet in flight towards end e arrives, SIM_NEVER if none */
+static uint64_t next_arrival(int e)
+{
+	struct sim_link *l = &links[1 - e];
+
+	return l->count ? link_slot(l, 0)->arrival : SIM_NEVER;
+}
+
+static uint64_t next_event(int e)
+{
+	uint64_t a = next_arrival(e);
+
+	return a < wake[e] ? a : wake[e];
+}
+
+int sim_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+	ts->tv_sec = now / 1000000000;
+	ts->tv_nsec = now % 1000000000;
+	return 0;
+}
+
+/* Gives the turn to end e and waits until it gives it back */
+static void resume(int e)
+{
+	sem_post(&turn[e]);
+	while (sem_wait(&back) < 0 && errno == EINTR)
+		;
+}
+
+static void take_turn(void)
+{
+	while (sem_wait(&turn[self]) < 0 && errno == EINTR)
+		;
+}
+
+void sim_wait(uint64_t deadline)
+{
+	wake[self] = deadline < now ? now : deadline;
+	sem_post(&back);
+	take_turn();
+}
+
+int sim_readable(void)
+{
+	return next_arrival(self) <= now;
+}
+
+int sim_sendmmsg(struct mmsghdr *msgs, unsigned int n)
+{
+	struct sim_link *l = &links[self];
+	struct sim_packet *p;
+	struct msghdr *m;
+	uint64_t start, backlog;
+	size_t len;
+	unsigned int i;
+	size_t j;
+	char *data;
+
+	for (i = 0; i < n; i++)
+	{
+		m = &msgs[i].msg_hdr;
+		for (j = 0, len = 0; j < m->msg_iovlen; j++)
+			len += m->msg_iov[j].iov_len;
+		msgs[i].msg_len = len;
+		l->sent++;
+		start = l->busy_until > now ? l->busy_until : now;
+		backlog = cfg.rate ? (start - now) * cfg.rate / 8000000000ULL : 0; // Bytes waiting to be sent
+		if (len > cfg.mtu || backlog + len > (uint64_t)cfg.queue * cfg.mtu)
+		{
+			l->dropped++;
+			continue;
+		}
+		if (l->count == l->size)
+			link_grow(l);
+		p = link_slot(l, l->count++);
+		l->busy_until = start + (cfg.rate ? len * 8000000000ULL / cfg.rate : 0);
+		p->arrival = l->busy_until + cfg.delay;
+		p->len = len;
+		data = (char *)(p + 1);
+		for (j = 0; j < m->msg_iovlen; data += m->msg_iov[j].iov_len, j++)
+			memcpy(data, m->msg_iov[j].iov_base, m->msg_iov[j].iov_len);
+		l->bytes += len;
+	}
+	return n;
+}
+
+int sim_recvmmsg(struct mmsghdr *msgs, unsigned int n, const struct sockaddr_storage *from)
+{
+	struct sim_link *l = &links[1 - self];
+	struct sim_packet *p;
+	struct msghdr *m;
+	unsigned int i;
+
+	for (i = 0; i < n && l->count && (p = link_slot(l, 0))->arrival <= now; i++)
+	{
+		m = &msgs[i].msg_hdr;
+		m->msg_flags = 0;
+		msgs[i].msg_len = p->len < m->msg_iov[0].iov_len ? p->len : m->msg_iov[0].iov_len;
+		if (p->len > m->msg_iov[0].iov_len)
+			m->msg_flags |= MSG_TRUNC;
+		memcpy(m->msg_iov[0].iov_base, p + 1, msgs[i].msg_len);
+		if (m->msg_name)
+		{
+			memcpy(m->msg_name, from, sizeof(*from));
+			m->msg_namelen = sizeof(*from);
+		}
+		l->head = (l->head + 1) & (l->size - 1);
+		l->count--;
+	}
+	if (i == 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return i;
+}
+
+static void *endpoint_thread(void *arg)
+{
+	self = (intptr_t)arg;
+	take_turn();
+	endpoint_fn(endpoint_arg[self]);
+	done[self] = 1;
+	sem_post(&back);
+	return NULL;
+}
+
+void sim_run(const struct sim_config *config, void *(*endpoint)(void *), void *arg[2], volatile sig_atomic_t *running)
+{
+	pthread_t threads[2];
+	struct timespec t0, t1;
+	uint64_t t;
+	int e, next, last = 1;
+
+	cfg = *config;
+	slot = sizeof(struct sim_packet) + cfg.mtu;
+	endpoint_fn = endpoint;
+	endpoint_arg = arg;
+	now = SIM_START_NS;
+	sem_init(&back, 0, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (e = 0; e < 2; e++)
+	{
+		links[e].size = 1024;
+		links[e].ring = malloc(links[e].size * slot);
+		sem_init(&turn[e], 0, 0);
+		errno = pthread_create(&threads[e], NULL, endpoint_thread, (void *)(intptr_t)e);
+		if (!links[e].ring || errno)
+		{
+			perror("sim");
+			exit(1);
+		}
+	}
+	for (e = 0; e < 2; e++)
+		resume(e); // Set up, until it first waits
+
+	while (*running && !done[0] && !done[1])
+	{ // The earliest event; on a tie, the end that did not run last, so that neither can keep the other waiting
+		next = 1 - last;
+		if (next_event(last) < next_event(next))
+			next = last;
+		t = next_event(next);
+		if (t == SIM_NEVER || t - SIM_START_NS > cfg.duration)
+		{
+			if (t != SIM_NEVER)
+				now = SIM_START_NS + cfg.duration; // The stats cover the whole time
+			break;
+		}
+		now = t;
+		last = next;
+		resume(next);
+	}
+
+	*running = 0;
+	for (e = 0; e < 2; e++)
+	{
+		if (!done[e])
+			resume(e);
+		pthread_join(threads[e], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "[simulation: %.3f s of virtual time in %.3f s]\n", (now - SIM_START_NS) / 1e9,
+			(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	for (e = 0; e < 2; e++)
+		fprintf(stderr, "[link %d -> %d: %ld packets, %lld bytes, %ld dropped (queue full)]\n", e, 1 - e, links[e].sent, links[e].bytes,
+				links[e].dropped);
+}
@@ -0,0 +1,64 @@
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+	Discrete-event simulation (make sim). Both ends run in one process, each in
+a thread of its own (the runtime state is thread-local, as with -j), but only
+one of them runs at a time: the scheduler takes the end whose next event is the
+earliest, moves the virtual clock to its date and gives it the turn until it
+waits again. The events are the packets arriving at each end and the date each
+end wants to be woken up at: its earliest timer, or right away while it has
+data to send. Nothing depends on the wall clock or on how the kernel schedules
+the threads, so the same options and seed give the same run, bit for bit, and
+the clock jumps from one event to the next instead of waiting for it.
+
+	Each direction of the link is a FIFO with a rate (every packet takes
+len * 8 / rate to be sent), a propagation delay, and a queue of the packets
+waiting to be sent, of limited size: when it is full, the packet is dropped
+(tail drop). Losses, corruption, duplicates and reordering still come from the
+impairment emulator (impair.h), which is seeded with --seed.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#define SIM_START_NS 1000000000ULL /* Virtual date when the simulation starts: 0 means "not set" in many places */
+#define SIM_NEVER UINT64_MAX
+
+struct sim_config
+{
+	uint64_t rate;	   /* Bits per second of each direction, 0: unlimited */
+	uint64_t delay;	   /* Propagation delay, ns */
+	int queue;		   /* Packets of mtu bytes that can wait to be sent on each direction */
+	uint64_t duration; /* Virtual time simulated, ns */
+	size_t mtu;		   /* Largest datagram */
+};
+
+/*
+	Runs endpoint(arg[0]) and endpoint(arg[1]), end 0 and end 1, until
+cfg->duration of virtual time went by, nothing is left to happen, or one of them
+returns, or *running is cleared. Then *running is cleared and every end that is
+still waiting gets the turn back, in order, so that it can finish; sim_run
+returns once both did.
+*/
+void sim_run(const struct sim_config *cfg, void *(*endpoint)(void *), void *arg[2], volatile sig_atomic_t *running);
+
+/* clock_gettime on the virtual clock (all the clocks are the same one) */
+int sim_clock_gettime(clockid_t clock, struct timespec *ts);
+
+/* Gives the turn back until the virtual date deadline (0: now, SIM_NEVER: no date) or until a packet arrives */
+void sim_wait(uint64_t deadline);
+
+/* Non-zero if packets arrived at the calling end */
+int sim_readable(void);
+
+/* sendmmsg of the calling end (never blocks: a full queue drops). Every message is a datagram, msg_name is not used */
+int sim_sendmmsg(struct mmsghdr *msgs, unsigned int n);
+
+/* recvmmsg of the calling end: the packets that arrived, with "from" as their source. -1 (EAGAIN) if none */
+int sim_recvmmsg(struct mmsghdr *msgs, unsigned int n, const struct sockaddr_storage *from);
+
+#endif /* SIM_H */
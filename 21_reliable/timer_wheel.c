@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_TICK_NS (1ULL << TW_TICK_SHIFT)
+#define TW_HORIZON (1ULL << (TW_LEVEL_BITS * TW_LEVELS)) /* Ticks covered by the whole wheel */
+
+void tw_init(struct timer_wheel *tw, uint64_t now_ns)
+{
+	int i;
+
+	tw->current = now_ns >> TW_TICK_SHIFT;
+	for (i = 0; i < TW_LEVELS * TW_SLOTS; i++)
+		tw->slots[i] = -1;
+	tw->nodes = NULL;
+	tw->nnodes = 0;
+	tw->active = 0;
+}
+
+/* Makes room for timer id; nodes only grow, so this only allocates the first time an id is used */
+static void tw_reserve(struct timer_wheel *tw, int id)
+{
+	int n, i;
+
+	if (id < tw->nnodes)
+		return;
+	n = tw->nnodes ? tw->nnodes : 16;
+	while (n <= id)
+		n *= 2;
+	tw->nodes = realloc(tw->nodes, n * sizeof(*tw->nodes));
+	if (!tw->nodes)
+	{
+		fprintf(stderr, "timer wheel: out of memory allocating %d timers\n", n);
+		abort();
+	}
+	for (i = tw->nnodes; i < n; i++)
+		tw->nodes[i].slot = -1;
+	tw->nnodes = n;
+}
+
+/* Slot where a timer expiring at tick "expires" (>= current) must be stored */
+static int32_t tw_slot_for(const struct timer_wheel *tw, uint64_t expires)
+{
+	uint64_t delta = expires - tw->current;
+	int level;
+
+	if (delta >= TW_HORIZON)
+	{ // Beyond the wheel: park it in the farthest top-level slot, it is re-filed when cascaded
+		expires = tw->current + TW_HORIZON - 1;
+		delta = TW_HORIZON - 1;
+	}
+	for (level = 0; delta >= (1ULL << (TW_LEVEL_BITS * (level + 1))); level++)
+		;
+	return level * TW_SLOTS + ((expires >> (TW_LEVEL_BITS * level)) & TW_MASK);
+}
+
+static void tw_link(struct timer_wheel *tw, int32_t id, int32_t slot)
+{
+	struct tw_node *n = &tw->nodes[id];
+
+	n->slot = slot;
+	n->prev = -1;
+	n->next = tw->slots[slot];
+	if (n->next >= 0)
+		tw->nodes[n->next].prev = id;
+	tw->slots[slot] = id;
+}
+
+static void tw_unlink(struct timer_wheel *tw, int32_t id)
+{
+	struct tw_node *n = &tw->nodes[id];
+
+	if (n->prev >= 0)
+		tw->nodes[n->prev].next = n->next;
+	else
+		tw->slots[n->slot] = n->next;
+	if (n->next >= 0)
+		tw->nodes[n->next].prev = n->prev;
+	n->slot = -1;
+}
+
+int tw_set(struct timer_wheel *tw, int id, uint64_t expires_ns)
+{
+	struct tw_node *n;
+	uint64_t expires;
+	int was_set;
+
+	tw_reserve(tw, id);
+	n = &tw->nodes[id];
+	was_set = n->slot >= 0;
+	if (was_set)
+		tw_unlink(tw, id);
+	else
+		tw->active++;
+
+	// Round up, so that a timer never fires before its date
+	expires = (expires_ns + TW_TICK_NS - 1) >> TW_TICK_SHIFT;
+	if (expires < tw->current)
+		expires = tw->current;
+	n->expires = expires;
+	n->expires_ns = expires_ns;
+	tw_link(tw, id, tw_slot_for(tw, expires));
+	return was_set;
+}
+
+int tw_clear(struct timer_wheel *tw, int id)
+{
+	if (id >= tw->nnodes || tw->nodes[id].slot < 0)
+		return 0;
+	tw_unlink(tw, id);
+	tw->active--;
+	return 1;
+}
+
+int tw_pending(const struct timer_wheel *tw, int id, uint64_t *expires_ns)
+{
+	if (id >= tw->nnodes || tw->nodes[id].slot < 0)
+		return 0;
+	*expires_ns = tw->nodes[id].expires_ns;
+	return 1;
+}
+
+/* Moves the timers of the current slot of "level" to the levels below */
+static void tw_cascade(struct timer_wheel *tw, int level)
+{
+	int32_t slot, id, next;
+
+	slot = level * TW_SLOTS + ((tw->current >> (TW_LEVEL_BITS * level)) & TW_MASK);
+	id = tw->slots[slot];
+	tw->slots[slot] = -1;
+	for (; id >= 0; id = next)
+	{
+		next = tw->nodes[id].next;
+		tw_link(tw, id, tw_slot_for(tw, tw->nodes[id].expires));
+	}
+}
+
+int tw_expire(struct timer_wheel *tw, uint64_t now_ns)
+{
+	uint64_t target = now_ns >> TW_TICK_SHIFT;
+	int32_t id;
+	int level;
+
+	for (;;)
+	{
+		if (tw->active == 0)
+		{ // Nothing can be due: jump straight to the present
+			if (tw->current < target)
+				tw->current = target;
+			return -1;
+		}
+		id = tw->slots[tw->current & TW_MASK];
+		if (id >= 0)
+		{
+			tw_unlink(tw, id);
+			tw->active--;
+			return id;
+		}
+		if (tw->current >= target)
+			return -1;
+		tw->current++;
+		for (level = 1; level < TW_LEVELS && ((tw->current >> (TW_LEVEL_BITS * (level - 1))) & TW_MASK) == 0; level++)
+			tw_cascade(tw, level);
+	}
+}
+
+int tw_next_expiry(const struct timer_wheel *tw, uint64_t *when_ns)
+{
+	uint64_t next, block;
+	int level, k, shift;
+
+	if (tw->active == 0)
+		return 0;
+	next = UINT64_MAX;
+	for (k = 0; k < TW_SLOTS; k++)
+	{ // Level 0: a non-empty slot is due exactly at its tick
+		if (tw->slots[(tw->current + k) & TW_MASK] >= 0)
+		{
+			next = tw->current + k;
+			break;
+		}
+	}
+	for (level = 1; level < TW_LEVELS; level++)
+	{ // Upper levels: the first non-empty slot ahead is cascaded when the level below wraps into it. The
+	  // farthest one (k == TW_SLOTS) is the slot of the current block again, reached after a full turn
+		shift = TW_LEVEL_BITS * level;
+		for (k = 1; k <= TW_SLOTS; k++)
+		{
+			block = (tw->current >> shift) + k;
+			if ((block << shift) >= next)
+				break;
+			if (tw->slots[level * TW_SLOTS + (block & TW_MASK)] >= 0)
+			{
+				next = block << shift;
+				break;
+			}
+		}
+	}
+	if (next == UINT64_MAX)
+		next = (tw->current | TW_MASK) + 1; // Not found (should not happen): look again once level 1 cascades
+	*when_ns = next << TW_TICK_SHIFT;
+	return 1;
+}
@@ -0,0 +1,67 @@
+#include <stdint.h>
+
+/*
+	Hierarchical timing wheel used by the runtime to implement SET_TIMER and
+CLEAR_TIMER. Time is measured in ticks of 2^TW_TICK_SHIFT ns (~16 us). There
+are TW_LEVELS levels of TW_SLOTS slots; level L holds the timers expiring
+between 2^(8L) and 2^(8(L+1)) ticks from now, and its slots are cascaded into
+the level below as time advances.
+
+	Timers are identified by a non-negative integer (the timer_number of the
+API). Arming and cancelling a timer is O(1); expiring is proportional to the
+number of due timers (plus one step per elapsed tick while timers are active).
+Nodes are linked by index, not by pointer, so the node array can grow.
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define TW_TICK_SHIFT 14
+#define TW_LEVEL_BITS 8
+#define TW_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_LEVELS 4
+
+struct tw_node
+{
+	int32_t next, prev;	  /* Links within the slot list, -1 terminates */
+	int32_t slot;		  /* Index into the slots array, -1 if the timer is not set */
+	uint64_t expires;	  /* Expiration tick */
+	uint64_t expires_ns;  /* Exact expiration date, in ns */
+};
+
+struct timer_wheel
+{
+	uint64_t current;					   /* All timers expiring at ticks < current have fired */
+	int32_t slots[TW_LEVELS * TW_SLOTS];   /* Head of each slot list, -1 if empty */
+	struct tw_node *nodes;
+	int nnodes;	 /* Allocated nodes */
+	int active;	 /* Timers currently set */
+};
+
+/* Initializes an empty wheel whose current time is now_ns */
+void tw_init(struct timer_wheel *tw, uint64_t now_ns);
+
+/* Arms (or re-arms) timer id to expire at expires_ns. Returns 1 if it was already set, 0 otherwise */
+int tw_set(struct timer_wheel *tw, int id, uint64_t expires_ns);
+
+/* Cancels timer id. Returns 1 if it was set, 0 otherwise */
+int tw_clear(struct timer_wheel *tw, int id);
+
+/* Returns 1 if timer id is set, and stores its expiration date in *expires_ns */
+int tw_pending(const struct timer_wheel *tw, int id, uint64_t *expires_ns);
+
+/*
+	Advances the wheel up to now_ns and returns the id of one expired timer,
+which is unset before returning, or -1 when no more timers are due. Call it in a
+loop; timers may be set or cleared between calls.
+*/
+int tw_expire(struct timer_wheel *tw, uint64_t now_ns);
+
+/*
+	Returns 1 and stores in *when_ns the date at which tw_expire has work to do
+(a timer is due, or a slot must be cascaded), or 0 if no timer is set. It is a
+lower bound of the next expiration, so it is safe to sleep until that date.
+*/
+int tw_next_expiry(const struct timer_wheel *tw, uint64_t *when_ns);
+
+#endif /* TIMER_WHEEL_H */